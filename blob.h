@@ -0,0 +1,162 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.h"
+#include "mesh.h"
+
+// The welded mesh and its BVH in one POSIX shared memory object, written once by a publisher and mapped read-only
+// by any number of renderer processes. Arrays are found through offsets from the start of the object rather than
+// pointers, so every process can map it at a different address. The pages are shared between all processes that
+// map it, and attaching costs a map instead of loading, welding and building.
+
+#define SCENE_BLOB_MAGIC 0x43534257u
+#define SCENE_BLOB_ALIGNMENT 64
+
+typedef struct {
+    uint32_t magic;
+    uint32_t header_size;
+    uint64_t size;
+    uint64_t num_unique_vertices;
+    uint64_t num_tris;
+    uint64_t num_degenerate_tris;
+    uint64_t num_duplicate_tris;
+    uint64_t num_nodes;
+    uint64_t num_prims;
+    aabb_t bounds;
+    // Byte offsets from the start of the object
+    uint64_t vertices_offset;
+    uint64_t indices_offset;
+    uint64_t nodes_offset;
+    uint64_t prim_indices_offset;
+} scene_blob_header_t;
+
+typedef struct {
+    const uint8_t *memory;
+    size_t size;
+    // Views into the mapping, neither may be written or freed
+    mesh_t mesh;
+    bvh_t bvh;
+} scene_blob_t;
+
+static uint64_t scene_blob_align(uint64_t offset) {
+    return (offset + SCENE_BLOB_ALIGNMENT - 1) / SCENE_BLOB_ALIGNMENT * SCENE_BLOB_ALIGNMENT;
+}
+
+//@param name POSIX shared memory object name, e.g. "/wonderbox-scene", replaced if it exists
+static bool scene_blob_publish(const char *name, const mesh_t *mesh, const bvh_t *bvh) {
+    scene_blob_header_t header = {
+            .header_size = sizeof(scene_blob_header_t),
+            .num_unique_vertices = mesh->num_unique_vertices,
+            .num_tris = mesh->num_tris,
+            .num_degenerate_tris = mesh->num_degenerate_tris,
+            .num_duplicate_tris = mesh->num_duplicate_tris,
+            .num_nodes = bvh->num_nodes,
+            .num_prims = bvh->num_prims,
+            .bounds = mesh->bounds,
+    };
+    header.vertices_offset = scene_blob_align(sizeof(scene_blob_header_t));
+    header.indices_offset = scene_blob_align(header.vertices_offset + mesh->num_unique_vertices * sizeof(vec3_t));
+    header.nodes_offset = scene_blob_align(header.indices_offset + mesh->num_tris * 3 * sizeof(uint32_t));
+    header.prim_indices_offset = scene_blob_align(header.nodes_offset + bvh->num_nodes * sizeof(bvh_node_t));
+    header.size = header.prim_indices_offset + bvh->num_prims * sizeof(uint32_t);
+
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        puts("Failed to create shared memory");
+        return false;
+    }
+    void *memory = ftruncate(fd, (off_t) header.size) == 0
+                           ? mmap(NULL, header.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        puts("Failed to map shared memory");
+        shm_unlink(name);
+        return false;
+    }
+    uint8_t *base = memory;
+    memcpy(base + header.vertices_offset, mesh->unique_vertices, mesh->num_unique_vertices * sizeof(vec3_t));
+    memcpy(base + header.indices_offset, mesh->indices, mesh->num_tris * 3 * sizeof(uint32_t));
+    memcpy(base + header.nodes_offset, bvh->nodes, bvh->num_nodes * sizeof(bvh_node_t));
+    memcpy(base + header.prim_indices_offset, bvh->prim_indices, bvh->num_prims * sizeof(uint32_t));
+    // The magic goes in last, an object that is still being written is rejected by attaching processes
+    memcpy(base, &header, sizeof(header));
+    __atomic_store_n((uint32_t *) base, SCENE_BLOB_MAGIC, __ATOMIC_RELEASE);
+    munmap(memory, header.size);
+    return true;
+}
+
+static bool scene_blob_unpublish(const char *name) {
+    if (shm_unlink(name) != 0) {
+        puts("Failed to remove shared memory");
+        return false;
+    }
+    return true;
+}
+
+static bool scene_blob_array_fits(const scene_blob_header_t *header, uint64_t offset, uint64_t count, size_t size) {
+    return offset <= header->size && count <= (header->size - offset) / size;
+}
+
+static void scene_blob_detach(scene_blob_t *blob) {
+    if (blob->memory != NULL) munmap((void *) blob->memory, blob->size);
+    *blob = (scene_blob_t) {0};
+}
+
+static bool scene_blob_attach(scene_blob_t *blob, const char *name) {
+    *blob = (scene_blob_t) {0};
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        puts("Failed to open shared memory");
+        return false;
+    }
+    struct stat info;
+    void *memory = fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(scene_blob_header_t)
+                           ? mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        puts("Failed to map shared memory");
+        return false;
+    }
+    blob->memory = memory;
+    blob->size = (size_t) info.st_size;
+    // The header is only read once the magic shows that the publisher has finished writing it
+    scene_blob_header_t header;
+    bool published = __atomic_load_n((const uint32_t *) memory, __ATOMIC_ACQUIRE) == SCENE_BLOB_MAGIC;
+    if (published) memcpy(&header, memory, sizeof(header));
+    if (!published || header.header_size != sizeof(scene_blob_header_t) || header.size > blob->size ||
+        !scene_blob_array_fits(&header, header.vertices_offset, header.num_unique_vertices, sizeof(vec3_t)) ||
+        !scene_blob_array_fits(&header, header.indices_offset, header.num_tris, 3 * sizeof(uint32_t)) ||
+        !scene_blob_array_fits(&header, header.nodes_offset, header.num_nodes, sizeof(bvh_node_t)) ||
+        !scene_blob_array_fits(&header, header.prim_indices_offset, header.num_prims, sizeof(uint32_t))) {
+        puts("Failed to read scene from shared memory");
+        scene_blob_detach(blob);
+        return false;
+    }
+    blob->mesh = (mesh_t) {
+            .unique_vertices = (vec3_t *) (blob->memory + header.vertices_offset),
+            .num_unique_vertices = header.num_unique_vertices,
+            .indices = (uint32_t *) (blob->memory + header.indices_offset),
+            .num_tris = header.num_tris,
+            .bounds = header.bounds,
+            .num_degenerate_tris = header.num_degenerate_tris,
+            .num_duplicate_tris = header.num_duplicate_tris,
+    };
+    blob->bvh = (bvh_t) {
+            .nodes = (bvh_node_t *) (blob->memory + header.nodes_offset),
+            .num_nodes = header.num_nodes,
+            .prim_indices = (uint32_t *) (blob->memory + header.prim_indices_offset),
+            .num_prims = header.num_prims,
+    };
+    return true;
+}
@@ -0,0 +1,451 @@
+#pragma once
+
+#include <float.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mesh.h"
+#include "vec3.h"
+
+#define BVH_NUM_BINS 16
+#define BVH_MAX_LEAF_SIZE 8
+#define BVH_STACK_SIZE 64
+#define BVH_CACHE_LINE_SIZE 64
+
+// Children of an inner node are stored next to each other at left_first and left_first + 1,
+// leaves reference count primitives starting at prim_indices[left_first]
+typedef struct {
+    vec3_t bounds_min;
+    uint32_t left_first;
+    vec3_t bounds_max;
+    uint32_t count;
+} bvh_node_t;
+
+typedef struct {
+    bvh_node_t *nodes;
+    size_t num_nodes;
+    uint32_t *prim_indices;
+    size_t num_prims;
+} bvh_t;
+
+// Orders of the nodes in memory, the tree itself stays the same
+typedef enum {
+    // As built, every subtree follows its parent depth first
+    BVH_LAYOUT_DEPTH_FIRST,
+    // Sibling pairs in van Emde Boas order, one cache line each
+    BVH_LAYOUT_VAN_EMDE_BOAS,
+} bvh_layout_t;
+
+typedef struct {
+    float t;
+    uint32_t triangle_index;
+    float u;
+    float v;
+} ray_hit_t;
+
+static aabb_t bvh_node_bounds(const bvh_node_t *node) {
+    return (aabb_t) {node->bounds_min, node->bounds_max};
+}
+
+static void bvh_free(bvh_t *bvh) {
+    free(bvh->nodes);
+    free(bvh->prim_indices);
+    *bvh = (bvh_t) {0};
+}
+
+static size_t bvh_memory_size(const bvh_t *bvh) {
+    return bvh->num_nodes * sizeof(bvh_node_t) + bvh->num_prims * sizeof(uint32_t);
+}
+
+// Traversals keep at most one postponed sibling per level plus the two children of the current node on their
+// stacks, nodes at depth BVH_STACK_SIZE - 1 stay leaves however many primitives they hold so those cannot overflow
+static void bvh_subdivide(bvh_t *bvh, uint32_t node_index, const aabb_t *prim_bounds, const vec3_t *centroids,
+                          uint32_t max_leaf_size, uint32_t depth) {
+    bvh_node_t *node = bvh->nodes + node_index;
+    uint32_t first = node->left_first, count = node->count;
+    if ((count <= 2 && count <= max_leaf_size) || depth + 1 >= BVH_STACK_SIZE) return;
+
+    aabb_t centroid_bounds = aabb_empty();
+    for (uint32_t i = first; i < first + count; i++) {
+        centroid_bounds = aabb_grow(centroid_bounds, centroids[bvh->prim_indices[i]]);
+    }
+
+    // Binned SAH over all three axes
+    float best_cost = FLT_MAX;
+    int best_axis = -1, best_split = 0;
+    for (int axis = 0; axis < 3; axis++) {
+        float axis_min = vec3_component(centroid_bounds.min, axis);
+        float axis_max = vec3_component(centroid_bounds.max, axis);
+        if (axis_max <= axis_min) continue;
+
+        aabb_t bin_bounds[BVH_NUM_BINS];
+        uint32_t bin_counts[BVH_NUM_BINS] = {0};
+        for (int b = 0; b < BVH_NUM_BINS; b++) bin_bounds[b] = aabb_empty();
+        float scale = BVH_NUM_BINS / (axis_max - axis_min);
+        for (uint32_t i = first; i < first + count; i++) {
+            uint32_t prim = bvh->prim_indices[i];
+            int b = (int) ((vec3_component(centroids[prim], axis) - axis_min) * scale);
+            // Non-finite centroids, e.g. of empty bounds, convert to INT_MIN
+            if (b < 0) b = 0;
+            if (b > BVH_NUM_BINS - 1) b = BVH_NUM_BINS - 1;
+            bin_counts[b]++;
+            bin_bounds[b] = aabb_union(bin_bounds[b], prim_bounds[prim]);
+        }
+
+        float left_area[BVH_NUM_BINS - 1];
+        uint32_t left_count[BVH_NUM_BINS - 1];
+        aabb_t box = aabb_empty();
+        uint32_t sum = 0;
+        for (int b = 0; b < BVH_NUM_BINS - 1; b++) {
+            sum += bin_counts[b];
+            box = aabb_union(box, bin_bounds[b]);
+            left_count[b] = sum;
+            left_area[b] = aabb_surface_area(box);
+        }
+        box = aabb_empty();
+        sum = 0;
+        for (int b = BVH_NUM_BINS - 1; b > 0; b--) {
+            sum += bin_counts[b];
+            box = aabb_union(box, bin_bounds[b]);
+            float cost = (float) left_count[b - 1] * left_area[b - 1] + (float) sum * aabb_surface_area(box);
+            if (left_count[b - 1] > 0 && sum > 0 && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b;
+            }
+        }
+    }
+    if (best_axis < 0) return;
+
+    // Compare against the cost of keeping a leaf, both relative to the parent area
+    float leaf_cost = (float) count * aabb_surface_area(bvh_node_bounds(node));
+    if (best_cost >= leaf_cost && count <= max_leaf_size) return;
+
+    float axis_min = vec3_component(centroid_bounds.min, best_axis);
+    float scale = BVH_NUM_BINS / (vec3_component(centroid_bounds.max, best_axis) - axis_min);
+    uint32_t i = first, j = first + count - 1;
+    while (i <= j) {
+        int b = (int) ((vec3_component(centroids[bvh->prim_indices[i]], best_axis) - axis_min) * scale);
+        if (b < 0) b = 0;
+        if (b > BVH_NUM_BINS - 1) b = BVH_NUM_BINS - 1;
+        if (b < best_split) {
+            i++;
+        } else {
+            uint32_t tmp = bvh->prim_indices[i];
+            bvh->prim_indices[i] = bvh->prim_indices[j];
+            bvh->prim_indices[j] = tmp;
+            if (j == 0) break;
+            j--;
+        }
+    }
+    uint32_t left_count = i - first;
+    if (left_count == 0 || left_count == count) return;
+
+    uint32_t left_index = bvh->num_nodes;
+    bvh->num_nodes += 2;
+    bvh_node_t *children = bvh->nodes + left_index;
+    children[0].left_first = first;
+    children[0].count = left_count;
+    children[1].left_first = i;
+    children[1].count = count - left_count;
+    for (int c = 0; c < 2; c++) {
+        aabb_t box = aabb_empty();
+        for (uint32_t k = children[c].left_first; k < children[c].left_first + children[c].count; k++) {
+            box = aabb_union(box, prim_bounds[bvh->prim_indices[k]]);
+        }
+        children[c].bounds_min = box.min;
+        children[c].bounds_max = box.max;
+    }
+    node->left_first = left_index;
+    node->count = 0;
+
+    bvh_subdivide(bvh, left_index, prim_bounds, centroids, max_leaf_size, depth + 1);
+    bvh_subdivide(bvh, left_index + 1, prim_bounds, centroids, max_leaf_size, depth + 1);
+}
+
+// Builds a binned SAH BVH over arbitrary primitives given their bounds, leaves hold at most max_leaf_size
+// primitives unless they cannot be told apart. prim_indices of the result index into prim_bounds.
+static bool bvh_build_leaves(bvh_t *bvh, const aabb_t *prim_bounds, size_t num_prims, uint32_t max_leaf_size) {
+    *bvh = (bvh_t) {0};
+    size_t max_nodes = num_prims > 0 ? 2 * num_prims - 1 : 1;
+    bvh->nodes = malloc(max_nodes * sizeof(bvh_node_t));
+    bvh->prim_indices = malloc((num_prims > 0 ? num_prims : 1) * sizeof(uint32_t));
+    vec3_t *centroids = malloc((num_prims > 0 ? num_prims : 1) * sizeof(vec3_t));
+    if (bvh->nodes == NULL || bvh->prim_indices == NULL || centroids == NULL) {
+        free(centroids);
+        bvh_free(bvh);
+        return false;
+    }
+    bvh->num_prims = num_prims;
+
+    aabb_t root_bounds = aabb_empty();
+    for (size_t i = 0; i < num_prims; i++) {
+        bvh->prim_indices[i] = i;
+        centroids[i] = aabb_center(prim_bounds[i]);
+        root_bounds = aabb_union(root_bounds, prim_bounds[i]);
+    }
+    bvh->nodes[0] = (bvh_node_t) {root_bounds.min, 0, root_bounds.max, num_prims};
+    bvh->num_nodes = 1;
+    bvh_subdivide(bvh, 0, prim_bounds, centroids, max_leaf_size, 0);
+    free(centroids);
+    return true;
+}
+
+static bool bvh_build(bvh_t *bvh, const aabb_t *prim_bounds, size_t num_prims) {
+    return bvh_build_leaves(bvh, prim_bounds, num_prims, BVH_MAX_LEAF_SIZE);
+}
+
+// Builds a BVH over the triangles [first_tri, first_tri + num_tris) of a mesh,
+// prim_indices of the result are mesh triangle indices
+static bool bvh_build_mesh(bvh_t *bvh, const mesh_t *mesh, size_t first_tri, size_t num_tris) {
+    // The empty BVH is a root without primitives, it has no bounds to read
+    if (num_tris == 0) return bvh_build(bvh, NULL, 0);
+    aabb_t *prim_bounds = malloc(num_tris * sizeof(aabb_t));
+    if (prim_bounds == NULL) return false;
+    for (size_t i = 0; i < num_tris; i++) {
+        vec3_t a, b, c;
+        mesh_triangle(mesh, first_tri + i, &a, &b, &c);
+        prim_bounds[i] = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), a), b), c);
+    }
+    bool ok = bvh_build(bvh, prim_bounds, num_tris);
+    free(prim_bounds);
+    if (!ok) return false;
+    for (size_t i = 0; i < num_tris; i++) {
+        bvh->prim_indices[i] += first_tri;
+    }
+    return true;
+}
+
+// Builds a BVH over an arbitrary list of mesh triangles, prim_indices of the result are mesh triangle indices
+static bool bvh_build_mesh_triangles(bvh_t *bvh, const mesh_t *mesh, const uint32_t *triangle_indices,
+                                     size_t num_tris) {
+    if (num_tris == 0) return bvh_build(bvh, NULL, 0);
+    aabb_t *prim_bounds = malloc(num_tris * sizeof(aabb_t));
+    if (prim_bounds == NULL) return false;
+    for (size_t i = 0; i < num_tris; i++) {
+        vec3_t a, b, c;
+        mesh_triangle(mesh, triangle_indices[i], &a, &b, &c);
+        prim_bounds[i] = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), a), b), c);
+    }
+    bool ok = bvh_build(bvh, prim_bounds, num_tris);
+    free(prim_bounds);
+    if (!ok) return false;
+    for (size_t i = 0; i < num_tris; i++) {
+        bvh->prim_indices[i] = triangle_indices[bvh->prim_indices[i]];
+    }
+    return true;
+}
+
+static bool bvh_copy(bvh_t *copy, const bvh_t *bvh) {
+    *copy = (bvh_t) {0};
+    copy->nodes = malloc((bvh->num_nodes > 0 ? bvh->num_nodes : 1) * sizeof(bvh_node_t));
+    copy->prim_indices = malloc((bvh->num_prims > 0 ? bvh->num_prims : 1) * sizeof(uint32_t));
+    if (copy->nodes == NULL || copy->prim_indices == NULL) {
+        bvh_free(copy);
+        return false;
+    }
+    memcpy(copy->nodes, bvh->nodes, bvh->num_nodes * sizeof(bvh_node_t));
+    memcpy(copy->prim_indices, bvh->prim_indices, bvh->num_prims * sizeof(uint32_t));
+    copy->num_nodes = bvh->num_nodes;
+    copy->num_prims = bvh->num_prims;
+    return true;
+}
+
+typedef struct {
+    const bvh_node_t *nodes;
+    // Height of the subtree below each inner node counted in sibling pairs
+    uint16_t *heights;
+    uint32_t *new_indices;
+    uint32_t next_index;
+} bvh_layout_state_t;
+
+static uint16_t bvh_layout_measure(bvh_layout_state_t *state, uint32_t node_index) {
+    const bvh_node_t *node = state->nodes + node_index;
+    if (node->count > 0) return 0;
+    uint16_t left = bvh_layout_measure(state, node->left_first);
+    uint16_t right = bvh_layout_measure(state, node->left_first + 1);
+    state->heights[node_index] = 1 + (left > right ? left : right);
+    return state->heights[node_index];
+}
+
+static void bvh_layout_van_emde_boas_pairs(bvh_layout_state_t *state, uint32_t parent, int num_levels);
+
+// Lays out the treelets whose root pairs are depth pairs below the children of parent
+static void bvh_layout_bottom_treelets(bvh_layout_state_t *state, uint32_t parent, int depth, int num_levels) {
+    uint32_t left = state->nodes[parent].left_first;
+    for (uint32_t child = left; child <= left + 1; child++) {
+        if (state->nodes[child].count > 0) continue;
+        if (depth == 1) {
+            bvh_layout_van_emde_boas_pairs(state, child, num_levels);
+        } else {
+            bvh_layout_bottom_treelets(state, child, depth - 1, num_levels);
+        }
+    }
+}
+
+// Lays out the sibling pairs of the first num_levels levels below the inner node parent: the top half of the
+// levels first, then each treelet hanging below it, both recursively. Whatever the size of a cache line or page,
+// the treelets of about that size end up contiguous, so a traversal touches few of them on its way down.
+static void bvh_layout_van_emde_boas_pairs(bvh_layout_state_t *state, uint32_t parent, int num_levels) {
+    int height = state->heights[parent] < num_levels ? state->heights[parent] : num_levels;
+    if (height == 1) {
+        uint32_t left = state->nodes[parent].left_first;
+        state->new_indices[left] = state->next_index;
+        state->new_indices[left + 1] = state->next_index + 1;
+        state->next_index += 2;
+        return;
+    }
+    int top = height / 2;
+    bvh_layout_van_emde_boas_pairs(state, parent, top);
+    bvh_layout_bottom_treelets(state, parent, top, height - top);
+}
+
+// Reorders the nodes of a built BVH in place, traversal gives the same results in any layout.
+// The van Emde Boas layout keeps the root at index 0 and leaves index 1 unused so that every sibling pair,
+// which traversal always tests together, fills exactly one cache line.
+static bool bvh_apply_layout(bvh_t *bvh, bvh_layout_t layout) {
+    if (layout == BVH_LAYOUT_DEPTH_FIRST || bvh->num_nodes < 3) return true;
+    size_t num_nodes = bvh->num_nodes + 1;
+    size_t size = (num_nodes * sizeof(bvh_node_t) + BVH_CACHE_LINE_SIZE - 1) / BVH_CACHE_LINE_SIZE *
+                  BVH_CACHE_LINE_SIZE;
+    bvh_node_t *nodes = aligned_alloc(BVH_CACHE_LINE_SIZE, size);
+    bvh_layout_state_t state = {.nodes = bvh->nodes, .next_index = 2};
+    state.heights = malloc(bvh->num_nodes * sizeof(uint16_t));
+    state.new_indices = malloc(bvh->num_nodes * sizeof(uint32_t));
+    if (nodes == NULL || state.heights == NULL || state.new_indices == NULL) {
+        free(nodes);
+        free(state.heights);
+        free(state.new_indices);
+        return false;
+    }
+    bvh_layout_measure(&state, 0);
+    bvh_layout_van_emde_boas_pairs(&state, 0, state.heights[0]);
+    state.new_indices[0] = 0;
+    nodes[1] = (bvh_node_t) {0};
+    for (size_t i = 0; i < bvh->num_nodes; i++) {
+        bvh_node_t node = bvh->nodes[i];
+        if (node.count == 0) node.left_first = state.new_indices[node.left_first];
+        nodes[state.new_indices[i]] = node;
+    }
+    free(state.heights);
+    free(state.new_indices);
+    free(bvh->nodes);
+    bvh->nodes = nodes;
+    bvh->num_nodes = num_nodes;
+    return true;
+}
+
+// Möller–Trumbore
+static bool ray_triangle_intersection(ray_t r, vec3_t a, vec3_t b, vec3_t c, float *t, float *u, float *v) {
+    vec3_t edge1 = vec3_sub(b, a);
+    vec3_t edge2 = vec3_sub(c, a);
+    vec3_t p = vec3_cross(r.direction, edge2);
+    float det = vec3_dot(edge1, p);
+    if (fabsf(det) < 1e-12f) return false;
+    float inv_det = 1.0f / det;
+    vec3_t s = vec3_sub(r.origin, a);
+    *u = vec3_dot(s, p) * inv_det;
+    if (*u < 0.0f || *u > 1.0f) return false;
+    vec3_t q = vec3_cross(s, edge1);
+    *v = vec3_dot(r.direction, q) * inv_det;
+    if (*v < 0.0f || *u + *v > 1.0f) return false;
+    *t = vec3_dot(edge2, q) * inv_det;
+    return *t > 0.0f;
+}
+
+// Finds the closest triangle hit closer than hit->t, hit->t must be initialized by the caller.
+// Adds the number of visited nodes to num_steps, a tighter initial hit->t visits fewer.
+static bool bvh_intersect_counted(const bvh_t *bvh, const mesh_t *mesh, ray_t ray, ray_hit_t *hit,
+                                  uint32_t *num_steps) {
+    if (bvh->num_prims == 0) return false;
+    vec3_t inv_direction = vec3_inverse(ray.direction);
+    float t_near, t_far;
+    if (!ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes), hit->t, &t_near, &t_far)) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = 0;
+    uint32_t steps = 0;
+    while (true) {
+        const bvh_node_t *node = bvh->nodes + node_index;
+        steps++;
+        if (node->count > 0) {
+            for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+                uint32_t triangle_index = bvh->prim_indices[i];
+                vec3_t a, b, c;
+                mesh_triangle(mesh, triangle_index, &a, &b, &c);
+                float t, u, v;
+                if (ray_triangle_intersection(ray, a, b, c, &t, &u, &v) && t < hit->t) {
+                    *hit = (ray_hit_t) {t, triangle_index, u, v};
+                    found = true;
+                }
+            }
+        } else {
+            // Visit the nearer child first, postpone the other one
+            uint32_t left = node->left_first, right = left + 1;
+            float t_left, t_right, t_unused;
+            bool hit_left = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + left),
+                                                  hit->t, &t_left, &t_unused);
+            bool hit_right = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + right),
+                                                   hit->t, &t_right, &t_unused);
+            if (hit_left && hit_right) {
+                if (t_right < t_left) {
+                    uint32_t tmp = left;
+                    left = right;
+                    right = tmp;
+                }
+                stack[stack_size++] = right;
+                node_index = left;
+                continue;
+            } else if (hit_left) {
+                node_index = left;
+                continue;
+            } else if (hit_right) {
+                node_index = right;
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        node_index = stack[--stack_size];
+    }
+    *num_steps += steps;
+    return found;
+}
+
+static bool bvh_intersect(const bvh_t *bvh, const mesh_t *mesh, ray_t ray, ray_hit_t *hit) {
+    uint32_t num_steps = 0;
+    return bvh_intersect_counted(bvh, mesh, ray, hit, &num_steps);
+}
+
+// True if any triangle is hit closer than t_max, stops at the first one found
+static bool bvh_occluded(const bvh_t *bvh, const mesh_t *mesh, ray_t ray, float t_max) {
+    if (bvh->num_prims == 0) return false;
+    vec3_t inv_direction = vec3_inverse(ray.direction);
+    float t_near, t_far;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+        const bvh_node_t *node = bvh->nodes + stack[--stack_size];
+        if (!ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(node), t_max, &t_near, &t_far)) {
+            continue;
+        }
+        if (node->count > 0) {
+            for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+                vec3_t a, b, c;
+                mesh_triangle(mesh, bvh->prim_indices[i], &a, &b, &c);
+                float t, u, v;
+                if (ray_triangle_intersection(ray, a, b, c, &t, &u, &v) && t < t_max) return true;
+            }
+        } else {
+            stack[stack_size++] = node->left_first + 1;
+            stack[stack_size++] = node->left_first;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <math.h>
+
+#include "vec3.h"
+
+typedef struct {
+    vec3_t origin;
+    vec3_t forward;
+    vec3_t right;
+    vec3_t up;
+} camera_t;
+
+// Looks down -Z at the bounds from far enough away to fit their bounding sphere
+static camera_t camera_frame_bounds(aabb_t bounds) {
+    vec3_t center = aabb_center(bounds);
+    float radius = 0.5f * vec3_length(vec3_sub(bounds.max, bounds.min));
+    camera_t camera;
+    camera.forward = (vec3_t) {0, 0, -1};
+    camera.right = (vec3_t) {1, 0, 0};
+    camera.up = (vec3_t) {0, 1, 0};
+    // Image plane spans [-1, 1] vertically at unit distance, i.e. a 90 degree vertical field of view
+    camera.origin = vec3_add(center, (vec3_t) {0, 0, radius * 1.6f});
+    return camera;
+}
+
+// world_up must not be parallel to the view direction
+static camera_t camera_look_at(vec3_t origin, vec3_t target, vec3_t world_up) {
+    camera_t camera;
+    camera.origin = origin;
+    camera.forward = vec3_normalized(vec3_sub(target, origin));
+    camera.right = vec3_normalized(vec3_cross(camera.forward, world_up));
+    camera.up = vec3_cross(camera.right, camera.forward);
+    return camera;
+}
+
+// Orbits the bounds around the Y axis at the framing distance of camera_frame_bounds, slightly from above,
+// t in [0, 1) is one full turn starting at the view of camera_frame_bounds
+static camera_t camera_turntable(aabb_t bounds, float t) {
+    vec3_t center = aabb_center(bounds);
+    float radius = 0.5f * vec3_length(vec3_sub(bounds.max, bounds.min));
+    float angle = 2.0f * (float) M_PI * t;
+    vec3_t offset = {sinf(angle) * radius * 1.6f, radius * 0.4f, cosf(angle) * radius * 1.6f};
+    return camera_look_at(vec3_add(center, offset), center, (vec3_t) {0, 1, 0});
+}
+
+// Flies in from far away on a spiral, passes close over the surface of the bounding sphere and pulls back out,
+// t in [0, 1] covers the whole flight
+static camera_t camera_flythrough(aabb_t bounds, float t) {
+    vec3_t center = aabb_center(bounds);
+    float radius = 0.5f * vec3_length(vec3_sub(bounds.max, bounds.min));
+    float angle = (float) M_PI * (t - 0.5f);
+    // Distance shrinks from 3 radii to 1.1 radii at the middle of the flight and grows back
+    float distance = radius * (1.1f + 1.9f * (2.0f * t - 1.0f) * (2.0f * t - 1.0f));
+    vec3_t offset = {sinf(angle) * distance, radius * 0.3f, cosf(angle) * distance};
+    return camera_look_at(vec3_add(center, offset), center, (vec3_t) {0, 1, 0});
+}
+
+#define CAMERA_NUM_CANONICAL_VIEWS 26
+
+// Views from the 6 faces, 12 edges and 8 corners of a cube around the bounds, at the framing distance of
+// camera_frame_bounds, all looking at the center. index goes from 0 to CAMERA_NUM_CANONICAL_VIEWS - 1.
+static camera_t camera_canonical_view(aabb_t bounds, int index) {
+    // Skip the center of the 3x3x3 grid of directions
+    int cell = index < 13 ? index : index + 1;
+    vec3_t direction = {(float) (cell % 3 - 1), (float) (cell / 3 % 3 - 1), (float) (cell / 9 - 1)};
+    vec3_t center = aabb_center(bounds);
+    float radius = 0.5f * vec3_length(vec3_sub(bounds.max, bounds.min));
+    vec3_t origin = vec3_add(center, vec3_scale(vec3_normalized(direction), radius * 1.6f));
+    // Straight up or down views need another up direction
+    vec3_t world_up = direction.x == 0.0f && direction.z == 0.0f ? (vec3_t) {0, 0, -1} : (vec3_t) {0, 1, 0};
+    return camera_look_at(origin, center, world_up);
+}
+
+// Pixel rows grow downwards, pixel (0, 0) is the top left corner
+static ray_t camera_ray(const camera_t *camera, float i, float j, int width, int height) {
+    float x = i / (float) width;
+    float y = j / (float) height;
+    // Transform to NDC and correct aspect ratio
+    x = 2 * x - 1;
+    y = 1 - 2 * y;
+    x *= (float) width / (float) height;
+    ray_t ray;
+    ray.direction = vec3_normalized(
+            vec3_add(camera->forward, vec3_add(vec3_scale(camera->right, x), vec3_scale(camera->up, y))));
+    ray.origin = camera->origin;
+    return ray;
+}
+
+// Part of a frame_width x frame_height image, x, y, width and height are in frame pixels. Every frame pixel
+// becomes scale x scale output pixels, so the region renders into ceil(width * scale) x ceil(height * scale).
+typedef struct {
+    int frame_width;
+    int frame_height;
+    int x;
+    int y;
+    int width;
+    int height;
+    float scale;
+} camera_region_t;
+
+static camera_region_t camera_region_full(int width, int height) {
+    return (camera_region_t) {width, height, 0, 0, width, height, 1.0f};
+}
+
+static int camera_region_output_width(const camera_region_t *region) {
+    return (int) ceilf((float) region->width * region->scale);
+}
+
+static int camera_region_output_height(const camera_region_t *region) {
+    return (int) ceilf((float) region->height * region->scale);
+}
+
+// Ray through the center of output pixel (i, j) of the region, the same ray the whole frame would use there
+static ray_t camera_region_ray(const camera_t *camera, const camera_region_t *region, int i, int j) {
+    return camera_ray(camera, (float) region->x + ((float) i + 0.5f) / region->scale,
+                      (float) region->y + ((float) j + 0.5f) / region->scale, region->frame_width,
+                      region->frame_height);
+}
+
+// Rectangle in output pixels of a region, empty if min > max
+typedef struct {
+    float min_x;
+    float min_y;
+    float max_x;
+    float max_y;
+} camera_screen_rect_t;
+
+// Output pixel rectangle that contains every ray of the region hitting the bounds, from the projected corners.
+// Bounds reaching behind the camera plane cannot be projected and cover the whole region.
+static camera_screen_rect_t camera_project_bounds(const camera_t *camera, const camera_region_t *region,
+                                                  aabb_t bounds) {
+    camera_screen_rect_t rect = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+    // Inverse of camera_region_ray, see also splat_range
+    float scale = 0.5f * (float) region->frame_height * region->scale;
+    float offset_x = (0.5f * (float) region->frame_width - (float) region->x) * region->scale;
+    float offset_y = (0.5f * (float) region->frame_height - (float) region->y) * region->scale;
+    for (int corner = 0; corner < 8; corner++) {
+        vec3_t p = {corner & 1 ? bounds.max.x : bounds.min.x, corner & 2 ? bounds.max.y : bounds.min.y,
+                    corner & 4 ? bounds.max.z : bounds.min.z};
+        vec3_t d = vec3_sub(p, camera->origin);
+        float z = vec3_dot(d, camera->forward);
+        if (!(z > 0.0f)) {
+            return (camera_screen_rect_t) {-INFINITY, -INFINITY, INFINITY, INFINITY};
+        }
+        float x = vec3_dot(d, camera->right) / z * scale + offset_x;
+        float y = -vec3_dot(d, camera->up) / z * scale + offset_y;
+        rect.min_x = minf(rect.min_x, x);
+        rect.min_y = minf(rect.min_y, y);
+        rect.max_x = maxf(rect.max_x, x);
+        rect.max_y = maxf(rect.max_y, y);
+    }
+    return rect;
+}
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Splits a welded mesh into connected components (triangles connected through shared vertices).
+// Every component gets its own bounds and BVH, a top level BVH over the component bounds ties them together.
+
+typedef struct {
+    // The triangles of the component are triangle_indices[first, first + num_tris)
+    size_t first;
+    size_t num_tris;
+    size_t num_vertices;
+    aabb_t bounds;
+    bvh_t bvh;
+    // Rotation and translation invariant shape description, quantized so that copies of a part compare equal
+    float area;
+    float spread;
+    // First component with the same shape description, the component itself if there is none
+    uint32_t instance_of;
+} mesh_component_t;
+
+typedef struct {
+    mesh_component_t *components;
+    size_t num_components;
+    size_t num_unique_shapes;
+    uint32_t *triangle_indices;
+    // prim_indices index into components
+    bvh_t bvh;
+} mesh_components_t;
+
+// Lock free union-find, parents only ever move to smaller indices so concurrent links cannot form cycles
+// and the root of a set is its smallest element
+static uint32_t union_find_root(_Atomic uint32_t *parents, uint32_t x) {
+    while (true) {
+        uint32_t parent = atomic_load_explicit(parents + x, memory_order_relaxed);
+        if (parent == x) return x;
+        uint32_t grandparent = atomic_load_explicit(parents + parent, memory_order_relaxed);
+        // Path halving, losing the race against another thread only means less compression
+        if (grandparent != parent) {
+            atomic_compare_exchange_weak_explicit(parents + x, &parent, grandparent, memory_order_relaxed,
+                                                  memory_order_relaxed);
+        }
+        x = grandparent;
+    }
+}
+
+static void union_find_link(_Atomic uint32_t *parents, uint32_t a, uint32_t b) {
+    while (true) {
+        a = union_find_root(parents, a);
+        b = union_find_root(parents, b);
+        if (a == b) return;
+        if (a < b) {
+            uint32_t tmp = a;
+            a = b;
+            b = tmp;
+        }
+        // Fails if another thread linked a in the meantime, then retry from the new roots
+        uint32_t expected = a;
+        if (atomic_compare_exchange_weak_explicit(parents + a, &expected, b, memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    _Atomic uint32_t *parents;
+    uint32_t *roots;
+    mesh_components_t *components;
+    atomic_bool failed;
+} mesh_components_job_t;
+
+static void mesh_components_init_range(void *context, size_t begin, size_t end) {
+    mesh_components_job_t *job = context;
+    for (size_t i = begin; i < end; i++) {
+        atomic_init(job->parents + i, (uint32_t) i);
+    }
+}
+
+static void mesh_components_union_range(void *context, size_t begin, size_t end) {
+    mesh_components_job_t *job = context;
+    for (size_t triangle_index = begin; triangle_index < end; triangle_index++) {
+        const uint32_t *tri = job->mesh->indices + 3 * triangle_index;
+        union_find_link(job->parents, tri[0], tri[1]);
+        union_find_link(job->parents, tri[0], tri[2]);
+    }
+}
+
+static void mesh_components_root_range(void *context, size_t begin, size_t end) {
+    mesh_components_job_t *job = context;
+    for (size_t i = begin; i < end; i++) {
+        job->roots[i] = union_find_root(job->parents, i);
+    }
+}
+
+static void mesh_components_build_range(void *context, size_t begin, size_t end) {
+    mesh_components_job_t *job = context;
+    for (size_t i = begin; i < end; i++) {
+        mesh_component_t *component = job->components->components + i;
+        const uint32_t *triangle_indices = job->components->triangle_indices + component->first;
+        aabb_t bounds = aabb_empty();
+        float area = 0.0f;
+        for (size_t k = 0; k < component->num_tris; k++) {
+            vec3_t a, b, c;
+            mesh_triangle(job->mesh, triangle_indices[k], &a, &b, &c);
+            bounds = aabb_grow(aabb_grow(aabb_grow(bounds, a), b), c);
+            area += 0.5f * vec3_length(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+        }
+        component->bounds = bounds;
+        component->area = area;
+        if (!bvh_build_mesh_triangles(&component->bvh, job->mesh, triangle_indices, component->num_tris)) {
+            atomic_store(&job->failed, true);
+        }
+    }
+}
+
+// Rounds away the low mantissa bits, so floats that only differ by accumulated rounding compare equal
+static float mesh_components_quantize(float x) {
+    uint32_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    bits = (bits + 0x800u) & ~0xFFFu;
+    memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static int mesh_component_shape_compare(const void *a, const void *b) {
+    const mesh_component_t *x = *(const mesh_component_t *const *) a;
+    const mesh_component_t *y = *(const mesh_component_t *const *) b;
+    if (x->num_tris != y->num_tris) return x->num_tris < y->num_tris ? -1 : 1;
+    if (x->num_vertices != y->num_vertices) return x->num_vertices < y->num_vertices ? -1 : 1;
+    if (x->area != y->area) return x->area < y->area ? -1 : 1;
+    if (x->spread != y->spread) return x->spread < y->spread ? -1 : 1;
+    // Ties keep component order, the first of a run is the lowest index
+    return x < y ? -1 : x > y;
+}
+
+// Groups components with equal shape descriptions, copies of a part placed with different transforms
+// end up with the same instance_of
+static bool mesh_components_find_instances(mesh_components_t *components) {
+    mesh_component_t **sorted = malloc((components->num_components > 0 ? components->num_components : 1) *
+                                       sizeof(mesh_component_t *));
+    if (sorted == NULL) return false;
+    for (size_t i = 0; i < components->num_components; i++) {
+        sorted[i] = components->components + i;
+    }
+    qsort(sorted, components->num_components, sizeof(mesh_component_t *), mesh_component_shape_compare);
+    components->num_unique_shapes = 0;
+    uint32_t first = 0;
+    for (size_t i = 0; i < components->num_components; i++) {
+        bool same_shape = i > 0 && sorted[i]->num_tris == sorted[i - 1]->num_tris &&
+                          sorted[i]->num_vertices == sorted[i - 1]->num_vertices &&
+                          sorted[i]->area == sorted[i - 1]->area && sorted[i]->spread == sorted[i - 1]->spread;
+        if (!same_shape) {
+            first = sorted[i] - components->components;
+            components->num_unique_shapes++;
+        }
+        sorted[i]->instance_of = first;
+    }
+    free(sorted);
+    return true;
+}
+
+static void mesh_components_free(mesh_components_t *components) {
+    for (size_t i = 0; i < components->num_components; i++) {
+        bvh_free(&components->components[i].bvh);
+    }
+    free(components->components);
+    free(components->triangle_indices);
+    bvh_free(&components->bvh);
+    *components = (mesh_components_t) {0};
+}
+
+static size_t mesh_components_memory_size(const mesh_components_t *components) {
+    size_t size = bvh_memory_size(&components->bvh) + components->num_components * sizeof(mesh_component_t);
+    for (size_t i = 0; i < components->num_components; i++) {
+        const mesh_component_t *component = components->components + i;
+        size += bvh_memory_size(&component->bvh) + component->num_tris * sizeof(uint32_t);
+    }
+    return size;
+}
+
+static bool mesh_components_build(mesh_components_t *components, const mesh_t *mesh) {
+    *components = (mesh_components_t) {0};
+    size_t num_vertices = mesh->num_unique_vertices;
+    mesh_components_job_t job = {.mesh = mesh, .components = components};
+    job.parents = malloc((num_vertices > 0 ? num_vertices : 1) * sizeof(_Atomic uint32_t));
+    job.roots = malloc((num_vertices > 0 ? num_vertices : 1) * sizeof(uint32_t));
+    components->triangle_indices = malloc((mesh->num_tris > 0 ? mesh->num_tris : 1) * sizeof(uint32_t));
+    if (job.parents == NULL || job.roots == NULL || components->triangle_indices == NULL) {
+        free(job.parents);
+        free(job.roots);
+        mesh_components_free(components);
+        return false;
+    }
+
+    parallel_for(num_vertices, 65536, mesh_components_init_range, &job);
+    parallel_for(mesh->num_tris, 16384, mesh_components_union_range, &job);
+    parallel_for(num_vertices, 65536, mesh_components_root_range, &job);
+    free(job.parents);
+
+    // A vertex no triangle uses would be a component without triangles or bounds, only sets with a triangle count
+    uint8_t *used = calloc(num_vertices > 0 ? num_vertices : 1, 1);
+    if (used == NULL) {
+        free(job.roots);
+        mesh_components_free(components);
+        return false;
+    }
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        used[job.roots[mesh->indices[3 * triangle_index]]] = 1;
+    }
+
+    // Number the components in order of their roots, a root precedes every other vertex of its set,
+    // roots is reused to map vertices to component indices, unused vertices to UINT32_MAX
+    uint32_t *vertex_components = job.roots;
+    size_t num_components = 0;
+    for (size_t i = 0; i < num_vertices; i++) {
+        if (job.roots[i] == i) {
+            vertex_components[i] = used[i] ? (uint32_t) num_components++ : UINT32_MAX;
+        } else {
+            vertex_components[i] = vertex_components[job.roots[i]];
+        }
+    }
+    free(used);
+
+    components->components = calloc(num_components > 0 ? num_components : 1, sizeof(mesh_component_t));
+    double *sums = calloc(num_components > 0 ? 4 * num_components : 1, sizeof(double));
+    if (components->components == NULL || sums == NULL) {
+        free(vertex_components);
+        free(sums);
+        mesh_components_free(components);
+        return false;
+    }
+    components->num_components = num_components;
+
+    // Counting sort of the triangles by component, triangle order is kept within a component
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        components->components[vertex_components[mesh->indices[3 * triangle_index]]].num_tris++;
+    }
+    size_t offset = 0;
+    for (size_t i = 0; i < num_components; i++) {
+        components->components[i].first = offset;
+        offset += components->components[i].num_tris;
+        components->components[i].num_tris = 0;
+    }
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        mesh_component_t *component = components->components + vertex_components[mesh->indices[3 * triangle_index]];
+        components->triangle_indices[component->first + component->num_tris++] = triangle_index;
+    }
+
+    // Mean squared distance of the vertices to their centroid
+    for (size_t i = 0; i < num_vertices; i++) {
+        if (vertex_components[i] == UINT32_MAX) continue;
+        double *sum = sums + 4 * vertex_components[i];
+        vec3_t v = mesh->unique_vertices[i];
+        sum[0] += v.x;
+        sum[1] += v.y;
+        sum[2] += v.z;
+        components->components[vertex_components[i]].num_vertices++;
+    }
+    for (size_t i = 0; i < num_components; i++) {
+        double *sum = sums + 4 * i;
+        for (int k = 0; k < 3; k++) {
+            sum[k] /= (double) components->components[i].num_vertices;
+        }
+    }
+    for (size_t i = 0; i < num_vertices; i++) {
+        if (vertex_components[i] == UINT32_MAX) continue;
+        double *sum = sums + 4 * vertex_components[i];
+        vec3_t v = mesh->unique_vertices[i];
+        double dx = v.x - sum[0], dy = v.y - sum[1], dz = v.z - sum[2];
+        sum[3] += dx * dx + dy * dy + dz * dz;
+    }
+    for (size_t i = 0; i < num_components; i++) {
+        components->components[i].spread = (float) (sums[4 * i + 3] / (double) components->components[i].num_vertices);
+    }
+    free(sums);
+    free(vertex_components);
+
+    // Components are built in parallel, each one serially, large components dominate but stay balanced
+    // against the many small ones by the dynamic chunk distribution
+    parallel_for(num_components, 1, mesh_components_build_range, &job);
+    aabb_t *component_bounds = malloc((num_components > 0 ? num_components : 1) * sizeof(aabb_t));
+    bool ok = !atomic_load(&job.failed) && component_bounds != NULL;
+    if (ok) {
+        for (size_t i = 0; i < num_components; i++) {
+            mesh_component_t *component = components->components + i;
+            component->area = mesh_components_quantize(component->area);
+            component->spread = mesh_components_quantize(component->spread);
+            component_bounds[i] = component->bounds;
+        }
+        ok = bvh_build(&components->bvh, component_bounds, num_components) &&
+             mesh_components_find_instances(components);
+    }
+    free(component_bounds);
+    if (!ok) mesh_components_free(components);
+    return ok;
+}
+
+// Like bvh_intersect, component BVHs are only entered if the ray reaches their bounds before hit->t
+static bool mesh_components_intersect(const mesh_components_t *components, const mesh_t *mesh, ray_t ray,
+                                      ray_hit_t *hit) {
+    const bvh_t *bvh = &components->bvh;
+    if (bvh->num_prims == 0) return false;
+    vec3_t inv_direction = vec3_inverse(ray.direction);
+    float t_near, t_far;
+    if (!ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes), hit->t, &t_near, &t_far)) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = 0;
+    while (true) {
+        const bvh_node_t *node = bvh->nodes + node_index;
+        if (node->count > 0) {
+            for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+                found |= bvh_intersect(&components->components[bvh->prim_indices[i]].bvh, mesh, ray, hit);
+            }
+        } else {
+            uint32_t left = node->left_first, right = left + 1;
+            float t_left, t_right, t_unused;
+            bool hit_left = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + left),
+                                                  hit->t, &t_left, &t_unused);
+            bool hit_right = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + right),
+                                                   hit->t, &t_right, &t_unused);
+            if (hit_left && hit_right) {
+                if (t_right < t_left) {
+                    uint32_t tmp = left;
+                    left = right;
+                    right = tmp;
+                }
+                stack[stack_size++] = right;
+                node_index = left;
+                continue;
+            } else if (hit_left) {
+                node_index = left;
+                continue;
+            } else if (hit_right) {
+                node_index = right;
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        node_index = stack[--stack_size];
+    }
+    return found;
+}
@@ -0,0 +1,316 @@
+#pragma once
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Writers for welded meshes. Text and repacked records are formatted block by block on the job system
+// while the previous block is being written, so large exports are limited by the disk rather than formatting.
+
+#define EXPORT_BLOCK_ELEMENTS (1 << 18)
+#define EXPORT_SLICE_ELEMENTS (1 << 14)
+#define EXPORT_SLICES_PER_BLOCK (EXPORT_BLOCK_ELEMENTS / EXPORT_SLICE_ELEMENTS)
+
+// Formats elements [begin, end) into out, returns the number of bytes written
+typedef size_t (*export_format_fn)(const void *context, size_t begin, size_t end, char *out);
+
+typedef struct export_writer_t export_writer_t;
+
+typedef struct {
+    export_writer_t *writer;
+    char *buffer;
+    // Slices are formatted independently into fixed size areas of the buffer and written back to back
+    size_t slice_sizes[EXPORT_SLICES_PER_BLOCK];
+    size_t num_slices;
+    size_t first;
+    size_t count;
+} export_block_t;
+
+struct export_writer_t {
+    FILE *file;
+    export_format_fn format;
+    const void *context;
+    size_t max_element_size;
+    export_block_t blocks[2];
+    atomic_bool failed;
+};
+
+static const uint64_t export_powers_of_ten[] = {1ull,
+                                                10ull,
+                                                100ull,
+                                                1000ull,
+                                                10000ull,
+                                                100000ull,
+                                                1000000ull,
+                                                10000000ull,
+                                                100000000ull,
+                                                1000000000ull,
+                                                10000000000ull,
+                                                100000000000ull,
+                                                1000000000000ull,
+                                                10000000000000ull};
+
+static char *export_format_uint(char *out, uint64_t value) {
+    char digits[20];
+    int num_digits = 0;
+    do {
+        digits[num_digits++] = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (num_digits > 0) *out++ = digits[--num_digits];
+    return out;
+}
+
+// Writes 9 significant digits, enough for the text to read back as the same float, and drops trailing zeros.
+// Values outside [1e-4, 1e9) are rare in meshes and fall back to printf.
+//@returns end of the written text, at most 24 characters
+static char *export_format_float(char *out, float value) {
+    if (value == 0.0f) {
+        *out++ = '0';
+        return out;
+    }
+    double x = value;
+    if (!(fabs(x) >= 1e-4 && fabs(x) < 1e9)) return out + sprintf(out, "%.9g", x);
+    if (x < 0) {
+        *out++ = '-';
+        x = -x;
+    }
+    // x lies in [10^exponent, 10^(exponent + 1))
+    int exponent = 0;
+    while (x >= (double) export_powers_of_ten[exponent + 1]) exponent++;
+    while (exponent <= 0 && x * (double) export_powers_of_ten[-exponent] < 1.0) exponent--;
+    int decimals = 8 - exponent;
+    uint64_t scaled = (uint64_t) (x * (double) export_powers_of_ten[decimals] + 0.5);
+    uint64_t fraction = scaled % export_powers_of_ten[decimals];
+    out = export_format_uint(out, scaled / export_powers_of_ten[decimals]);
+    if (fraction != 0) {
+        while (fraction % 10 == 0) {
+            fraction /= 10;
+            decimals--;
+        }
+        *out++ = '.';
+        for (int i = decimals - 1; i >= 0; i--) {
+            out[i] = (char) ('0' + fraction % 10);
+            fraction /= 10;
+        }
+        out += decimals;
+    }
+    return out;
+}
+
+static void export_format_slices(void *context, size_t begin, size_t end) {
+    export_block_t *block = context;
+    export_writer_t *writer = block->writer;
+    for (size_t slice = begin; slice < end; slice++) {
+        size_t first = block->first + slice * EXPORT_SLICE_ELEMENTS;
+        size_t last = first + EXPORT_SLICE_ELEMENTS < block->first + block->count ? first + EXPORT_SLICE_ELEMENTS
+                                                                                  : block->first + block->count;
+        char *out = block->buffer + slice * EXPORT_SLICE_ELEMENTS * writer->max_element_size;
+        block->slice_sizes[slice] = writer->format(writer->context, first, last, out);
+    }
+}
+
+static void export_write_block(void *data) {
+    export_block_t *block = data;
+    export_writer_t *writer = block->writer;
+    for (size_t slice = 0; slice < block->num_slices; slice++) {
+        const char *out = block->buffer + slice * EXPORT_SLICE_ELEMENTS * writer->max_element_size;
+        if (fwrite(out, 1, block->slice_sizes[slice], writer->file) != block->slice_sizes[slice]) {
+            atomic_store(&writer->failed, true);
+            return;
+        }
+    }
+}
+
+// Formats and writes count elements, formatting block i + 1 overlaps writing block i
+static bool export_elements(FILE *file, size_t count, size_t max_element_size, export_format_fn format,
+                            const void *context) {
+    export_writer_t writer = {.file = file, .format = format, .context = context, .max_element_size = max_element_size};
+    size_t buffer_size = EXPORT_BLOCK_ELEMENTS * max_element_size;
+    for (int b = 0; b < 2; b++) {
+        writer.blocks[b].writer = &writer;
+        writer.blocks[b].buffer = malloc(buffer_size);
+    }
+    if (writer.blocks[0].buffer == NULL || writer.blocks[1].buffer == NULL) {
+        puts("Failed to allocate memory");
+        free(writer.blocks[0].buffer);
+        free(writer.blocks[1].buffer);
+        return false;
+    }
+
+    job_t *write_job = NULL;
+    int current = 0;
+    for (size_t first = 0; first < count && !atomic_load(&writer.failed); first += EXPORT_BLOCK_ELEMENTS) {
+        export_block_t *block = writer.blocks + current;
+        block->first = first;
+        block->count = count - first < EXPORT_BLOCK_ELEMENTS ? count - first : EXPORT_BLOCK_ELEMENTS;
+        block->num_slices = (block->count + EXPORT_SLICE_ELEMENTS - 1) / EXPORT_SLICE_ELEMENTS;
+        parallel_for(block->num_slices, 1, export_format_slices, block);
+
+        // Writes must stay in order, the previous block is done before this one is handed over
+        job_wait(write_job);
+        job_release(write_job);
+        write_job = job_create(export_write_block, block);
+        if (write_job == NULL) {
+            export_write_block(block);
+        } else {
+            job_submit(write_job);
+        }
+        current ^= 1;
+    }
+    job_wait(write_job);
+    job_release(write_job);
+
+    free(writer.blocks[0].buffer);
+    free(writer.blocks[1].buffer);
+    return !atomic_load(&writer.failed);
+}
+
+// uchar count followed by three uint indices, 13 bytes per face
+static size_t export_ply_faces(const void *context, size_t begin, size_t end, char *out) {
+    const mesh_t *mesh = context;
+    char *start = out;
+    for (size_t triangle_index = begin; triangle_index < end; triangle_index++) {
+        *out++ = 3;
+        memcpy(out, mesh->indices + 3 * triangle_index, 3 * sizeof(uint32_t));
+        out += 3 * sizeof(uint32_t);
+    }
+    return out - start;
+}
+
+static size_t export_obj_vertices(const void *context, size_t begin, size_t end, char *out) {
+    const mesh_t *mesh = context;
+    char *start = out;
+    for (size_t i = begin; i < end; i++) {
+        vec3_t v = mesh->unique_vertices[i];
+        *out++ = 'v';
+        *out++ = ' ';
+        out = export_format_float(out, v.x);
+        *out++ = ' ';
+        out = export_format_float(out, v.y);
+        *out++ = ' ';
+        out = export_format_float(out, v.z);
+        *out++ = '\n';
+    }
+    return out - start;
+}
+
+static size_t export_obj_faces(const void *context, size_t begin, size_t end, char *out) {
+    const mesh_t *mesh = context;
+    char *start = out;
+    for (size_t triangle_index = begin; triangle_index < end; triangle_index++) {
+        const uint32_t *tri = mesh->indices + 3 * triangle_index;
+        *out++ = 'f';
+        for (int k = 0; k < 3; k++) {
+            *out++ = ' ';
+            // OBJ indices start at 1
+            out = export_format_uint(out, (uint64_t) tri[k] + 1);
+        }
+        *out++ = '\n';
+    }
+    return out - start;
+}
+
+// Binary little endian PLY, vertices are written straight from the mesh
+static bool export_ply(const mesh_t *mesh, FILE *file) {
+    fprintf(file,
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "element vertex %zu\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "element face %zu\n"
+            "property list uchar uint vertex_indices\n"
+            "end_header\n",
+            mesh->num_unique_vertices, mesh->num_tris);
+    if (fwrite(mesh->unique_vertices, sizeof(vec3_t), mesh->num_unique_vertices, file) !=
+        mesh->num_unique_vertices) {
+        return false;
+    }
+    return export_elements(file, mesh->num_tris, 1 + 3 * sizeof(uint32_t), export_ply_faces, mesh);
+}
+
+static bool export_obj(const mesh_t *mesh, FILE *file) {
+    fprintf(file, "# %zu vertices, %zu triangles\n", mesh->num_unique_vertices, mesh->num_tris);
+    // "v " and three floats with separators and newline, "f " and three indices with separators and newline
+    return export_elements(file, mesh->num_unique_vertices, 80, export_obj_vertices, mesh) &&
+           export_elements(file, mesh->num_tris, 40, export_obj_faces, mesh);
+}
+
+static bool export_glb_chunk_header(FILE *file, uint32_t length, const char type[4]) {
+    return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(type, 1, 4, file) == 4;
+}
+
+// glTF binary with one mesh, the binary chunk holds the vertex positions followed by the index buffer,
+// both are written straight from the mesh
+static bool export_glb(const mesh_t *mesh, FILE *file) {
+    uint64_t positions_size = mesh->num_unique_vertices * sizeof(vec3_t);
+    uint64_t indices_size = mesh->num_tris * 3 * sizeof(uint32_t);
+    char json[2048];
+    int json_length = snprintf(
+            json, sizeof(json),
+            "{\"asset\":{\"version\":\"2.0\",\"generator\":\"WonderBox\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+            "\"nodes\":[{\"mesh\":0}],\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0},\"indices\":1}]}],"
+            "\"accessors\":["
+            "{\"bufferView\":0,\"componentType\":5126,\"count\":%zu,\"type\":\"VEC3\","
+            "\"min\":[%.9g,%.9g,%.9g],\"max\":[%.9g,%.9g,%.9g]},"
+            "{\"bufferView\":1,\"componentType\":5125,\"count\":%zu,\"type\":\"SCALAR\"}],"
+            "\"bufferViews\":["
+            "{\"buffer\":0,\"byteOffset\":0,\"byteLength\":%" PRIu64 ",\"target\":34962},"
+            "{\"buffer\":0,\"byteOffset\":%" PRIu64 ",\"byteLength\":%" PRIu64 ",\"target\":34963}],"
+            "\"buffers\":[{\"byteLength\":%" PRIu64 "}]}",
+            mesh->num_unique_vertices, mesh->bounds.min.x, mesh->bounds.min.y, mesh->bounds.min.z,
+            mesh->bounds.max.x, mesh->bounds.max.y, mesh->bounds.max.z, 3 * mesh->num_tris, positions_size,
+            positions_size, indices_size, positions_size + indices_size);
+    // Chunks are 4 byte aligned, JSON is padded with spaces, the binary chunk is already a multiple of 4
+    while (json_length % 4 != 0) json[json_length++] = ' ';
+    uint64_t total_size = 12 + 8 + (uint64_t) json_length + 8 + positions_size + indices_size;
+    if (total_size > UINT32_MAX) {
+        puts("Mesh is too large for glTF binary");
+        return false;
+    }
+    uint32_t header[3] = {0x46546C67, 2, (uint32_t) total_size};
+    return fwrite(header, sizeof(header), 1, file) == 1 && export_glb_chunk_header(file, json_length, "JSON") &&
+           fwrite(json, 1, json_length, file) == (size_t) json_length &&
+           export_glb_chunk_header(file, (uint32_t) (positions_size + indices_size), "BIN\0") &&
+           fwrite(mesh->unique_vertices, sizeof(vec3_t), mesh->num_unique_vertices, file) ==
+                   mesh->num_unique_vertices &&
+           fwrite(mesh->indices, 3 * sizeof(uint32_t), mesh->num_tris, file) == mesh->num_tris;
+}
+
+// Picks the format from the file extension: .ply, .obj or .glb
+static bool export_mesh(const mesh_t *mesh, const char *filepath) {
+    const char *extension = strrchr(filepath, '.');
+    bool (*export_fn)(const mesh_t *, FILE *) = NULL;
+    if (extension != NULL && strcmp(extension, ".ply") == 0) export_fn = export_ply;
+    if (extension != NULL && strcmp(extension, ".obj") == 0) export_fn = export_obj;
+    if (extension != NULL && strcmp(extension, ".glb") == 0) export_fn = export_glb;
+    if (export_fn == NULL) {
+        puts("Unknown export format, expected .ply, .obj or .glb");
+        return false;
+    }
+    // glTF forbids empty accessors and buffers, and empty bounds are not finite
+    if (mesh->num_tris == 0) {
+        puts("Mesh has no triangles to export");
+        return false;
+    }
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    bool ok = export_fn(mesh, file);
+    ok &= fclose(file) == 0;
+    if (!ok) puts("Failed to write file");
+    return ok;
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+// Paths of all files below a directory with a given extension, relative to that directory
+typedef struct {
+    char **paths;
+    size_t num_paths;
+    size_t capacity;
+} file_list_t;
+
+static void file_list_free(file_list_t *list) {
+    for (size_t i = 0; i < list->num_paths; i++) free(list->paths[i]);
+    free(list->paths);
+    *list = (file_list_t) {0};
+}
+
+static bool file_list_push(file_list_t *list, const char *path) {
+    if (list->num_paths == list->capacity) {
+        size_t capacity = list->capacity > 0 ? 2 * list->capacity : 256;
+        char **paths = realloc(list->paths, capacity * sizeof(char *));
+        if (paths == NULL) return false;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->num_paths] = strdup(path);
+    return list->paths[list->num_paths++] != NULL;
+}
+
+static bool file_has_extension(const char *path, const char *extension) {
+    const char *dot = strrchr(path, '.');
+    return dot != NULL && strcasecmp(dot, extension) == 0;
+}
+
+// Walks root/relative depth first, unreadable directories are skipped, symbolic links are not followed
+static bool file_list_collect_below(file_list_t *list, const char *root, const char *relative,
+                                    const char *extension) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s%s%s", root, relative[0] != '\0' ? "/" : "", relative);
+    DIR *dir = opendir(path);
+    if (dir == NULL) return true;
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char child[4096];
+        if (snprintf(child, sizeof(child), "%s%s%s", relative, relative[0] != '\0' ? "/" : "", entry->d_name) >=
+            (int) sizeof(child)) {
+            continue;
+        }
+        char full[4096];
+        if (snprintf(full, sizeof(full), "%s/%s", root, child) >= (int) sizeof(full)) continue;
+        struct stat info;
+        if (lstat(full, &info) != 0) continue;
+        if (S_ISDIR(info.st_mode)) {
+            ok = file_list_collect_below(list, root, child, extension);
+        } else if (S_ISREG(info.st_mode) && file_has_extension(child, extension)) {
+            ok = file_list_push(list, child);
+        }
+    }
+    closedir(dir);
+    return ok;
+}
+
+//@param extension e.g. ".stl", compared ignoring case
+static bool file_list_collect(file_list_t *list, const char *root, const char *extension) {
+    *list = (file_list_t) {0};
+    if (!file_list_collect_below(list, root, "", extension)) {
+        puts("Failed to allocate memory");
+        file_list_free(list);
+        return false;
+    }
+    return true;
+}
+
+// Creates every missing directory on the way to a file, like mkdir -p on its parent
+static bool file_make_parent_directories(const char *filepath) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s", filepath);
+    for (char *slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        if (mkdir(path, 0755) != 0 && errno != EEXIST) return false;
+        *slash = '/';
+    }
+    return true;
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "mesh.h"
+
+// Remembers the triangle each pixel hit in the last frame. While the camera moves slowly most primary rays
+// hit the same triangle again, testing it first gives the BVH traversal a tight maximum distance, so it
+// only descends into nodes that could hold something closer. The result is the same closest hit either way.
+
+typedef struct {
+    // Per pixel triangle index or MESH_NO_TRIANGLE, for this mesh at this many pixels
+    _Atomic uint32_t *triangles;
+    size_t num_pixels;
+    const mesh_t *mesh;
+    // Without predictions the cache only counts traversal steps, for comparison
+    bool enabled;
+    atomic_size_t num_rays;
+    atomic_size_t num_predicted;
+    atomic_size_t num_kept;
+    atomic_size_t num_steps;
+} hit_cache_t;
+
+typedef struct {
+    size_t num_rays;
+    size_t num_predicted;
+    size_t num_kept;
+    uint32_t num_steps;
+} hit_cache_stats_t;
+
+static void hit_cache_free(hit_cache_t *cache) {
+    free((void *) cache->triangles);
+    cache->triangles = NULL;
+    cache->num_pixels = 0;
+    cache->mesh = NULL;
+}
+
+// Forgets all predictions when the mesh or the number of pixels changed
+static bool hit_cache_prepare(hit_cache_t *cache, const mesh_t *mesh, size_t num_pixels) {
+    if (cache->triangles != NULL && cache->mesh == mesh && cache->num_pixels == num_pixels) return true;
+    hit_cache_free(cache);
+    cache->triangles = malloc(num_pixels * sizeof(uint32_t));
+    if (cache->triangles == NULL) return false;
+    // All bytes 0xFF is MESH_NO_TRIANGLE
+    memset((void *) cache->triangles, 0xFF, num_pixels * sizeof(uint32_t));
+    cache->num_pixels = num_pixels;
+    cache->mesh = mesh;
+    return true;
+}
+
+static void hit_cache_reset_stats(hit_cache_t *cache) {
+    atomic_store(&cache->num_rays, 0);
+    atomic_store(&cache->num_predicted, 0);
+    atomic_store(&cache->num_kept, 0);
+    atomic_store(&cache->num_steps, 0);
+}
+
+// Closest hit of a pixel's primary ray like bvh_intersect, seeded with the pixel's previous triangle
+static bool hit_cache_intersect(hit_cache_t *cache, const bvh_t *bvh, const mesh_t *mesh, size_t pixel, ray_t ray,
+                                ray_hit_t *hit, hit_cache_stats_t *stats) {
+    stats->num_rays++;
+    uint32_t predicted = MESH_NO_TRIANGLE;
+    if (cache->enabled) {
+        predicted = atomic_load_explicit(cache->triangles + pixel, memory_order_relaxed);
+        vec3_t a, b, c;
+        float t, u, v;
+        if (predicted != MESH_NO_TRIANGLE) {
+            mesh_triangle(mesh, predicted, &a, &b, &c);
+            if (ray_triangle_intersection(ray, a, b, c, &t, &u, &v) && t < hit->t) {
+                *hit = (ray_hit_t) {t, predicted, u, v};
+                stats->num_predicted++;
+            } else {
+                predicted = MESH_NO_TRIANGLE;
+            }
+        }
+    }
+    bool found = bvh_intersect_counted(bvh, mesh, ray, hit, &stats->num_steps) || predicted != MESH_NO_TRIANGLE;
+    stats->num_kept += predicted != MESH_NO_TRIANGLE && hit->triangle_index == predicted;
+    atomic_store_explicit(cache->triangles + pixel, found ? hit->triangle_index : MESH_NO_TRIANGLE,
+                          memory_order_relaxed);
+    return found;
+}
+
+static void hit_cache_add_stats(hit_cache_t *cache, const hit_cache_stats_t *stats) {
+    atomic_fetch_add_explicit(&cache->num_rays, stats->num_rays, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->num_predicted, stats->num_predicted, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->num_kept, stats->num_kept, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->num_steps, stats->num_steps, memory_order_relaxed);
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Writes an RGB8 image as binary PPM
+static bool image_write_ppm(const char *filepath, const uint8_t *pixels, int width, int height) {
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL) {
+        puts("Failed to open image output");
+        return false;
+    }
+    bool ok = fprintf(file, "P6\n%d %d\n255\n", width, height) > 0;
+    ok &= fwrite(pixels, 3, (size_t) width * height, file) == (size_t) width * height;
+    ok &= fclose(file) == 0;
+    if (!ok) puts("Failed to write image");
+    return ok;
+}
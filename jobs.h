@@ -0,0 +1,401 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// Task graph scheduler: jobs run once all their dependencies finished, finishing a job releases
+// its continuations. Every worker owns a deque it pushes to and pops from at the back (depth first,
+// cache warm), idle workers steal from the front of the others. Jobs submitted from outside the pool
+// land in a shared queue. Background jobs (loading, building) live in their own queue and are only
+// picked up by idle workers, never by a thread helping out while it waits, so waits stay short.
+
+#define JOB_MAX_WORKERS 256
+
+typedef void (*job_fn)(void *data);
+
+typedef struct job_t job_t;
+
+struct job_t {
+    job_fn fn;
+    void *data;
+    bool background;
+    // Unfinished dependencies, plus one until the job is submitted
+    atomic_int pending;
+    atomic_bool finished;
+    pthread_mutex_t mutex;
+    bool completing;
+    job_t **continuations;
+    int num_continuations;
+    int continuations_capacity;
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    job_t **items;
+    size_t capacity;
+    // Monotonic positions, the front is stolen from and the back is owned
+    size_t front;
+    size_t back;
+} job_queue_t;
+
+static struct {
+    int num_workers;
+    pthread_t threads[JOB_MAX_WORKERS];
+    job_queue_t local[JOB_MAX_WORKERS];
+    job_queue_t injected;
+    job_queue_t background;
+    atomic_bool running;
+    atomic_int num_queued;
+    atomic_int num_waiters;
+    pthread_mutex_t sleep_mutex;
+    pthread_cond_t wake_cond;
+} job_system;
+
+static _Thread_local int job_worker_index = -1;
+
+static int thread_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) return 1;
+    return n > JOB_MAX_WORKERS ? JOB_MAX_WORKERS : (int) n;
+}
+
+static void job_queue_init(job_queue_t *queue) {
+    pthread_mutex_init(&queue->mutex, NULL);
+    queue->items = malloc(64 * sizeof(job_t *));
+    // Without items the first push tries again
+    queue->capacity = queue->items != NULL ? 64 : 0;
+    queue->front = queue->back = 0;
+}
+
+static void job_queue_free(job_queue_t *queue) {
+    pthread_mutex_destroy(&queue->mutex);
+    free(queue->items);
+}
+
+// Must be called with the queue locked
+//@returns false if the queue is full and could not grow
+static bool job_queue_reserve(job_queue_t *queue) {
+    if (queue->back - queue->front < queue->capacity) return true;
+    size_t capacity = queue->capacity > 0 ? 2 * queue->capacity : 64;
+    job_t **items = malloc(capacity * sizeof(job_t *));
+    if (items == NULL) return false;
+    for (size_t i = queue->front; i < queue->back; i++) {
+        items[i % capacity] = queue->items[i % queue->capacity];
+    }
+    free(queue->items);
+    queue->items = items;
+    queue->capacity = capacity;
+    return true;
+}
+
+static bool job_queue_push(job_queue_t *queue, job_t *job) {
+    pthread_mutex_lock(&queue->mutex);
+    bool ok = job_queue_reserve(queue);
+    if (ok) queue->items[queue->back++ % queue->capacity] = job;
+    pthread_mutex_unlock(&queue->mutex);
+    return ok;
+}
+
+static bool job_queue_push_front(job_queue_t *queue, job_t *job) {
+    pthread_mutex_lock(&queue->mutex);
+    if (!job_queue_reserve(queue)) {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    if (queue->front == 0) {
+        // Rebase the positions so front can move back, the ring layout is unchanged modulo capacity
+        queue->front += queue->capacity;
+        queue->back += queue->capacity;
+    }
+    queue->items[--queue->front % queue->capacity] = job;
+    pthread_mutex_unlock(&queue->mutex);
+    return true;
+}
+
+static job_t *job_queue_pop_back(job_queue_t *queue) {
+    job_t *job = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->back > queue->front) job = queue->items[--queue->back % queue->capacity];
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+static job_t *job_queue_pop_front(job_queue_t *queue) {
+    job_t *job = NULL;
+    pthread_mutex_lock(&queue->mutex);
+    if (queue->back > queue->front) job = queue->items[queue->front++ % queue->capacity];
+    pthread_mutex_unlock(&queue->mutex);
+    return job;
+}
+
+static void job_wake(bool everyone) {
+    pthread_mutex_lock(&job_system.sleep_mutex);
+    if (everyone) {
+        pthread_cond_broadcast(&job_system.wake_cond);
+    } else {
+        pthread_cond_signal(&job_system.wake_cond);
+    }
+    pthread_mutex_unlock(&job_system.sleep_mutex);
+}
+
+static void job_run(job_t *job);
+
+// Continuations of background jobs skip ahead of the queue, so a chain of dependent jobs
+// runs through quickly instead of waiting behind every job that was submitted up front.
+// A job that does not fit in a full queue runs right away on the calling thread instead.
+static void job_enqueue(job_t *job, bool continuation) {
+    bool queued;
+    if (job->background && continuation) {
+        queued = job_queue_push_front(&job_system.background, job);
+    } else if (job->background) {
+        queued = job_queue_push(&job_system.background, job);
+    } else if (job_worker_index >= 0) {
+        queued = job_queue_push(job_system.local + job_worker_index, job);
+    } else {
+        queued = job_queue_push(&job_system.injected, job);
+    }
+    if (!queued) {
+        job_run(job);
+        return;
+    }
+    atomic_fetch_add(&job_system.num_queued, 1);
+    // Waiters share the condition with sleeping workers and may be able to help with this job
+    job_wake(atomic_load(&job_system.num_waiters) > 0);
+}
+
+static job_t *job_take(bool allow_background) {
+    job_t *job = NULL;
+    int self = job_worker_index;
+    if (self >= 0) job = job_queue_pop_back(job_system.local + self);
+    if (job == NULL) job = job_queue_pop_front(&job_system.injected);
+    for (int i = 1; job == NULL && i <= job_system.num_workers; i++) {
+        int victim = (self + i) % job_system.num_workers;
+        if (victim < 0) victim += job_system.num_workers;
+        if (victim != self) job = job_queue_pop_front(job_system.local + victim);
+    }
+    if (job == NULL && allow_background) job = job_queue_pop_front(&job_system.background);
+    if (job != NULL) atomic_fetch_sub(&job_system.num_queued, 1);
+    return job;
+}
+
+static void job_complete(job_t *job) {
+    pthread_mutex_lock(&job->mutex);
+    job->completing = true;
+    pthread_mutex_unlock(&job->mutex);
+    // No continuations can be added once completing is set, so the list is stable
+    for (int i = 0; i < job->num_continuations; i++) {
+        job_t *continuation = job->continuations[i];
+        if (atomic_fetch_sub(&continuation->pending, 1) == 1) job_enqueue(continuation, true);
+    }
+    free(job->continuations);
+    job->continuations = NULL;
+    job->num_continuations = 0;
+    // The job may be released by a waiter as soon as this is visible
+    atomic_store(&job->finished, true);
+    if (atomic_load(&job_system.num_waiters) > 0) job_wake(true);
+}
+
+static void job_run(job_t *job) {
+    job->fn(job->data);
+    job_complete(job);
+}
+
+static void *job_worker_main(void *arg) {
+    job_worker_index = (int) (size_t) arg;
+    while (true) {
+        job_t *job = job_take(true);
+        if (job != NULL) {
+            job_run(job);
+            continue;
+        }
+        pthread_mutex_lock(&job_system.sleep_mutex);
+        while (atomic_load(&job_system.running) && atomic_load(&job_system.num_queued) == 0) {
+            pthread_cond_wait(&job_system.wake_cond, &job_system.sleep_mutex);
+        }
+        bool exit = !atomic_load(&job_system.running) && atomic_load(&job_system.num_queued) == 0;
+        pthread_mutex_unlock(&job_system.sleep_mutex);
+        if (exit) break;
+    }
+    return NULL;
+}
+
+//@param num_workers number of worker threads, 0 for one less than the number of cores (at least one)
+static bool job_system_init(int num_workers) {
+    if (atomic_load(&job_system.running)) return true;
+    if (num_workers <= 0) num_workers = thread_count() - 1;
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > JOB_MAX_WORKERS) num_workers = JOB_MAX_WORKERS;
+
+    job_queue_init(&job_system.injected);
+    job_queue_init(&job_system.background);
+    for (int i = 0; i < num_workers; i++) {
+        job_queue_init(job_system.local + i);
+    }
+    pthread_mutex_init(&job_system.sleep_mutex, NULL);
+    pthread_cond_init(&job_system.wake_cond, NULL);
+    atomic_store(&job_system.num_queued, 0);
+    atomic_store(&job_system.num_waiters, 0);
+    atomic_store(&job_system.running, true);
+    job_system.num_workers = num_workers;
+    for (int i = 0; i < num_workers; i++) {
+        if (pthread_create(job_system.threads + i, NULL, job_worker_main, (void *) (size_t) i) != 0) {
+            // Keep going with the workers that did start, the calling thread also helps
+            job_system.num_workers = i;
+            break;
+        }
+    }
+    return true;
+}
+
+// Runs the remaining queued jobs and stops the workers, jobs still running must not start parallel work
+static void job_system_shutdown(void) {
+    if (!atomic_load(&job_system.running)) return;
+    atomic_store(&job_system.running, false);
+    job_wake(true);
+    for (int i = 0; i < job_system.num_workers; i++) {
+        pthread_join(job_system.threads[i], NULL);
+    }
+    for (int i = 0; i < job_system.num_workers; i++) {
+        job_queue_free(job_system.local + i);
+    }
+    job_queue_free(&job_system.injected);
+    job_queue_free(&job_system.background);
+    pthread_mutex_destroy(&job_system.sleep_mutex);
+    pthread_cond_destroy(&job_system.wake_cond);
+}
+
+static job_t *job_create(job_fn fn, void *data) {
+    job_t *job = calloc(1, sizeof(job_t));
+    if (job == NULL) return NULL;
+    job->fn = fn;
+    job->data = data;
+    atomic_init(&job->pending, 1);
+    atomic_init(&job->finished, false);
+    pthread_mutex_init(&job->mutex, NULL);
+    return job;
+}
+
+static job_t *job_create_background(job_fn fn, void *data) {
+    job_t *job = job_create(fn, data);
+    if (job != NULL) job->background = true;
+    return job;
+}
+
+// Makes job wait for dependency, must be called before job is submitted
+//@returns false if out of memory, job then does not wait for dependency
+static bool job_depends_on(job_t *job, job_t *dependency) {
+    bool ok = true;
+    pthread_mutex_lock(&dependency->mutex);
+    if (!dependency->completing) {
+        if (dependency->num_continuations == dependency->continuations_capacity) {
+            int capacity = dependency->continuations_capacity > 0 ? 2 * dependency->continuations_capacity : 4;
+            job_t **continuations = realloc(dependency->continuations, capacity * sizeof(job_t *));
+            ok = continuations != NULL;
+            if (ok) {
+                dependency->continuations = continuations;
+                dependency->continuations_capacity = capacity;
+            }
+        }
+        if (ok) {
+            dependency->continuations[dependency->num_continuations++] = job;
+            atomic_fetch_add(&job->pending, 1);
+        }
+    }
+    pthread_mutex_unlock(&dependency->mutex);
+    return ok;
+}
+
+// The job becomes runnable as soon as its dependencies finished
+static void job_submit(job_t *job) {
+    if (atomic_fetch_sub(&job->pending, 1) == 1) job_enqueue(job, false);
+}
+
+static bool job_is_finished(const job_t *job) {
+    return atomic_load_explicit(&((job_t *) job)->finished, memory_order_acquire);
+}
+
+// Helps running foreground jobs until job finished, waiting for NULL returns right away
+static void job_wait(job_t *job) {
+    if (job == NULL) return;
+    while (!job_is_finished(job)) {
+        job_t *other = job_take(false);
+        if (other != NULL) {
+            job_run(other);
+            continue;
+        }
+        atomic_fetch_add(&job_system.num_waiters, 1);
+        pthread_mutex_lock(&job_system.sleep_mutex);
+        if (!job_is_finished(job)) {
+            // Finishing and enqueuing both broadcast while there are waiters, the timeout is only a backstop
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&job_system.wake_cond, &job_system.sleep_mutex, &deadline);
+        }
+        pthread_mutex_unlock(&job_system.sleep_mutex);
+        atomic_fetch_sub(&job_system.num_waiters, 1);
+    }
+}
+
+// Frees a finished job
+static void job_release(job_t *job) {
+    if (job == NULL) return;
+    pthread_mutex_destroy(&job->mutex);
+    free(job->continuations);
+    free(job);
+}
+
+typedef void (*parallel_for_fn)(void *context, size_t begin, size_t end);
+
+typedef struct {
+    parallel_for_fn fn;
+    void *context;
+    size_t count;
+    size_t grain;
+    atomic_size_t next;
+} parallel_for_state_t;
+
+static void parallel_for_job(void *data) {
+    parallel_for_state_t *state = data;
+    while (true) {
+        size_t begin = atomic_fetch_add_explicit(&state->next, state->grain, memory_order_relaxed);
+        if (begin >= state->count) break;
+        size_t end = begin + state->grain < state->count ? begin + state->grain : state->count;
+        state->fn(state->context, begin, end);
+    }
+}
+
+// Calls fn on chunks of [0, count) of at most grain elements from the job system, the calling thread helps.
+// Chunks are handed out dynamically so uneven chunk costs balance out.
+static void parallel_for(size_t count, size_t grain, parallel_for_fn fn, void *context) {
+    if (count == 0) return;
+    if (grain == 0) grain = 1;
+    job_system_init(0);
+    parallel_for_state_t state = {fn, context, count, grain, 0};
+    size_t num_chunks = (count + grain - 1) / grain;
+    size_t num_jobs = (size_t) job_system.num_workers + 1;
+    if (num_jobs > num_chunks) num_jobs = num_chunks;
+
+    job_t *jobs[JOB_MAX_WORKERS + 1];
+    size_t num_created = 0;
+    for (size_t i = 1; i < num_jobs; i++) {
+        job_t *job = job_create(parallel_for_job, &state);
+        if (job == NULL) break;
+        jobs[num_created++] = job;
+        job_submit(job);
+    }
+    parallel_for_job(&state);
+    for (size_t i = 0; i < num_created; i++) {
+        job_wait(jobs[i]);
+        job_release(jobs[i]);
+    }
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "mesh.h"
+
+// Streams a binary STL file through the job system as a task graph per chunk of triangles:
+//
+//   parse[i] -> weld[i] -> build[i]        (preview BVH of the chunk, usable as soon as it is ready)
+//               weld[i-1] -^
+//   weld[last] -> welded -> build full BVH
+//
+// Parsing runs in parallel, welding is chained in file order so vertex indices stay deterministic,
+// and chunk BVHs let the renderer show a preview before the whole file has been processed.
+
+#define STL_CHUNK_TRIANGLES 16384
+
+// A contiguous range of mesh triangles with its own BVH
+typedef struct {
+    size_t first_tri;
+    size_t num_tris;
+    aabb_t bounds;
+    bvh_t bvh;
+    atomic_bool ready;
+} mesh_part_t;
+
+typedef struct stl_stream_t stl_stream_t;
+
+typedef struct {
+    stl_stream_t *stream;
+    size_t index;
+    // Triangle records of the file, welding may drop some so the part can end up smaller
+    size_t first_tri;
+    size_t num_tris;
+    // 3 positions per triangle, only alive between parsing and welding
+    vec3_t *positions;
+} stl_chunk_t;
+
+struct stl_stream_t {
+    const char *filepath;
+    mesh_t mesh;
+    mesh_welder_t welder;
+    size_t num_chunks;
+    stl_chunk_t *chunks;
+    mesh_part_t *parts;
+    bvh_t bvh;
+    bvh_layout_t bvh_layout;
+    // Mesh and BVH belong to someone else, e.g. a shared memory mapping, and are not freed
+    bool borrowed;
+    job_t **jobs;
+    size_t num_jobs;
+    // Finishes once every chunk is welded, the mesh is complete from then on
+    job_t *welded_job;
+    // Finishes once the BVH over the whole mesh is built
+    job_t *bvh_job;
+    atomic_bool failed;
+    atomic_bool welded;
+    atomic_bool bvh_ready;
+};
+
+static void stl_chunk_parse(void *data) {
+    stl_chunk_t *chunk = data;
+    stl_stream_t *stream = chunk->stream;
+    mesh_part_t *part = stream->parts + chunk->index;
+    unsigned char *raw = malloc(chunk->num_tris * STL_TRIANGLE_SIZE);
+    chunk->positions = malloc(chunk->num_tris * 3 * sizeof(vec3_t));
+    // Every chunk has its own handle so chunks can be read concurrently
+    FILE *stl_mesh_file = fopen(stream->filepath, "rb");
+    bool ok = raw != NULL && chunk->positions != NULL && stl_mesh_file != NULL &&
+              fseek(stl_mesh_file, (long) (STL_HEADER_SIZE + chunk->first_tri * STL_TRIANGLE_SIZE), SEEK_SET) == 0 &&
+              stl_read_triangles(stl_mesh_file, chunk->num_tris, raw, chunk->positions);
+    if (stl_mesh_file != NULL) fclose(stl_mesh_file);
+    free(raw);
+    if (!ok) {
+        free(chunk->positions);
+        chunk->positions = NULL;
+        atomic_store(&stream->failed, true);
+        return;
+    }
+    part->bounds = aabb_of_points(chunk->positions, 3 * chunk->num_tris);
+}
+
+static void stl_chunk_weld(void *data) {
+    stl_chunk_t *chunk = data;
+    stl_stream_t *stream = chunk->stream;
+    mesh_part_t *part = stream->parts + chunk->index;
+    if (chunk->positions != NULL && !atomic_load(&stream->failed)) {
+        part->first_tri = stream->mesh.num_tris;
+        mesh_weld(&stream->welder, &stream->mesh, chunk->positions, chunk->num_tris);
+        part->num_tris = stream->mesh.num_tris - part->first_tri;
+    }
+    free(chunk->positions);
+    chunk->positions = NULL;
+}
+
+static void stl_chunk_build(void *data) {
+    stl_chunk_t *chunk = data;
+    stl_stream_t *stream = chunk->stream;
+    mesh_part_t *part = stream->parts + chunk->index;
+    if (atomic_load(&stream->failed)) return;
+    if (!bvh_build_mesh(&part->bvh, &stream->mesh, part->first_tri, part->num_tris)) {
+        atomic_store(&stream->failed, true);
+        return;
+    }
+    atomic_store_explicit(&part->ready, true, memory_order_release);
+}
+
+static void stl_stream_welded(void *data) {
+    stl_stream_t *stream = data;
+    mesh_welder_free(&stream->welder);
+    atomic_store_explicit(&stream->welded, true, memory_order_release);
+}
+
+static void stl_stream_build(void *data) {
+    stl_stream_t *stream = data;
+    if (atomic_load(&stream->failed)) return;
+    if (!bvh_build_mesh(&stream->bvh, &stream->mesh, 0, stream->mesh.num_tris) ||
+        !bvh_apply_layout(&stream->bvh, stream->bvh_layout)) {
+        atomic_store(&stream->failed, true);
+        return;
+    }
+    atomic_store_explicit(&stream->bvh_ready, true, memory_order_release);
+}
+
+static job_t *stl_stream_add_job(stl_stream_t *stream, job_fn fn, void *data) {
+    job_t *job = job_create_background(fn, data);
+    stream->jobs[stream->num_jobs++] = job;
+    return job;
+}
+
+// Reads the header and schedules the whole pipeline, returns without waiting for it.
+// The BVH over the whole mesh is stored in bvh_layout, chunk BVHs keep the order they were built in.
+static bool stl_stream_start(stl_stream_t *stream, const char *filepath, bvh_layout_t bvh_layout) {
+    *stream = (stl_stream_t) {0};
+    stream->filepath = filepath;
+    stream->bvh_layout = bvh_layout;
+    FILE *stl_mesh_file = fopen(filepath, "rb");
+    if (stl_mesh_file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    uint32_t num_tris = 0;
+    bool ok = stl_read_num_tris(stl_mesh_file, &num_tris);
+    fclose(stl_mesh_file);
+    if (!ok) return false;
+
+    stream->num_chunks = (num_tris + STL_CHUNK_TRIANGLES - 1) / STL_CHUNK_TRIANGLES;
+    stream->chunks = calloc(stream->num_chunks + 1, sizeof(stl_chunk_t));
+    stream->parts = calloc(stream->num_chunks + 1, sizeof(mesh_part_t));
+    stream->jobs = calloc(3 * stream->num_chunks + 2, sizeof(job_t *));
+    if (stream->chunks == NULL || stream->parts == NULL || stream->jobs == NULL ||
+        !mesh_welder_init(&stream->welder, &stream->mesh, num_tris)) {
+        puts("Failed to allocate memory");
+        free(stream->chunks);
+        free(stream->parts);
+        free(stream->jobs);
+        return false;
+    }
+
+    // Nothing is submitted until the whole graph is in place, so a failure part way releases jobs that never ran
+    job_system_init(0);
+    job_t *previous_weld = NULL;
+    for (size_t i = 0; ok && i < stream->num_chunks; i++) {
+        stl_chunk_t *chunk = stream->chunks + i;
+        chunk->stream = stream;
+        chunk->index = i;
+        chunk->first_tri = i * STL_CHUNK_TRIANGLES;
+        chunk->num_tris = num_tris - chunk->first_tri < STL_CHUNK_TRIANGLES ? num_tris - chunk->first_tri
+                                                                            : STL_CHUNK_TRIANGLES;
+        job_t *parse = stl_stream_add_job(stream, stl_chunk_parse, chunk);
+        job_t *weld = stl_stream_add_job(stream, stl_chunk_weld, chunk);
+        job_t *build = stl_stream_add_job(stream, stl_chunk_build, chunk);
+        ok = parse != NULL && weld != NULL && build != NULL && job_depends_on(weld, parse) &&
+             (previous_weld == NULL || job_depends_on(weld, previous_weld)) && job_depends_on(build, weld);
+        previous_weld = weld;
+    }
+    if (ok) {
+        stream->welded_job = stl_stream_add_job(stream, stl_stream_welded, stream);
+        stream->bvh_job = stl_stream_add_job(stream, stl_stream_build, stream);
+        ok = stream->welded_job != NULL && stream->bvh_job != NULL &&
+             (previous_weld == NULL || job_depends_on(stream->welded_job, previous_weld)) &&
+             job_depends_on(stream->bvh_job, stream->welded_job);
+    }
+    if (!ok) {
+        puts("Failed to allocate memory");
+        for (size_t i = 0; i < stream->num_jobs; i++) job_release(stream->jobs[i]);
+        free(stream->chunks);
+        free(stream->parts);
+        free(stream->jobs);
+        mesh_welder_free(&stream->welder);
+        mesh_free(&stream->mesh);
+        return false;
+    }
+    for (size_t i = 0; i < stream->num_jobs; i++) {
+        job_submit(stream->jobs[i]);
+    }
+    return true;
+}
+
+static void stl_stream_adopted(void *data) {
+    stl_stream_t *stream = data;
+    atomic_store_explicit(&stream->bvh_ready, true, memory_order_release);
+}
+
+// A stream over a mesh and BVH that were built elsewhere, it completes right away without chunks so it can be
+// used in place of one that loads a file
+static bool stl_stream_adopt(stl_stream_t *stream, const mesh_t *mesh, const bvh_t *bvh) {
+    *stream = (stl_stream_t) {0};
+    stream->mesh = *mesh;
+    stream->bvh = *bvh;
+    stream->borrowed = true;
+    stream->jobs = calloc(2, sizeof(job_t *));
+    if (stream->jobs == NULL) {
+        puts("Failed to allocate memory");
+        return false;
+    }
+    job_system_init(0);
+    stream->welded_job = stl_stream_add_job(stream, stl_stream_welded, stream);
+    stream->bvh_job = stl_stream_add_job(stream, stl_stream_adopted, stream);
+    if (stream->welded_job == NULL || stream->bvh_job == NULL ||
+        !job_depends_on(stream->bvh_job, stream->welded_job)) {
+        puts("Failed to allocate memory");
+        job_release(stream->welded_job);
+        job_release(stream->bvh_job);
+        free(stream->jobs);
+        return false;
+    }
+    for (size_t i = 0; i < stream->num_jobs; i++) {
+        job_submit(stream->jobs[i]);
+    }
+    return true;
+}
+
+static bool stl_stream_is_welded(const stl_stream_t *stream) {
+    return atomic_load_explicit(&((stl_stream_t *) stream)->welded, memory_order_acquire);
+}
+
+static bool stl_stream_is_complete(const stl_stream_t *stream) {
+    return atomic_load_explicit(&((stl_stream_t *) stream)->bvh_ready, memory_order_acquire) ||
+           atomic_load(&((stl_stream_t *) stream)->failed);
+}
+
+// Waits for the whole pipeline, the calling thread does not help with background jobs
+//@returns false if loading failed
+static bool stl_stream_wait(stl_stream_t *stream) {
+    for (size_t i = 0; i < stream->num_jobs; i++) {
+        job_wait(stream->jobs[i]);
+    }
+    return !atomic_load(&stream->failed);
+}
+
+// Union of the bounds of the parts that are ready to be traced
+static aabb_t stl_stream_ready_bounds(const stl_stream_t *stream) {
+    aabb_t bounds = aabb_empty();
+    for (size_t i = 0; i < stream->num_chunks; i++) {
+        const mesh_part_t *part = stream->parts + i;
+        if (atomic_load_explicit(&((mesh_part_t *) part)->ready, memory_order_acquire)) {
+            bounds = aabb_union(bounds, part->bounds);
+        }
+    }
+    return bounds;
+}
+
+// Waits for the pipeline before freeing, so it is safe to call while jobs are still running
+static void stl_stream_free(stl_stream_t *stream) {
+    stl_stream_wait(stream);
+    for (size_t i = 0; i < stream->num_jobs; i++) {
+        job_release(stream->jobs[i]);
+    }
+    for (size_t i = 0; i < stream->num_chunks; i++) {
+        bvh_free(&stream->parts[i].bvh);
+        free(stream->chunks[i].positions);
+    }
+    free(stream->jobs);
+    free(stream->chunks);
+    free(stream->parts);
+    mesh_welder_free(&stream->welder);
+    if (!stream->borrowed) {
+        bvh_free(&stream->bvh);
+        mesh_free(&stream->mesh);
+    }
+}
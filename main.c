@@ -1,26 +1,38 @@
+#include <inttypes.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "NanoGUI/nanogui.h"
-#include "hash.h"
-
-typedef struct {
-    float x;
-    float y;
-    float z;
-} vec3_t;
-
-typedef struct {
-    vec3_t origin;
-    vec3_t direction;
-} ray_t;
-
-typedef struct {
-    vec3_t center;
-    float radius;
-} sphere_t;
+#include "blob.h"
+#include "bvh.h"
+#include "camera.h"
+#include "components.h"
+#include "export.h"
+#include "files.h"
+#include "hitcache.h"
+#include "image.h"
+#include "jobs.h"
+#include "loader.h"
+#include "mesh.h"
+#include "meshlet.h"
+#include "net.h"
+#include "paged.h"
+#include "perf.h"
+#include "sampler.h"
+#include "schedule.h"
+#include "sdf.h"
+#include "shadow.h"
+#include "shm.h"
+#include "splat.h"
+#include "thickness.h"
+#include "timing.h"
+#include "vec3.h"
+#include "video.h"
+#include "visibility.h"
 
 typedef struct {
     vec3_t color;
@@ -33,211 +45,1993 @@ typedef struct {
     float power;
 } point_light_t;
 
-struct vec3_uint32_hash_table_node_t {
-    vec3_t key;
-    uint32_t value;
-    struct vec3_uint32_hash_table_node_t *next;
-};
+typedef enum {
+    RENDER_MODE_BVH,
+    RENDER_MODE_SDF,
+    RENDER_MODE_POINTS,
+} render_mode_t;
 
-static float vec3_length_squared(vec3_t v) {
-    return v.x * v.x + v.y * v.y + v.z * v.z;
-}
+typedef enum {
+    SHADOWS_NONE,
+    SHADOWS_RAY,
+    SHADOWS_MAP,
+} shadow_mode_t;
+
+// Order of the rays within a tile, consecutive Z-order rays are neighbors in both directions and so mostly
+// visit the same BVH nodes and triangles while they are still in cache
+typedef enum {
+    PIXEL_ORDER_MORTON,
+    PIXEL_ORDER_SCANLINE,
+} pixel_order_t;
+
+#define RENDER_TILE_SIZE 16
+
+typedef struct {
+    render_mode_t mode;
+    const mesh_t *mesh;
+    // The BVH over the whole mesh, while it is being built the ready chunk parts are traced instead
+    const bvh_t *bvh;
+    const mesh_part_t *parts;
+    size_t num_parts;
+    // Connected components with their own BVHs, traced instead of the BVH over the whole mesh when set
+    const mesh_components_t *components;
+    // Meshlet leaves, traced instead of the BVH over the whole mesh when set
+    const mesh_meshlets_t *meshlets;
+    const sdf_t *sdf;
+    // Per unique vertex 0x00RRGGBB colors for point splatting
+    const uint32_t *vertex_colors;
+    splat_framebuffer_t *splat_framebuffer;
+    bool fill_holes;
+    // Shadows need the complete mesh, the map is brought up to date with the light before each frame
+    shadow_mode_t shadows;
+    shadow_map_t *shadow_map;
+    pixel_order_t pixel_order;
+    // Tile costs of the last frame order and split the tiles of the next one, without it tiles go in raster order
+    tile_schedule_t *tile_schedule;
+    // Pixels outside the projected bounds of the traced geometry are background without tracing
+    bool bounds_culling;
+    // Last hit triangle per pixel, used for the BVH over the whole mesh
+    hit_cache_t *hit_cache;
+    // Per unique vertex wall thickness, when set surfaces are colored by it relative to thickness_limit
+    const float *thickness;
+    float thickness_limit;
+    camera_t camera;
+    point_light_t light;
+} scene_t;
+
+//@param light_visibility fraction of the light reaching the surface, 0 in full shadow
+static lighting_t
+blinn_phong_shading(point_light_t pl, vec3_t surface_position, vec3_t surface_normal, vec3_t view_direction,
+                    float specular_hardness, float light_visibility) {
+    if (pl.power < 0 || light_visibility <= 0.0f) {
+        return (lighting_t) {{0, 0, 0},
+                             {0, 0, 0}};
+    }
+
+    lighting_t out;
+
+    vec3_t light_direction = vec3_sub(pl.position, surface_position);
+    float distance_squared = vec3_length_squared(light_direction);
+    float distance = sqrtf(distance_squared);
+    light_direction = vec3_scale(light_direction, 1.0f / distance);
 
-static float vec3_length(vec3_t v) {
-    return sqrtf(vec3_length_squared(v));
+    // Diffuse
+    float NdotL = vec3_dot(surface_normal, light_direction);
+    float intensity = clampf(NdotL, 0.0f, 1.0f);
+    out.color = vec3_scale(pl.color, light_visibility * intensity * pl.power / distance_squared);
+
+    // Specular
+    vec3_t half_vector = vec3_normalized(vec3_add(light_direction, view_direction));
+    float NdotH = vec3_dot(surface_normal, half_vector);
+    float specular_intensity = powf(clampf(NdotH, 0.0f, 1.0f), specular_hardness);
+    out.specular = vec3_scale(pl.color, light_visibility * specular_intensity * pl.power / distance_squared);
+
+    return out;
 }
 
-static vec3_t vec3_normalized(vec3_t v) {
-    float l = vec3_length(v);
-    return (vec3_t) {v.x / l, v.y / l, v.z / l};
+// All shadow rays end at the light, a cube shadow map answers them with a lookup instead of a BVH traversal
+static float light_visibility(const scene_t *scene, vec3_t position, vec3_t normal) {
+    if (scene->bvh == NULL) return 1.0f;
+    if (scene->shadows == SHADOWS_MAP && scene->shadow_map != NULL) {
+        return shadow_map_visibility(scene->shadow_map, position, normal);
+    }
+    if (scene->shadows == SHADOWS_RAY) {
+        vec3_t to_light = vec3_sub(scene->light.position, position);
+        float distance = vec3_length(to_light);
+        // Starts off the surface so the ray does not hit the triangle it leaves from
+        ray_t ray = {vec3_add(position, vec3_scale(normal, 1e-4f * distance)), vec3_scale(to_light, 1.0f / distance)};
+        return bvh_occluded(scene->bvh, scene->mesh, ray, distance) ? 0.0f : 1.0f;
+    }
+    return 1.0f;
 }
 
-static vec3_t vec3_scale(vec3_t v, float scale) {
-    return (vec3_t) {v.x * scale, v.y * scale, v.z * scale};
+static void shade_to_rgb(const scene_t *scene, vec3_t position, vec3_t normal, vec3_t view_direction, uint8_t *rgb) {
+    lighting_t lighting = blinn_phong_shading(scene->light, position, normal, view_direction, 20.0f,
+                                              light_visibility(scene, position, normal));
+    rgb[0] = (uint8_t) clampf(lighting.color.x * 255, 0, 255);
+    rgb[1] = (uint8_t) clampf(lighting.color.y * 255, 0, 255);
+    rgb[2] = (uint8_t) clampf(lighting.color.z * 255, 0, 255);
 }
 
-static vec3_t vec3_add(vec3_t a, vec3_t b) {
-    return (vec3_t) {a.x + b.x, a.y + b.y, a.z + b.z};
+typedef struct {
+    const scene_t *scene;
+    const vec3_t *normals;
+    uint32_t *colors;
+} vertex_colors_range_t;
+
+static void vertex_colors_range(void *context, size_t begin, size_t end) {
+    const vertex_colors_range_t *job = context;
+    const scene_t *scene = job->scene;
+    for (size_t i = begin; i < end; i++) {
+        vec3_t position = scene->mesh->unique_vertices[i];
+        vec3_t view_direction = vec3_normalized(vec3_sub(scene->camera.origin, position));
+        vec3_t normal = job->normals[i];
+        if (vec3_dot(normal, view_direction) < 0) normal = vec3_scale(normal, -1.0f);
+        uint8_t rgb[3];
+        shade_to_rgb(scene, position, normal, view_direction, rgb);
+        job->colors[i] = splat_pack_color(rgb[0], rgb[1], rgb[2]);
+    }
 }
 
-static vec3_t vec3_sub(vec3_t a, vec3_t b) {
-    return (vec3_t) {a.x - b.x, a.y - b.y, a.z - b.z};
+// The light and camera are static, so points are lit once up front and splatting only moves colors around
+static uint32_t *compute_vertex_colors(const scene_t *scene) {
+    const mesh_t *mesh = scene->mesh;
+    vec3_t *normals = malloc(mesh->num_unique_vertices * sizeof(vec3_t));
+    uint32_t *colors = malloc(mesh->num_unique_vertices * sizeof(uint32_t));
+    if (normals == NULL || colors == NULL) {
+        free(normals);
+        free(colors);
+        return NULL;
+    }
+    mesh_vertex_normals(mesh, normals);
+    vertex_colors_range_t job = {scene, normals, colors};
+    parallel_for(mesh->num_unique_vertices, 4096, vertex_colors_range, &job);
+    free(normals);
+    return colors;
 }
 
-static float vec3_dot(vec3_t a, vec3_t b) {
-    return a.x * b.x + a.y * b.y + a.z * b.z;
+static void render_points(const scene_t *scene, const camera_region_t *region, uint8_t *pixels) {
+    splat_framebuffer_clear(scene->splat_framebuffer);
+    splat_points(scene->splat_framebuffer, &scene->camera, region, scene->mesh->unique_vertices,
+                 scene->vertex_colors, scene->mesh->num_unique_vertices);
+    splat_resolve(scene->splat_framebuffer, pixels, scene->fill_holes);
 }
 
-static float clampf(float value, float min, float max) {
-    if (value < min) return min;
-    if (value > max) return max;
-    return value;
+static bool trace_mesh(const scene_t *scene, ray_t ray, ray_hit_t *hit) {
+    if (scene->components != NULL) return mesh_components_intersect(scene->components, scene->mesh, ray, hit);
+    if (scene->meshlets != NULL) return mesh_meshlets_intersect(scene->meshlets, ray, hit);
+    if (scene->bvh != NULL) return bvh_intersect(scene->bvh, scene->mesh, ray, hit);
+    bool found = false;
+    for (size_t i = 0; i < scene->num_parts; i++) {
+        const mesh_part_t *part = scene->parts + i;
+        if (!atomic_load_explicit(&((mesh_part_t *) part)->ready, memory_order_acquire)) continue;
+        found |= bvh_intersect(&part->bvh, scene->mesh, ray, hit);
+    }
+    return found;
 }
 
-static bool ray_sphere_intersection(ray_t r, sphere_t s, float *t) {
-    vec3_t oc = {r.origin.x - s.center.x, r.origin.y - s.center.y, r.origin.z - s.center.z};
-    float a = r.direction.x * r.direction.x + r.direction.y * r.direction.y + r.direction.z * r.direction.z;
-    float b = 2.0f * (oc.x * r.direction.x + oc.y * r.direction.y + oc.z * r.direction.z);
-    float c = oc.x * oc.x + oc.y * oc.y + oc.z * oc.z - s.radius * s.radius;
-    float discriminant = b * b - 4 * a * c;
-    if (discriminant < 0) {
+// A primary ray through the given output pixel, with the hit cache its hit is predicted from the last frame
+static bool trace_scene(const scene_t *scene, ray_t ray, float pixel_cone, hit_cache_t *hit_cache, size_t pixel,
+                        hit_cache_stats_t *cache_stats, vec3_t *position, vec3_t *normal, vec3_t *albedo) {
+    *albedo = (vec3_t) {1.0f, 1.0f, 1.0f};
+    if (scene->mode == RENDER_MODE_SDF && scene->sdf != NULL) {
+        float t;
+        if (!sdf_trace(scene->sdf, ray, INFINITY, pixel_cone, &t)) return false;
+        *position = vec3_add(ray.origin, vec3_scale(ray.direction, t));
+        *normal = sdf_normal(scene->sdf, *position);
+        return true;
+    }
+
+    ray_hit_t hit = {INFINITY, 0, 0, 0};
+    if (hit_cache != NULL && scene->components == NULL && scene->meshlets == NULL && scene->bvh != NULL) {
+        if (!hit_cache_intersect(hit_cache, scene->bvh, scene->mesh, pixel, ray, &hit, cache_stats)) return false;
+    } else if (!trace_mesh(scene, ray, &hit)) {
         return false;
+    }
+    vec3_t a, b, c;
+    mesh_triangle(scene->mesh, hit.triangle_index, &a, &b, &c);
+    *position = vec3_add(ray.origin, vec3_scale(ray.direction, hit.t));
+    *normal = vec3_normalized(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+    // Mesh winding is not trusted, always shade the side facing the viewer
+    if (vec3_dot(*normal, ray.direction) > 0) *normal = vec3_scale(*normal, -1.0f);
+    if (scene->thickness != NULL) {
+        *albedo = thickness_color_at(scene->mesh, scene->thickness, scene->thickness_limit, hit);
+    }
+    return true;
+}
+
+typedef struct {
+    const scene_t *scene;
+    const camera_region_t *region;
+    int width;
+    int height;
+    int num_tiles_x;
+    // Only pixels on the stride grid are traced, minus those on the grid of the previous pass if it is not 0
+    int stride;
+    int previous_stride;
+    // Items to render when set, otherwise every item is a whole tile
+    const tile_schedule_t *schedule;
+    hit_cache_t *hit_cache;
+    // Tiles that can see geometry and the rectangle around all of it, everything is traced without them
+    const uint8_t *tile_visible;
+    camera_screen_rect_t visible_rect;
+    uint8_t *pixels;
+    atomic_size_t num_hits;
+} render_job_t;
+
+// Gathers the even bits of a Morton code, the odd bits are the other coordinate
+static uint32_t morton_compact_bits(uint32_t code) {
+    code &= 0x55555555u;
+    code = (code | (code >> 1)) & 0x33333333u;
+    code = (code | (code >> 2)) & 0x0F0F0F0Fu;
+    code = (code | (code >> 4)) & 0x00FF00FFu;
+    code = (code | (code >> 8)) & 0x0000FFFFu;
+    return code;
+}
+
+// Traces cells [first_cell, end_cell) of a tile, a cell is the pixel at the top left of a stride x stride block.
+// Cells are numbered in the pixel order, so with Morton order a quarter of the cells is a quarter of the tile.
+static size_t render_tile_cells(render_job_t *job, size_t tile, int first_cell, int end_cell, uint32_t *num_rays) {
+    const scene_t *scene = job->scene;
+    int width = job->width, height = job->height;
+    float pixel_cone = 2.0f / ((float) job->region->frame_height * job->region->scale);
+    int x0 = (int) (tile % job->num_tiles_x) * RENDER_TILE_SIZE;
+    int y0 = (int) (tile / job->num_tiles_x) * RENDER_TILE_SIZE;
+    int x1 = x0 + RENDER_TILE_SIZE < width ? x0 + RENDER_TILE_SIZE : width;
+    int y1 = y0 + RENDER_TILE_SIZE < height ? y0 + RENDER_TILE_SIZE : height;
+    int stride = job->stride, previous_stride = job->previous_stride;
+    int cells_per_side = RENDER_TILE_SIZE / stride;
+    bool culled_tile = job->tile_visible != NULL && !job->tile_visible[tile];
+    camera_screen_rect_t rect = job->visible_rect;
+    size_t num_hits = 0;
+    hit_cache_stats_t cache_stats = {0};
+    for (int cell = first_cell; cell < end_cell; cell++) {
+        int i, j;
+        if (scene->pixel_order == PIXEL_ORDER_MORTON) {
+            i = x0 + (int) morton_compact_bits((uint32_t) cell) * stride;
+            j = y0 + (int) morton_compact_bits((uint32_t) cell >> 1) * stride;
+        } else {
+            i = x0 + cell % cells_per_side * stride;
+            j = y0 + cell / cells_per_side * stride;
+        }
+        // Border tiles are cut off by the image
+        if (i >= x1 || j >= y1) continue;
+        if (previous_stride != 0 && i % previous_stride == 0 && j % previous_stride == 0) continue;
+        uint8_t *pixel = job->pixels + 3 * ((size_t) j * width + i);
+        if (culled_tile || (job->tile_visible != NULL && ((float) i < rect.min_x || (float) i > rect.max_x ||
+                                                          (float) j < rect.min_y || (float) j > rect.max_y))) {
+            pixel[0] = pixel[1] = pixel[2] = 0;
+            continue;
+        }
+        ray_t ray = camera_region_ray(&scene->camera, job->region, i, j);
+        vec3_t position, normal, albedo;
+        (*num_rays)++;
+        if (trace_scene(scene, ray, pixel_cone, job->hit_cache, (size_t) j * width + i, &cache_stats, &position,
+                        &normal, &albedo)) {
+            shade_to_rgb(scene, position, normal, vec3_scale(ray.direction, -1.0f), pixel);
+            pixel[0] = (uint8_t) (pixel[0] * albedo.x);
+            pixel[1] = (uint8_t) (pixel[1] * albedo.y);
+            pixel[2] = (uint8_t) (pixel[2] * albedo.z);
+            num_hits++;
+        } else {
+            pixel[0] = pixel[1] = pixel[2] = 0;
+        }
+    }
+    if (job->hit_cache != NULL) hit_cache_add_stats(job->hit_cache, &cache_stats);
+    return num_hits;
+}
+
+static void render_tiles(void *context, size_t begin, size_t end) {
+    render_job_t *job = context;
+    int cells_per_side = RENDER_TILE_SIZE / job->stride;
+    int num_cells = cells_per_side * cells_per_side;
+    size_t num_hits = 0;
+    for (size_t item = begin; item < end; item++) {
+        uint32_t num_rays = 0;
+        if (job->schedule == NULL) {
+            num_hits += render_tile_cells(job, item, 0, num_cells, &num_rays);
+            continue;
+        }
+        const tile_schedule_item_t *scheduled = job->schedule->items + item;
+        int part_cells = num_cells / scheduled->num_parts;
+        double start = timing_seconds();
+        num_hits += render_tile_cells(job, scheduled->tile, scheduled->part * part_cells,
+                                      (scheduled->part + 1) * part_cells, &num_rays);
+        tile_schedule_record((tile_schedule_t *) job->schedule, scheduled->tile, timing_seconds() - start, num_rays);
+    }
+    atomic_fetch_add_explicit(&job->num_hits, num_hits, memory_order_relaxed);
+}
+
+// Nearest upsampling, every stride x stride block takes the color of its traced top left pixel
+static void render_fill_tiles(void *context, size_t begin, size_t end) {
+    render_job_t *job = context;
+    int width = job->width, height = job->height, stride = job->stride;
+    for (size_t tile = begin; tile < end; tile++) {
+        int x0 = (int) (tile % job->num_tiles_x) * RENDER_TILE_SIZE;
+        int y0 = (int) (tile / job->num_tiles_x) * RENDER_TILE_SIZE;
+        int x1 = x0 + RENDER_TILE_SIZE < width ? x0 + RENDER_TILE_SIZE : width;
+        int y1 = y0 + RENDER_TILE_SIZE < height ? y0 + RENDER_TILE_SIZE : height;
+        for (int j = y0; j < y1; j++) {
+            for (int i = x0; i < x1; i++) {
+                if (i % stride == 0 && j % stride == 0) continue;
+                const uint8_t *sample = job->pixels + 3 * ((size_t) (j - j % stride) * width + (i - i % stride));
+                memcpy(job->pixels + 3 * ((size_t) j * width + i), sample, 3);
+            }
+        }
+    }
+}
+
+static void cull_mark_bounds(const scene_t *scene, const camera_region_t *region, aabb_t bounds, int num_tiles_x,
+                             int num_tiles_y, uint8_t *tile_visible, camera_screen_rect_t *visible_rect) {
+    camera_screen_rect_t rect = camera_project_bounds(&scene->camera, region, bounds);
+    // A pixel margin covers rounding, rays go through pixel centers
+    rect.min_x = maxf(rect.min_x - 1.0f, -1.0f);
+    rect.min_y = maxf(rect.min_y - 1.0f, -1.0f);
+    rect.max_x = minf(rect.max_x + 1.0f, (float) (num_tiles_x * RENDER_TILE_SIZE));
+    rect.max_y = minf(rect.max_y + 1.0f, (float) (num_tiles_y * RENDER_TILE_SIZE));
+    if (!(rect.min_x <= rect.max_x && rect.min_y <= rect.max_y)) return;
+    visible_rect->min_x = minf(visible_rect->min_x, rect.min_x);
+    visible_rect->min_y = minf(visible_rect->min_y, rect.min_y);
+    visible_rect->max_x = maxf(visible_rect->max_x, rect.max_x);
+    visible_rect->max_y = maxf(visible_rect->max_y, rect.max_y);
+    int tx0 = rect.min_x < 0.0f ? 0 : (int) rect.min_x / RENDER_TILE_SIZE;
+    int ty0 = rect.min_y < 0.0f ? 0 : (int) rect.min_y / RENDER_TILE_SIZE;
+    int tx1 = (int) rect.max_x / RENDER_TILE_SIZE, ty1 = (int) rect.max_y / RENDER_TILE_SIZE;
+    if (tx1 >= num_tiles_x) tx1 = num_tiles_x - 1;
+    if (ty1 >= num_tiles_y) ty1 = num_tiles_y - 1;
+    for (int ty = ty0; ty <= ty1; ty++) {
+        memset(tile_visible + (size_t) ty * num_tiles_x + tx0, 1, (size_t) (tx1 - tx0 + 1));
+    }
+}
+
+// Marks the tiles that the projected bounds of whatever trace_scene would trace overlap, every instance on its own.
+//@returns the rectangle around all of them
+static camera_screen_rect_t cull_tiles(const scene_t *scene, const camera_region_t *region, int num_tiles_x,
+                                       int num_tiles_y, uint8_t *tile_visible) {
+    camera_screen_rect_t visible_rect = {INFINITY, INFINITY, -INFINITY, -INFINITY};
+    memset(tile_visible, 0, (size_t) num_tiles_x * num_tiles_y);
+    if (scene->mode == RENDER_MODE_SDF && scene->sdf != NULL) {
+        cull_mark_bounds(scene, region, sdf_bounds(scene->sdf), num_tiles_x, num_tiles_y, tile_visible,
+                         &visible_rect);
+    } else if (scene->components != NULL) {
+        for (size_t i = 0; i < scene->components->num_components; i++) {
+            cull_mark_bounds(scene, region, scene->components->components[i].bounds, num_tiles_x, num_tiles_y,
+                             tile_visible, &visible_rect);
+        }
+    } else if (scene->bvh != NULL) {
+        cull_mark_bounds(scene, region, scene->mesh->bounds, num_tiles_x, num_tiles_y, tile_visible, &visible_rect);
     } else {
-        *t = (-b - sqrtf(discriminant)) / (2.0f * a);
-        return true;
+        for (size_t i = 0; i < scene->num_parts; i++) {
+            const mesh_part_t *part = scene->parts + i;
+            if (!atomic_load_explicit(&((mesh_part_t *) part)->ready, memory_order_acquire)) continue;
+            if (part->bvh.num_prims == 0) continue;
+            cull_mark_bounds(scene, region, bvh_node_bounds(part->bvh.nodes), num_tiles_x, num_tiles_y,
+                             tile_visible, &visible_rect);
+        }
     }
+    return visible_rect;
 }
 
-static bool
-ray_sphere_intersection_with_normal_and_position(ray_t r, sphere_t s, float *t, vec3_t *normal, vec3_t *position) {
-    if (ray_sphere_intersection(r, s, t)) {
-        *position = vec3_add(r.origin, vec3_scale(r.direction, *t));
-        *normal = vec3_scale(vec3_sub(*position, s.center), 1.0f / s.radius);
-        return true;
+static size_t render_region_stride(const scene_t *scene, const camera_region_t *region, int stride,
+                                   int previous_stride, uint8_t *pixels) {
+    if (scene->shadows == SHADOWS_MAP && scene->shadow_map != NULL && scene->bvh != NULL) {
+        shadow_map_update(scene->shadow_map, scene->mesh, scene->light.position);
+    }
+    if (scene->mode == RENDER_MODE_POINTS && scene->vertex_colors != NULL) {
+        render_points(scene, region, pixels);
+        return 0;
+    }
+    int width = camera_region_output_width(region), height = camera_region_output_height(region);
+    int num_tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int num_tiles_y = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    size_t num_tiles = (size_t) num_tiles_x * num_tiles_y;
+    tile_schedule_t *schedule = scene->tile_schedule;
+    if (schedule != NULL && !tile_schedule_resize(schedule, num_tiles)) schedule = NULL;
+    render_job_t job = {.scene = scene,
+                        .region = region,
+                        .width = width,
+                        .height = height,
+                        .num_tiles_x = num_tiles_x,
+                        .stride = stride,
+                        .previous_stride = previous_stride,
+                        .schedule = schedule,
+                        .pixels = pixels};
+    if (scene->hit_cache != NULL && hit_cache_prepare(scene->hit_cache, scene->mesh, (size_t) width * height)) {
+        job.hit_cache = scene->hit_cache;
+    }
+    uint8_t *tile_visible = scene->bounds_culling ? malloc(num_tiles) : NULL;
+    if (tile_visible != NULL) {
+        job.visible_rect = cull_tiles(scene, region, num_tiles_x, num_tiles_y, tile_visible);
+        job.tile_visible = tile_visible;
+    }
+    if (schedule != NULL) {
+        int cells_per_side = RENDER_TILE_SIZE / stride;
+        tile_schedule_plan(schedule, job_system.num_workers + 1, cells_per_side * cells_per_side);
+        parallel_for(schedule->num_items, 1, render_tiles, &job);
+        tile_schedule_learn(schedule);
     } else {
+        parallel_for(num_tiles, 1, render_tiles, &job);
+    }
+    if (stride > 1) parallel_for(num_tiles, 16, render_fill_tiles, &job);
+    free(tile_visible);
+    return atomic_load(&job.num_hits);
+}
+
+// Renders only the region of the frame into an RGB8 image of the region's output size, as tiles on the job system.
+// Pixels match the whole frame rendered at the region scale, e.g. for inspectors and tile servers.
+//@returns the number of pixels that hit the surface
+static size_t render_region(const scene_t *scene, const camera_region_t *region, uint8_t *pixels) {
+    return render_region_stride(scene, region, 1, 0, pixels);
+}
+
+// One pass of coarse to fine rendering. Strides go RENDER_TILE_SIZE, ..., 4, 2, 1: the first pass traces every
+// stride-th pixel, later passes only the pixels the coarser passes skipped. Gaps are filled with the nearest traced
+// pixel, so every pass leaves a complete image and the last one is identical to render_region.
+// Points are splatted whole in every pass.
+//@returns the number of traced pixels that hit the surface
+static size_t render_region_pass(const scene_t *scene, const camera_region_t *region, int stride, uint8_t *pixels) {
+    return render_region_stride(scene, region, stride, stride < RENDER_TILE_SIZE ? 2 * stride : 0, pixels);
+}
+
+// Renders an RGB8 frame, returns the number of pixels that hit the surface
+static size_t render_frame(const scene_t *scene, int width, int height, uint8_t *pixels) {
+    camera_region_t region = camera_region_full(width, height);
+    return render_region(scene, &region, pixels);
+}
+
+// True if the scene shows something else than the one it is compared with, e.g. moved or got a better structure
+static bool scene_view_changed(const scene_t *scene, const scene_t *other) {
+    return memcmp(&scene->camera, &other->camera, sizeof(camera_t)) != 0 || scene->bvh != other->bvh ||
+           scene->components != other->components || scene->meshlets != other->meshlets ||
+           scene->sdf != other->sdf || scene->vertex_colors != other->vertex_colors ||
+           scene->thickness != other->thickness;
+}
+
+// Puts the light above and to the left of the camera, bright enough to reach the mesh at any scale
+static void place_light(scene_t *scene, aabb_t bounds) {
+    float radius = 0.5f * vec3_length(vec3_sub(bounds.max, bounds.min));
+    scene->light.color = (vec3_t) {1.0f, 1.0f, 1.0f};
+    scene->light.position = vec3_add(scene->camera.origin,
+                                     vec3_scale(vec3_sub(scene->camera.up, scene->camera.right), radius));
+    scene->light.power = vec3_length_squared(vec3_sub(scene->light.position, aabb_center(bounds)));
+}
+
+// Points the camera at the bounds
+static void frame_scene(scene_t *scene, aabb_t bounds) {
+    scene->camera = camera_frame_bounds(bounds);
+    place_light(scene, bounds);
+}
+
+typedef enum {
+    CAMERA_PATH_TURNTABLE,
+    CAMERA_PATH_FLYTHROUGH,
+} camera_path_t;
+
+static void place_camera_on_path(scene_t *scene, camera_path_t path, int frame, int num_frames) {
+    aabb_t bounds = scene->mesh->bounds;
+    if (path == CAMERA_PATH_TURNTABLE) {
+        scene->camera = camera_turntable(bounds, (float) frame / (float) num_frames);
+    } else {
+        scene->camera = camera_flythrough(bounds, num_frames > 1 ? (float) frame / (float) (num_frames - 1) : 0.5f);
+    }
+    place_light(scene, bounds);
+}
+
+typedef struct {
+    render_job_t *jobs;
+    size_t num_tiles;
+} render_views_job_t;
+
+static void render_views_tiles(void *context, size_t begin, size_t end) {
+    render_views_job_t *batch = context;
+    for (size_t item = begin; item < end; item++) {
+        render_job_t *job = batch->jobs + item / batch->num_tiles;
+        uint32_t num_rays = 0;
+        size_t num_hits = render_tile_cells(job, item % batch->num_tiles, 0, RENDER_TILE_SIZE * RENDER_TILE_SIZE,
+                                            &num_rays);
+        atomic_fetch_add_explicit(&job->num_hits, num_hits, memory_order_relaxed);
+    }
+}
+
+// Renders the region from many cameras in one call, the light follows each camera like it does everywhere else.
+// Tiles of all views go through one parallel_for, so threads move on to the next view instead of waiting for the
+// slowest tile of each. A shadow map would differ per view, views are shadowed by rays instead.
+//@param pixels one output image per camera
+static bool render_views(const scene_t *scene, const camera_t *cameras, size_t num_views,
+                         const camera_region_t *region, uint8_t **pixels) {
+    if (scene->mode == RENDER_MODE_POINTS && scene->vertex_colors != NULL) {
+        // Points share one framebuffer and are lit once for the framing camera, they go one view at a time
+        for (size_t view = 0; view < num_views; view++) {
+            scene_t view_scene = *scene;
+            view_scene.camera = cameras[view];
+            render_region(&view_scene, region, pixels[view]);
+        }
+        return true;
+    }
+    int width = camera_region_output_width(region), height = camera_region_output_height(region);
+    int num_tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    int num_tiles_y = (height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    size_t num_tiles = (size_t) num_tiles_x * num_tiles_y;
+    scene_t *scenes = malloc(num_views * sizeof(scene_t));
+    render_job_t *jobs = malloc(num_views * sizeof(render_job_t));
+    uint8_t *tile_visible = malloc(num_views * num_tiles);
+    if (scenes == NULL || jobs == NULL || tile_visible == NULL) {
+        puts("Failed to allocate memory");
+        free(scenes);
+        free(jobs);
+        free(tile_visible);
         return false;
     }
+    for (size_t view = 0; view < num_views; view++) {
+        scenes[view] = *scene;
+        scenes[view].camera = cameras[view];
+        place_light(scenes + view, scene->mesh->bounds);
+        if (scenes[view].shadows == SHADOWS_MAP) scenes[view].shadows = SHADOWS_RAY;
+        scenes[view].hit_cache = NULL;
+        jobs[view] = (render_job_t) {.scene = scenes + view,
+                                     .region = region,
+                                     .width = width,
+                                     .height = height,
+                                     .num_tiles_x = num_tiles_x,
+                                     .stride = 1,
+                                     .pixels = pixels[view]};
+        if (scene->bounds_culling) {
+            jobs[view].tile_visible = tile_visible + view * num_tiles;
+            jobs[view].visible_rect = cull_tiles(scenes + view, region, num_tiles_x, num_tiles_y,
+                                                 tile_visible + view * num_tiles);
+        }
+    }
+    render_views_job_t batch = {jobs, num_tiles};
+    parallel_for(num_views * num_tiles, 1, render_views_tiles, &batch);
+    free(scenes);
+    free(jobs);
+    free(tile_visible);
+    return true;
 }
 
-static lighting_t
-blinn_phong_shading(point_light_t pl, vec3_t surface_position, vec3_t surface_normal, vec3_t view_direction,
-                    float specular_hardness) {
-    if (pl.power < 0) {
-        return (lighting_t) {{0, 0, 0},
-                             {0, 0, 0}};
+// Renders the canonical views of the mesh in one batch and writes them as prefix_00.ppm, prefix_01.ppm, ...
+static bool render_canonical_views(const scene_t *scene, const camera_region_t *region, const char *prefix) {
+    int width = camera_region_output_width(region), height = camera_region_output_height(region);
+    camera_t cameras[CAMERA_NUM_CANONICAL_VIEWS];
+    uint8_t *pixels[CAMERA_NUM_CANONICAL_VIEWS];
+    uint8_t *buffer = malloc(CAMERA_NUM_CANONICAL_VIEWS * 3 * (size_t) width * height);
+    if (buffer == NULL) {
+        puts("Failed to allocate memory");
+        return false;
+    }
+    for (int view = 0; view < CAMERA_NUM_CANONICAL_VIEWS; view++) {
+        cameras[view] = camera_canonical_view(scene->mesh->bounds, view);
+        pixels[view] = buffer + view * 3 * (size_t) width * height;
+    }
+    double start = timing_seconds();
+    bool ok = render_views(scene, cameras, CAMERA_NUM_CANONICAL_VIEWS, region, pixels);
+    double seconds = timing_seconds() - start;
+    for (int view = 0; ok && view < CAMERA_NUM_CANONICAL_VIEWS; view++) {
+        char filepath[4096];
+        snprintf(filepath, sizeof(filepath), "%s_%02d.ppm", prefix, view);
+        ok = image_write_ppm(filepath, pixels[view], width, height);
     }
+    if (ok) {
+        printf("Rendered %d views in %.2f ms, %.2f ms/view\n", CAMERA_NUM_CANONICAL_VIEWS, seconds * 1e3,
+               seconds / CAMERA_NUM_CANONICAL_VIEWS * 1e3);
+    }
+    free(buffer);
+    return ok;
+}
 
-    lighting_t out;
+// Renders a camera path into a video, frames alternate between two buffers so that converting and writing
+// one frame overlaps rendering the next. The light follows the camera, point colors stay lit from the start.
+static bool render_video(scene_t scene, const camera_region_t *region, video_writer_t *writer, camera_path_t path,
+                         int num_frames) {
+    int width = writer->width, height = writer->height;
+    uint8_t *pixels[2] = {malloc(3 * (size_t) width * height), malloc(3 * (size_t) width * height)};
+    if (pixels[0] == NULL || pixels[1] == NULL) {
+        puts("Failed to allocate memory");
+        free(pixels[0]);
+        free(pixels[1]);
+        video_writer_close(writer);
+        return false;
+    }
 
-    vec3_t light_direction = vec3_sub(pl.position, surface_position);
-    float distance_squared = vec3_length_squared(light_direction);
-    float distance = sqrtf(distance_squared);
-    light_direction = vec3_scale(light_direction, 1.0f / distance);
+    double start = timing_seconds(), render_seconds = 0.0;
+    for (int frame = 0; frame < num_frames; frame++) {
+        place_camera_on_path(&scene, path, frame, num_frames);
+        double render_start = timing_seconds();
+        render_region(&scene, region, pixels[frame % 2]);
+        render_seconds += timing_seconds() - render_start;
+        video_writer_submit(writer, pixels[frame % 2]);
+    }
+    bool ok = video_writer_close(writer);
+    double seconds = timing_seconds() - start;
+    printf("Rendered %d frames in %.2f s, %.2f fps, %.1f%% of the time spent rendering\n", num_frames, seconds,
+           (double) num_frames / seconds, 100.0 * render_seconds / seconds);
+    free(pixels[0]);
+    free(pixels[1]);
+    return ok;
+}
 
-    // Diffuse
-    float NdotL = vec3_dot(surface_normal, light_direction);
-    float intensity = clampf(NdotL, 0.0f, 1.0f);
-    out.color = vec3_scale(pl.color, intensity * pl.power / distance_squared);
+// Renders the camera path over and over straight into the slots of a shared memory ring,
+// stops after num_frames frames or never if num_frames is 0
+static void serve_shared_memory(scene_t scene, const camera_region_t *region, shm_ring_t *ring, camera_path_t path,
+                                int path_frames, uint64_t num_frames) {
+    double start = timing_seconds();
+    for (uint64_t frame = 0; num_frames == 0 || frame < num_frames; frame++) {
+        place_camera_on_path(&scene, path, (int) (frame % (uint64_t) path_frames), path_frames);
+        uint8_t *pixels = shm_ring_begin_frame(ring);
+        render_region(&scene, region, pixels);
+        shm_ring_publish_frame(ring);
+        if ((frame + 1) % 100 == 0) {
+            printf("Published %" PRIu64 " frames, %.2f fps\n", frame + 1,
+                   (double) (frame + 1) / (timing_seconds() - start));
+        }
+    }
+}
 
-    // Specular
-    vec3_t half_vector = vec3_normalized(vec3_add(light_direction, view_direction));
-    float NdotH = vec3_dot(surface_normal, half_vector);
-    float specular_intensity = powf(clampf(NdotH, 0.0f, 1.0f), specular_hardness);
-    out.specular = vec3_scale(pl.color, specular_intensity * pl.power / distance_squared);
+// Serves the camera path to one TCP client at a time as changed tiles, a new client starts with a whole frame.
+// Stops after num_frames frames or never if num_frames is 0.
+static bool serve_tcp(scene_t scene, const camera_region_t *region, int port, camera_path_t path, int path_frames,
+                      uint64_t num_frames) {
+    int width = camera_region_output_width(region), height = camera_region_output_height(region);
+    int listen_fd = net_listen(port);
+    if (listen_fd < 0) {
+        puts("Failed to listen");
+        return false;
+    }
+    net_encoder_t encoder;
+    uint8_t *pixels = malloc(3 * (size_t) width * height);
+    if (pixels == NULL || !net_encoder_create(&encoder, width, height)) {
+        puts("Failed to allocate memory");
+        free(pixels);
+        close(listen_fd);
+        return false;
+    }
 
-    return out;
+    uint64_t frame = 0;
+    while (num_frames == 0 || frame < num_frames) {
+        printf("Waiting for a client on port %d\n", port);
+        int client_fd = net_accept(listen_fd);
+        if (client_fd < 0) break;
+        net_encoder_reset(&encoder);
+        uint64_t first_frame = frame;
+        size_t num_sent_bytes = 0, num_sent_tiles = 0;
+        for (; num_frames == 0 || frame < num_frames; frame++) {
+            place_camera_on_path(&scene, path, (int) (frame % (uint64_t) path_frames), path_frames);
+            render_region(&scene, region, pixels);
+            uint32_t num_changed = net_encode_frame(&encoder, pixels);
+            if (!net_send_frame(client_fd, &encoder, num_changed)) break;
+            num_sent_bytes += sizeof(net_frame_header_t) + encoder.payload_size;
+            num_sent_tiles += num_changed;
+        }
+        uint64_t num_client_frames = frame - first_frame;
+        if (num_client_frames > 0) {
+            printf("Sent %" PRIu64 " frames, %.1f%% of the tiles, %.2f KiB/frame, %.2f%% of raw RGB\n",
+                   num_client_frames, 100.0 * (double) num_sent_tiles / (double) (encoder.num_tiles * num_client_frames),
+                   (double) num_sent_bytes / (double) num_client_frames / 1024.0,
+                   100.0 * (double) num_sent_bytes / (3.0 * width * height * (double) num_client_frames));
+        }
+        close(client_fd);
+    }
+    net_encoder_free(&encoder);
+    free(pixels);
+    close(listen_fd);
+    return true;
+}
+
+// Meshes loading or loaded ahead of rendering per thread, bounds how many meshes are in memory at once
+#define THUMBNAIL_SLOTS_PER_THREAD 2
+
+typedef struct {
+    char filepath[4096];
+    mesh_t mesh;
+    bool ok;
+    job_t *load_job;
+} thumbnail_slot_t;
+
+static void thumbnail_load_job(void *data) {
+    thumbnail_slot_t *slot = data;
+    slot->ok = mesh_load_stl(slot->filepath, &slot->mesh);
+}
+
+static void thumbnail_start_loading(thumbnail_slot_t *slot, const char *input_dir, const char *relative_path) {
+    snprintf(slot->filepath, sizeof(slot->filepath), "%s/%s", input_dir, relative_path);
+    slot->ok = false;
+    slot->load_job = job_create_background(thumbnail_load_job, slot);
+    if (slot->load_job == NULL) {
+        thumbnail_load_job(slot);
+    } else {
+        job_submit(slot->load_job);
+    }
+}
+
+// Renders a size x size thumbnail of every STL file below input_dir to the same relative path below output_dir,
+// as PPM. Meshes load as background jobs on idle workers while the calling thread renders the ones already loaded
+// with the help of all workers, in file order through a fixed ring of slots.
+static int render_thumbnails(const char *input_dir, const char *output_dir, int size) {
+    if (size < 1) {
+        puts("Expected a thumbnail size of at least 1");
+        return 1;
+    }
+    job_system_init(0);
+    double start = timing_seconds();
+    file_list_t files;
+    if (!file_list_collect(&files, input_dir, ".stl")) return 1;
+    printf("Found %zu STL files in %.2f ms\n", files.num_paths, (timing_seconds() - start) * 1e3);
+
+    size_t num_slots = (size_t) THUMBNAIL_SLOTS_PER_THREAD * (job_system.num_workers + 1);
+    thumbnail_slot_t *slots = calloc(num_slots, sizeof(thumbnail_slot_t));
+    uint8_t *pixels = malloc(3 * (size_t) size * size);
+    if (slots == NULL || pixels == NULL) {
+        puts("Failed to allocate memory");
+        free(slots);
+        free(pixels);
+        file_list_free(&files);
+        return 1;
+    }
+    start = timing_seconds();
+    for (size_t i = 0; i < num_slots && i < files.num_paths; i++) {
+        thumbnail_start_loading(slots + i, input_dir, files.paths[i]);
+    }
+
+    size_t num_failed = 0;
+    for (size_t i = 0; i < files.num_paths; i++) {
+        thumbnail_slot_t *slot = slots + i % num_slots;
+        job_wait(slot->load_job);
+        job_release(slot->load_job);
+        slot->load_job = NULL;
+
+        bool ok = slot->ok && slot->mesh.num_tris > 0;
+        bvh_t bvh = {0};
+        if (ok) ok = bvh_build_mesh(&bvh, &slot->mesh, 0, slot->mesh.num_tris);
+        if (ok) {
+            scene_t scene = {.mode = RENDER_MODE_BVH, .mesh = &slot->mesh, .bvh = &bvh, .bounds_culling = true};
+            // Framed from the bounds the loader reduced while welding
+            frame_scene(&scene, slot->mesh.bounds);
+            render_frame(&scene, size, size, pixels);
+            char output_filepath[4096];
+            int length = snprintf(output_filepath, sizeof(output_filepath), "%s/%s", output_dir, files.paths[i]);
+            // Replaces the .stl extension, a truncated path would get it in place of its last characters instead
+            ok = length >= 0 && (size_t) length < sizeof(output_filepath);
+            if (ok) snprintf(output_filepath + length - 4, 5, ".ppm");
+            ok = ok && file_make_parent_directories(output_filepath) &&
+                 image_write_ppm(output_filepath, pixels, size, size);
+        }
+        if (!ok) {
+            printf("Failed to make a thumbnail of %s\n", files.paths[i]);
+            num_failed++;
+        }
+        bvh_free(&bvh);
+        if (slot->ok) mesh_free(&slot->mesh);
+
+        if (i + num_slots < files.num_paths) thumbnail_start_loading(slot, input_dir, files.paths[i + num_slots]);
+        if ((i + 1) % 1000 == 0) {
+            printf("%zu / %zu thumbnails, %.1f files/s\n", i + 1, files.num_paths,
+                   (double) (i + 1) / (timing_seconds() - start));
+        }
+    }
+    double seconds = timing_seconds() - start;
+    printf("Rendered %zu thumbnails in %.2f s, %.1f files/s, %zu failed\n", files.num_paths - num_failed, seconds,
+           (double) files.num_paths / seconds, num_failed);
+    free(slots);
+    free(pixels);
+    file_list_free(&files);
+    return num_failed == 0 ? 0 : 1;
+}
+
+// Primary rays of every output pixel of the region, in raster order
+static ray_t *region_rays(const camera_t *camera, const camera_region_t *region) {
+    int width = camera_region_output_width(region), height = camera_region_output_height(region);
+    ray_t *rays = malloc((size_t) width * height * sizeof(ray_t));
+    if (rays == NULL) return NULL;
+    for (int j = 0; j < height; j++) {
+        for (int i = 0; i < width; i++) rays[(size_t) j * width + i] = camera_region_ray(camera, region, i, j);
+    }
+    return rays;
+}
+
+// Shades a hit that only comes with the unnormalized normal of its triangle, misses are background
+static void shade_paged_hit(const scene_t *scene, ray_t ray, ray_hit_t hit, vec3_t normal, uint8_t *rgb) {
+    if (hit.t == INFINITY) {
+        rgb[0] = rgb[1] = rgb[2] = 0;
+        return;
+    }
+    normal = vec3_normalized(normal);
+    if (vec3_dot(normal, ray.direction) > 0) normal = vec3_scale(normal, -1.0f);
+    shade_to_rgb(scene, vec3_add(ray.origin, vec3_scale(ray.direction, hit.t)), normal,
+                 vec3_scale(ray.direction, -1.0f), rgb);
+}
+
+// Renders the default view of a pages file written with --write-pages, keeping at most resident_mib of it in
+// memory, the mesh itself is never loaded
+static int render_pages(const char *pages_filepath, const char *output_filepath, int resident_mib) {
+    job_system_init(0);
+    paged_bvh_t paged;
+    if (!paged_bvh_open(&paged, pages_filepath, (size_t) resident_mib * 1024 * 1024 / PAGED_BVH_PAGE_SIZE)) {
+        return 1;
+    }
+    scene_t scene = {0};
+    frame_scene(&scene, paged.header.bounds);
+    camera_region_t region = camera_region_full(640, 480);
+    size_t num_pixels = (size_t) region.width * region.height;
+    ray_t *rays = region_rays(&scene.camera, &region);
+    ray_hit_t *hits = malloc(num_pixels * sizeof(ray_hit_t));
+    vec3_t *normals = malloc(num_pixels * sizeof(vec3_t));
+    uint8_t *pixels = malloc(3 * num_pixels);
+    bool ok = rays != NULL && hits != NULL && normals != NULL && pixels != NULL;
+    if (!ok) puts("Failed to allocate memory");
+    if (ok) {
+        for (size_t i = 0; i < num_pixels; i++) hits[i] = (ray_hit_t) {INFINITY, 0, 0, 0};
+        double start = timing_seconds();
+        ok = paged_bvh_trace(&paged, rays, hits, normals, num_pixels);
+        double seconds = timing_seconds() - start;
+        if (ok) {
+            printf("Traced %zu rays through %u pages of %d KiB, %zu resident at most, in %.2f ms, %zu page loads, "
+                   "%.2f waits/ray\n",
+                   num_pixels, paged.header.num_pages, PAGED_BVH_PAGE_SIZE / 1024, paged.max_resident,
+                   seconds * 1e3, paged.num_loads, (double) paged.num_deferred / (double) num_pixels);
+        }
+    }
+    for (size_t i = 0; ok && i < num_pixels; i++) shade_paged_hit(&scene, rays[i], hits[i], normals[i], pixels + 3 * i);
+    ok = ok && image_write_ppm(output_filepath, pixels, region.width, region.height);
+    free(rays);
+    free(hits);
+    free(normals);
+    free(pixels);
+    paged_bvh_close(&paged);
+    return ok ? 0 : 1;
+}
+
+// Shows frames streamed by serve_tcp, the window takes the size of the first frame
+static int view_tcp(const char *address) {
+    int socket_fd = net_connect(address);
+    if (socket_fd < 0) {
+        puts("Failed to connect");
+        return 1;
+    }
+    net_frame_header_t header;
+    if (!net_receive_header(socket_fd, &header)) {
+        close(socket_fd);
+        return 1;
+    }
+    // The header was checked, its dimensions fit an int
+    int width = (int) header.width, height = (int) header.height;
+    uint8_t *pixels = calloc(3 * (size_t) width * height, 1);
+    uint8_t *payload = NULL;
+    size_t payload_capacity = 0, num_received_bytes = 0;
+    uint64_t num_frames = 0;
+    bool ok = pixels != NULL;
+    if (ok) {
+        nano_gui_create_fixed_size_window(width, height);
+    } else {
+        puts("Failed to allocate memory");
+    }
+    while (ok && nano_gui_process_events()) {
+        if (num_frames > 0) {
+            ok = net_receive_header(socket_fd, &header) && header.width == (uint32_t) width &&
+                 header.height == (uint32_t) height;
+        }
+        ok = ok && net_receive_tiles(socket_fd, &header, pixels, &payload, &payload_capacity);
+        if (!ok) break;
+        num_frames++;
+        num_received_bytes += sizeof(header) + header.payload_size;
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                const uint8_t *pixel = pixels + 3 * ((size_t) j * width + i);
+                nano_gui_draw_pixel(i, j, pixel[0], pixel[1], pixel[2]);
+            }
+        }
+    }
+    printf("Received %" PRIu64 " frames, %.2f KiB/frame\n", num_frames,
+           num_frames > 0 ? (double) num_received_bytes / (double) num_frames / 1024.0 : 0.0);
+    free(pixels);
+    free(payload);
+    close(socket_fd);
+    return 0;
+}
+
+// Shows the latest complete frame of a shared memory ring, copied out of its slot and drawn once it is known whole
+static int view_shared_memory(const char *name) {
+    shm_ring_t ring;
+    if (!shm_ring_open(&ring, name)) return 1;
+    int width = ring.header->width, height = ring.header->height;
+    size_t frame_size = 3 * (size_t) width * height;
+    uint8_t *frame_pixels = malloc(frame_size);
+    if (frame_pixels == NULL) {
+        puts("Failed to allocate memory");
+        shm_ring_close(&ring);
+        return 1;
+    }
+    nano_gui_create_fixed_size_window(width, height);
+    uint64_t shown_frame = UINT64_MAX;
+    size_t num_torn = 0;
+    while (nano_gui_process_events()) {
+        uint64_t frame, sequence;
+        const uint8_t *pixels;
+        if (!shm_ring_acquire(&ring, &frame, &pixels, &sequence) || frame == shown_frame) {
+            usleep(1000);
+            continue;
+        }
+        memcpy(frame_pixels, pixels, frame_size);
+        // A torn copy is dropped, the next complete frame takes its place
+        if (!shm_ring_validate(&ring, frame, sequence)) {
+            num_torn++;
+            continue;
+        }
+        for (int j = 0; j < height; j++) {
+            for (int i = 0; i < width; i++) {
+                const uint8_t *pixel = frame_pixels + 3 * ((size_t) j * width + i);
+                nano_gui_draw_pixel(i, j, pixel[0], pixel[1], pixel[2]);
+            }
+        }
+        shown_frame = frame;
+    }
+    printf("Last frame shown: %" PRIu64 ", torn reads: %zu\n", shown_frame, num_torn);
+    free(frame_pixels);
+    shm_ring_close(&ring);
+    return 0;
+}
+
+// The BVH cost of the removed triangles is estimated from the per triangle cost of the BVH without them
+static void print_load_summary(const mesh_t *mesh, const bvh_t *bvh, double seconds) {
+    printf("Loaded %zu triangles, %zu unique vertices in %.2f ms\n", mesh->num_tris, mesh->num_unique_vertices,
+           seconds * 1e3);
+    size_t num_removed = mesh->num_degenerate_tris + mesh->num_duplicate_tris;
+    if (num_removed == 0) return;
+    double index_memory = (double) (num_removed * 3 * sizeof(uint32_t));
+    double bvh_memory = bvh != NULL && mesh->num_tris > 0
+                                ? (double) bvh_memory_size(bvh) / (double) mesh->num_tris * (double) num_removed
+                                : 0.0;
+    printf("Removed %zu degenerate and %zu duplicate triangles (%.2f%% fewer to intersect), "
+           "saving %.2f MiB of indices and %.2f MiB of BVH\n",
+           mesh->num_degenerate_tris, mesh->num_duplicate_tris,
+           100.0 * (double) num_removed / (double) (mesh->num_tris + num_removed), index_memory / (1024.0 * 1024.0),
+           bvh_memory / (1024.0 * 1024.0));
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    int resolution;
+    sdf_t sdf;
+    atomic_bool ready;
+} sdf_build_job_t;
+
+static void sdf_build_job(void *data) {
+    sdf_build_job_t *job = data;
+    double start = timing_seconds();
+    if (!sdf_build(&job->sdf, job->mesh, job->resolution)) {
+        puts("Failed to build SDF");
+        return;
+    }
+    printf("Built SDF with %zu bricks in %.2f ms\n", job->sdf.num_allocated_bricks, (timing_seconds() - start) * 1e3);
+    atomic_store_explicit(&job->ready, true, memory_order_release);
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    mesh_components_t components;
+    atomic_bool ready;
+} components_build_job_t;
+
+static void components_build_job(void *data) {
+    components_build_job_t *job = data;
+    double start = timing_seconds();
+    if (!mesh_components_build(&job->components, job->mesh)) {
+        puts("Failed to split mesh into components");
+        return;
+    }
+    printf("Split mesh into %zu components, %zu unique shapes in %.2f ms\n", job->components.num_components,
+           job->components.num_unique_shapes, (timing_seconds() - start) * 1e3);
+    atomic_store_explicit(&job->ready, true, memory_order_release);
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    const bvh_t *bvh;
+    mesh_meshlets_t meshlets;
+    atomic_bool ready;
+} meshlets_build_job_t;
+
+static void meshlets_build_job(void *data) {
+    meshlets_build_job_t *job = data;
+    double start = timing_seconds();
+    if (!mesh_meshlets_build(&job->meshlets, job->mesh, job->bvh)) {
+        puts("Failed to cluster mesh into meshlets");
+        return;
+    }
+    size_t num_meshlets = job->meshlets.num_meshlets > 0 ? job->meshlets.num_meshlets : 1;
+    printf("Clustered mesh into %zu meshlets of %.1f vertices and %.1f triangles on average in %.2f ms\n",
+           job->meshlets.num_meshlets, (double) job->meshlets.num_vertices / (double) num_meshlets,
+           (double) job->meshlets.num_tris / (double) num_meshlets, (timing_seconds() - start) * 1e3);
+    atomic_store_explicit(&job->ready, true, memory_order_release);
+}
+
+typedef struct {
+    const mesh_t *mesh;
+    const bvh_t *bvh;
+    int num_samples;
+    float limit;
+    float *thickness;
+    atomic_bool ready;
+} thickness_job_t;
+
+static void thickness_job(void *data) {
+    thickness_job_t *job = data;
+    const mesh_t *mesh = job->mesh;
+    double start = timing_seconds();
+    job->thickness = malloc((mesh->num_unique_vertices > 0 ? mesh->num_unique_vertices : 1) * sizeof(float));
+    if (job->thickness == NULL || !mesh_wall_thickness(mesh, job->bvh, job->num_samples, job->thickness)) {
+        puts("Failed to allocate memory");
+        free(job->thickness);
+        job->thickness = NULL;
+        return;
+    }
+    double seconds = timing_seconds() - start;
+    float thinnest = INFINITY;
+    size_t num_thin = 0, num_open = 0;
+    for (size_t i = 0; i < mesh->num_unique_vertices; i++) {
+        thinnest = minf(thinnest, job->thickness[i]);
+        num_thin += job->thickness[i] < job->limit;
+        num_open += isinf(job->thickness[i]);
+    }
+    double num_rays = (double) mesh->num_unique_vertices * job->num_samples;
+    printf("Measured wall thickness at %zu vertices in %.2f ms, %.2f Mrays/s\n", mesh->num_unique_vertices,
+           seconds * 1e3, num_rays / seconds * 1e-6);
+    printf("Thinnest wall %g, %zu vertices thinner than %g, %zu without an opposite wall\n", thinnest, num_thin,
+           job->limit, num_open);
+    atomic_store_explicit(&job->ready, true, memory_order_release);
+}
+
+typedef struct {
+    // Copy of the scene framed to the complete mesh, the same framing the main loop ends up with
+    scene_t scene;
+    uint32_t *colors;
+    atomic_bool ready;
+} vertex_colors_job_t;
+
+static void vertex_colors_job(void *data) {
+    vertex_colors_job_t *job = data;
+    frame_scene(&job->scene, job->scene.mesh->bounds);
+    job->colors = compute_vertex_colors(&job->scene);
+    if (job->colors == NULL) {
+        puts("Failed to allocate memory");
+        return;
+    }
+    atomic_store_explicit(&job->ready, true, memory_order_release);
+}
+
+// Runs fn as a background job once dependency finished. Without memory for the job it runs right away on the
+// calling thread instead, after waiting for dependency.
+static job_t *start_derived_build(job_fn fn, void *data, job_t *dependency) {
+    job_t *job = job_create_background(fn, data);
+    if (job != NULL && !job_depends_on(job, dependency)) {
+        job_release(job);
+        job = NULL;
+    }
+    if (job == NULL) {
+        job_wait(dependency);
+        fn(data);
+        return NULL;
+    }
+    job_submit(job);
+    return job;
+}
+
+// Renders the same view with BVH tracing, per component BVH tracing, meshlet leaves and SDF sphere tracing and
+// reports speed, memory and agreement, then times splatting the unique vertices as points
+static void benchmark_render_modes(scene_t scene, int width, int height, int num_frames) {
+    size_t num_pixels = (size_t) width * height;
+    uint8_t *bvh_pixels = malloc(3 * num_pixels);
+    uint8_t *components_pixels = malloc(3 * num_pixels);
+    uint8_t *meshlets_pixels = malloc(3 * num_pixels);
+    uint8_t *sdf_pixels = malloc(3 * num_pixels);
+    const mesh_components_t *components = scene.components;
+    const mesh_meshlets_t *meshlets = scene.meshlets;
+    const render_mode_t modes[4] = {RENDER_MODE_BVH, RENDER_MODE_BVH, RENDER_MODE_BVH, RENDER_MODE_SDF};
+    const char *names[4] = {"BVH", "Components", "Meshlets", "SDF"};
+    uint8_t *outputs[4] = {bvh_pixels, components_pixels, meshlets_pixels, sdf_pixels};
+    for (int m = 0; m < 4; m++) {
+        scene.mode = modes[m];
+        scene.components = m == 1 ? components : NULL;
+        scene.meshlets = m == 2 ? meshlets : NULL;
+        size_t num_hits = render_frame(&scene, width, height, outputs[m]);
+        double start = timing_seconds();
+        for (int frame = 0; frame < num_frames; frame++) {
+            render_frame(&scene, width, height, outputs[m]);
+        }
+        double seconds = (timing_seconds() - start) / num_frames;
+        size_t memory = m == 0   ? bvh_memory_size(scene.bvh)
+                        : m == 1 ? mesh_components_memory_size(components)
+                        : m == 2 ? mesh_meshlets_memory_size(meshlets)
+                                 : sdf_memory_size(scene.sdf);
+        printf("%s: %.2f ms/frame, %.2f Mrays/s, %zu hits, %.2f MiB\n", names[m], seconds * 1e3,
+               (double) num_pixels / seconds * 1e-6, num_hits, (double) memory / (1024.0 * 1024.0));
+    }
+
+    // Both BVH variants find the same closest triangles, so anything but exact ties between triangles must match
+    printf("Components match BVH: %s\n", memcmp(bvh_pixels, components_pixels, 3 * num_pixels) == 0 ? "yes" : "no");
+    printf("Meshlets match BVH: %s\n", memcmp(bvh_pixels, meshlets_pixels, 3 * num_pixels) == 0 ? "yes" : "no");
+    // Meshlets carry their own copy of the geometry, the BVH needs the mesh besides its nodes
+    size_t mesh_memory = scene.mesh->num_unique_vertices * sizeof(vec3_t) + scene.mesh->num_tris * 3 * sizeof(uint32_t);
+    printf("Geometry and acceleration structure: %.2f MiB with per triangle leaves, %.2f MiB with meshlet leaves\n",
+           (double) (bvh_memory_size(scene.bvh) + mesh_memory) / (1024.0 * 1024.0),
+           (double) mesh_meshlets_memory_size(meshlets) / (1024.0 * 1024.0));
+
+    // Coarse to fine passes add up to the whole frame, report when the first one and each finer one is done
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    scene.meshlets = NULL;
+    camera_region_t region = camera_region_full(width, height);
+    double start = timing_seconds();
+    printf("Progressive:");
+    for (int stride = RENDER_TILE_SIZE; stride >= 1; stride /= 2) {
+        render_region_pass(&scene, &region, stride, components_pixels);
+        printf(" 1/%d after %.2f ms%s", stride, (timing_seconds() - start) * 1e3, stride > 1 ? "," : "\n");
+    }
+    printf("Progressive matches BVH: %s\n",
+           memcmp(bvh_pixels, components_pixels, 3 * num_pixels) == 0 ? "yes" : "no");
+
+    size_t num_agreeing = 0;
+    for (size_t p = 0; p < num_pixels; p++) {
+        bool bvh_hit = bvh_pixels[3 * p] | bvh_pixels[3 * p + 1] | bvh_pixels[3 * p + 2];
+        bool sdf_hit = sdf_pixels[3 * p] | sdf_pixels[3 * p + 1] | sdf_pixels[3 * p + 2];
+        num_agreeing += bvh_hit == sdf_hit;
+    }
+    printf("Coverage agreement: %.2f%%\n", 100.0 * (double) num_agreeing / (double) num_pixels);
+
+    // Points are not rays, report them separately
+    scene.mode = RENDER_MODE_POINTS;
+    render_frame(&scene, width, height, bvh_pixels);
+    start = timing_seconds();
+    for (int frame = 0; frame < num_frames; frame++) {
+        render_frame(&scene, width, height, bvh_pixels);
+    }
+    double seconds = (timing_seconds() - start) / num_frames;
+    printf("Points: %.2f ms/frame, %.2f Mpoints/s\n", seconds * 1e3,
+           (double) scene.mesh->num_unique_vertices / seconds * 1e-6);
+    free(bvh_pixels);
+    free(components_pixels);
+    free(meshlets_pixels);
+    free(sdf_pixels);
+}
+
+// Renders the same view with ray traced shadows and with the cube shadow map and reports speed and agreement,
+// the map is built once up front and reused by every frame like it is for a static view
+static void benchmark_shadows(scene_t scene, shadow_map_t *shadow_map, int width, int height, int num_frames) {
+    size_t num_pixels = (size_t) width * height;
+    uint8_t *ray_pixels = malloc(3 * num_pixels);
+    uint8_t *map_pixels = malloc(3 * num_pixels);
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    scene.shadow_map = shadow_map;
+
+    scene.shadows = SHADOWS_RAY;
+    render_frame(&scene, width, height, ray_pixels);
+    double start = timing_seconds();
+    for (int frame = 0; frame < num_frames; frame++) {
+        render_frame(&scene, width, height, ray_pixels);
+    }
+    printf("Ray traced shadows: %.2f ms/frame\n", (timing_seconds() - start) / num_frames * 1e3);
+
+    scene.shadows = SHADOWS_MAP;
+    start = timing_seconds();
+    shadow_map_update(shadow_map, scene.mesh, scene.light.position);
+    double build_seconds = timing_seconds() - start;
+    start = timing_seconds();
+    for (int frame = 0; frame < num_frames; frame++) {
+        render_frame(&scene, width, height, map_pixels);
+    }
+    printf("Shadow map: %.2f ms/frame, built in %.2f ms, %d x %d x 6, %.2f MiB\n",
+           (timing_seconds() - start) / num_frames * 1e3, build_seconds * 1e3, shadow_map->resolution,
+           shadow_map->resolution, (double) shadow_map_memory_size(shadow_map) / (1024.0 * 1024.0));
+
+    // Filtered edges differ by design, count pixels within a few levels of the ray traced result
+    size_t num_agreeing = 0;
+    for (size_t p = 0; p < 3 * num_pixels; p += 3) {
+        bool agree = true;
+        for (int c = 0; c < 3; c++) agree &= abs((int) ray_pixels[p + c] - (int) map_pixels[p + c]) <= 8;
+        num_agreeing += agree;
+    }
+    printf("Shadow agreement: %.2f%%\n", 100.0 * (double) num_agreeing / (double) num_pixels);
+    free(ray_pixels);
+    free(map_pixels);
+}
+
+// Renders whole frames with all tiles on this thread so that its counters see every ray
+//@returns seconds per frame
+static double benchmark_counted_frames(render_job_t *job, const perf_counters_t *counters, int num_frames,
+                                       uint64_t totals[PERF_NUM_COUNTERS]) {
+    size_t num_tiles = (size_t) job->num_tiles_x * ((job->height + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE);
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) totals[c] = 0;
+    double seconds = 0.0;
+    for (int frame = 0; frame < num_frames; frame++) {
+        uint64_t values[PERF_NUM_COUNTERS];
+        double start = timing_seconds();
+        perf_counters_start(counters);
+        render_tiles(job, 0, num_tiles);
+        perf_counters_stop(counters, values);
+        seconds += timing_seconds() - start;
+        for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+            totals[c] = values[c] == PERF_COUNTER_MISSING || totals[c] == PERF_COUNTER_MISSING
+                                ? PERF_COUNTER_MISSING
+                                : totals[c] + values[c];
+        }
+    }
+    return seconds / num_frames;
+}
+
+static void print_counters_per_ray(const uint64_t totals[PERF_NUM_COUNTERS], double num_rays) {
+    const char *counter_names[PERF_NUM_COUNTERS] = {"L1D misses", "LLC misses", "dTLB misses", "instructions"};
+    for (int c = 0; c < PERF_NUM_COUNTERS; c++) {
+        if (totals[c] == PERF_COUNTER_MISSING) continue;
+        printf(", %.2f %s/ray", (double) totals[c] / num_rays, counter_names[c]);
+    }
+    printf("\n");
+}
+
+// Traces the same view in Z-order and in scanline order within tiles, on one thread.
+// Generic perf events only offer L1 data, last level cache and data TLB misses.
+static void benchmark_pixel_orders(scene_t scene, int width, int height, int num_frames) {
+    uint8_t *pixels = malloc(3 * (size_t) width * height);
+    perf_counters_t counters;
+    bool have_counters = perf_counters_open(&counters);
+    if (!have_counters) puts("Cache counters unavailable, only timing pixel orders");
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    camera_region_t region = camera_region_full(width, height);
+    int num_tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE;
+    const pixel_order_t orders[2] = {PIXEL_ORDER_SCANLINE, PIXEL_ORDER_MORTON};
+    const char *names[2] = {"Scanline order", "Morton order"};
+    for (int o = 0; o < 2; o++) {
+        scene.pixel_order = orders[o];
+        render_job_t job = {.scene = &scene,
+                            .region = &region,
+                            .width = width,
+                            .height = height,
+                            .num_tiles_x = num_tiles_x,
+                            .stride = 1,
+                            .pixels = pixels};
+        uint64_t totals[PERF_NUM_COUNTERS];
+        double seconds = benchmark_counted_frames(&job, &counters, num_frames, totals);
+        printf("%s: %.2f ms/frame on one thread", names[o], seconds * 1e3);
+        print_counters_per_ray(totals, (double) num_frames * width * height);
+    }
+    perf_counters_close(&counters);
+    free(pixels);
+}
+
+// Traces the same view through the BVH as built and after the van Emde Boas layout pass, on one thread.
+// The layout pays off once the nodes no longer fit the last level cache, with meshes of millions of triangles.
+static void benchmark_bvh_layouts(scene_t scene, int width, int height, int num_frames) {
+    size_t image_size = 3 * (size_t) width * height;
+    uint8_t *pixels = malloc(2 * image_size);
+    bvh_t laid_out;
+    if (pixels == NULL || !bvh_copy(&laid_out, scene.bvh) || !bvh_apply_layout(&laid_out, BVH_LAYOUT_VAN_EMDE_BOAS)) {
+        puts("Failed to allocate memory");
+        free(pixels);
+        return;
+    }
+    perf_counters_t counters;
+    if (!perf_counters_open(&counters)) puts("Cache counters unavailable, only timing BVH layouts");
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    scene.hit_cache = NULL;
+    camera_region_t region = camera_region_full(width, height);
+    const bvh_t *bvhs[2] = {scene.bvh, &laid_out};
+    const char *names[2] = {"Depth-first BVH layout", "Van Emde Boas BVH layout"};
+    for (int l = 0; l < 2; l++) {
+        scene.bvh = bvhs[l];
+        render_job_t job = {.scene = &scene,
+                            .region = &region,
+                            .width = width,
+                            .height = height,
+                            .num_tiles_x = (width + RENDER_TILE_SIZE - 1) / RENDER_TILE_SIZE,
+                            .stride = 1,
+                            .pixels = pixels + l * image_size};
+        uint64_t totals[PERF_NUM_COUNTERS];
+        double seconds = benchmark_counted_frames(&job, &counters, num_frames, totals);
+        printf("%s: %.2f ms/frame on one thread, %.1f MiB of nodes", names[l], seconds * 1e3,
+               (double) (bvhs[l]->num_nodes * sizeof(bvh_node_t)) / (1024.0 * 1024.0));
+        print_counters_per_ray(totals, (double) num_frames * width * height);
+    }
+    printf("Van Emde Boas layout matches: %s\n", memcmp(pixels, pixels + image_size, image_size) == 0 ? "yes" : "no");
+    perf_counters_close(&counters);
+    bvh_free(&laid_out);
+    free(pixels);
+}
+
+// Renders the same view with tiles in raster order and in the order predicted from the previous frame,
+// the ideal frame time is the measured work spread evenly over all threads
+static void benchmark_tile_schedule(scene_t scene, int width, int height, int num_frames) {
+    uint8_t *pixels = malloc(3 * (size_t) width * height);
+    tile_schedule_t *schedule = scene.tile_schedule;
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    int num_threads = job_system.num_workers + 1;
+
+    scene.tile_schedule = NULL;
+    render_frame(&scene, width, height, pixels);
+    double start = timing_seconds();
+    for (int frame = 0; frame < num_frames; frame++) {
+        render_frame(&scene, width, height, pixels);
+    }
+    printf("Raster tile order: %.2f ms/frame\n", (timing_seconds() - start) / num_frames * 1e3);
+
+    // The first frame only measures
+    scene.tile_schedule = schedule;
+    render_frame(&scene, width, height, pixels);
+    start = timing_seconds();
+    double work_seconds = 0.0;
+    for (int frame = 0; frame < num_frames; frame++) {
+        render_frame(&scene, width, height, pixels);
+        work_seconds += schedule->work_seconds;
+    }
+    printf("Predicted tile order: %.2f ms/frame, %zu items for %zu tiles, work / %d threads %.2f ms/frame\n",
+           (timing_seconds() - start) / num_frames * 1e3, schedule->num_items, schedule->num_tiles, num_threads,
+           work_seconds / num_threads / num_frames * 1e3);
+    free(pixels);
+}
+
+// Renders each mode with and without skipping pixels outside the projected bounds, culling must not change a pixel
+static void benchmark_bounds_culling(scene_t scene, int width, int height, int num_frames) {
+    size_t num_pixels = (size_t) width * height;
+    uint8_t *traced_pixels = malloc(3 * num_pixels);
+    uint8_t *culled_pixels = malloc(3 * num_pixels);
+    const mesh_components_t *components = scene.components;
+    const render_mode_t modes[3] = {RENDER_MODE_BVH, RENDER_MODE_BVH, RENDER_MODE_SDF};
+    const char *names[3] = {"BVH", "Components", "SDF"};
+    for (int m = 0; m < 3; m++) {
+        scene.mode = modes[m];
+        scene.components = m == 1 ? components : NULL;
+        double seconds[2];
+        for (int culling = 0; culling < 2; culling++) {
+            scene.bounds_culling = culling;
+            uint8_t *pixels = culling ? culled_pixels : traced_pixels;
+            render_frame(&scene, width, height, pixels);
+            double start = timing_seconds();
+            for (int frame = 0; frame < num_frames; frame++) {
+                render_frame(&scene, width, height, pixels);
+            }
+            seconds[culling] = (timing_seconds() - start) / num_frames;
+        }
+        printf("%s bounds culling: %.2f ms/frame, %.2f ms/frame without, same image: %s\n", names[m],
+               seconds[1] * 1e3, seconds[0] * 1e3,
+               memcmp(traced_pixels, culled_pixels, 3 * num_pixels) == 0 ? "yes" : "no");
+    }
+    free(traced_pixels);
+    free(culled_pixels);
+}
+
+// Renders a slow turntable with and without predicting each pixel's hit from the last frame and reports how often
+// the prediction held and how many BVH nodes the traversals visited
+static void benchmark_hit_cache(scene_t scene, int width, int height, int num_frames) {
+    size_t num_pixels = (size_t) width * height;
+    uint8_t *traced_pixels = malloc(3 * num_pixels);
+    uint8_t *cached_pixels = malloc(3 * num_pixels);
+    hit_cache_t cache = {0};
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    scene.hit_cache = &cache;
+    for (int enabled = 0; enabled < 2; enabled++) {
+        cache.enabled = enabled;
+        uint8_t *pixels = enabled ? cached_pixels : traced_pixels;
+        // The first frame fills the cache
+        place_camera_on_path(&scene, CAMERA_PATH_TURNTABLE, 0, 720);
+        render_frame(&scene, width, height, pixels);
+        hit_cache_reset_stats(&cache);
+        double start = timing_seconds();
+        for (int frame = 1; frame <= num_frames; frame++) {
+            place_camera_on_path(&scene, CAMERA_PATH_TURNTABLE, frame, 720);
+            render_frame(&scene, width, height, pixels);
+        }
+        double seconds = (timing_seconds() - start) / num_frames;
+        double num_rays = (double) atomic_load(&cache.num_rays);
+        if (enabled) {
+            printf("Hit cache: %.2f ms/frame, %.2f steps/ray, %.1f%% of the rays kept their triangle, "
+                   "%.1f%% started from one\n", seconds * 1e3, (double) atomic_load(&cache.num_steps) / num_rays,
+                   100.0 * (double) atomic_load(&cache.num_kept) / num_rays,
+                   100.0 * (double) atomic_load(&cache.num_predicted) / num_rays);
+        } else {
+            printf("Without hit cache: %.2f ms/frame, %.2f steps/ray\n", seconds * 1e3,
+                   (double) atomic_load(&cache.num_steps) / num_rays);
+        }
+    }
+    printf("Hit cache matches BVH: %s\n", memcmp(traced_pixels, cached_pixels, 3 * num_pixels) == 0 ? "yes" : "no");
+    hit_cache_free(&cache);
+    free(traced_pixels);
+    free(cached_pixels);
+}
+
+typedef struct {
+    const scene_t *scene;
+    const ray_t *rays;
+    ray_hit_t *hits;
+} intersect_rays_job_t;
+
+static void intersect_rays_range(void *context, size_t begin, size_t end) {
+    intersect_rays_job_t *job = context;
+    for (size_t i = begin; i < end; i++) {
+        job->hits[i] = (ray_hit_t) {INFINITY, 0, 0, 0};
+        bvh_intersect(job->scene->bvh, job->scene->mesh, job->rays[i], job->hits + i);
+    }
+}
+
+// Traces the primary rays of a frame through the pages of the BVH in a temporary file with a quarter of the pages
+// resident, and checks that they find the same hits as the BVH in memory
+static void benchmark_paged_bvh(scene_t scene, int width, int height) {
+    char pages_filepath[] = "/tmp/wonderbox-pages-XXXXXX";
+    int fd = mkstemp(pages_filepath);
+    if (fd < 0) {
+        puts("Failed to create a temporary file");
+        return;
+    }
+    close(fd);
+    paged_bvh_t paged;
+    if (!paged_bvh_write(pages_filepath, scene.bvh, scene.mesh) || !paged_bvh_open(&paged, pages_filepath, SIZE_MAX)) {
+        unlink(pages_filepath);
+        return;
+    }
+    // Slots were allocated for all pages, any smaller limit fits in them
+    paged.max_resident = paged.header.num_pages / 4 > 0 ? paged.header.num_pages / 4 : 1;
+
+    camera_region_t region = camera_region_full(width, height);
+    size_t num_rays = (size_t) width * height;
+    ray_t *rays = region_rays(&scene.camera, &region);
+    ray_hit_t *hits = malloc(num_rays * sizeof(ray_hit_t));
+    ray_hit_t *paged_hits = malloc(num_rays * sizeof(ray_hit_t));
+    vec3_t *normals = malloc(num_rays * sizeof(vec3_t));
+    if (rays != NULL && hits != NULL && paged_hits != NULL && normals != NULL) {
+        double start = timing_seconds();
+        intersect_rays_job_t job = {&scene, rays, hits};
+        parallel_for(num_rays, RENDER_TILE_SIZE * RENDER_TILE_SIZE, intersect_rays_range, &job);
+        double memory_seconds = timing_seconds() - start;
+        for (size_t i = 0; i < num_rays; i++) paged_hits[i] = (ray_hit_t) {INFINITY, 0, 0, 0};
+        start = timing_seconds();
+        bool same = paged_bvh_trace(&paged, rays, paged_hits, normals, num_rays);
+        double paged_seconds = timing_seconds() - start;
+        for (size_t i = 0; i < num_rays; i++) {
+            same &= hits[i].t == paged_hits[i].t &&
+                    (hits[i].t == INFINITY || hits[i].triangle_index == paged_hits[i].triangle_index);
+        }
+        printf("BVH in memory: %.2f ms/frame, paged BVH: %.2f ms/frame with %zu of %u pages resident, "
+               "%zu page loads, %.2f waits/ray, same hits: %s\n",
+               memory_seconds * 1e3, paged_seconds * 1e3, paged.max_resident, paged.header.num_pages,
+               paged.num_loads, (double) paged.num_deferred / (double) num_rays, same ? "yes" : "no");
+    } else {
+        puts("Failed to allocate memory");
+    }
+    free(rays);
+    free(hits);
+    free(paged_hits);
+    free(normals);
+    paged_bvh_close(&paged);
+    unlink(pages_filepath);
+}
+
+// Renders the canonical views one after another and as one batch, both must give the same images
+static void benchmark_views(scene_t scene, int width, int height) {
+    size_t image_size = 3 * (size_t) width * height;
+    uint8_t *separate = malloc(CAMERA_NUM_CANONICAL_VIEWS * image_size);
+    uint8_t *batched = malloc(CAMERA_NUM_CANONICAL_VIEWS * image_size);
+    camera_t cameras[CAMERA_NUM_CANONICAL_VIEWS];
+    uint8_t *pixels[CAMERA_NUM_CANONICAL_VIEWS];
+    scene.mode = RENDER_MODE_BVH;
+    scene.components = NULL;
+    scene.shadows = SHADOWS_NONE;
+    scene.hit_cache = NULL;
+    scene.tile_schedule = NULL;
+    for (int view = 0; view < CAMERA_NUM_CANONICAL_VIEWS; view++) {
+        cameras[view] = camera_canonical_view(scene.mesh->bounds, view);
+        pixels[view] = batched + view * image_size;
+    }
+    double start = timing_seconds();
+    for (int view = 0; view < CAMERA_NUM_CANONICAL_VIEWS; view++) {
+        scene.camera = cameras[view];
+        place_light(&scene, scene.mesh->bounds);
+        render_frame(&scene, width, height, separate + view * image_size);
+    }
+    double separate_seconds = timing_seconds() - start;
+    camera_region_t region = camera_region_full(width, height);
+    start = timing_seconds();
+    render_views(&scene, cameras, CAMERA_NUM_CANONICAL_VIEWS, &region, pixels);
+    double batched_seconds = timing_seconds() - start;
+    printf("%d views: %.2f ms one by one, %.2f ms batched, same images: %s\n", CAMERA_NUM_CANONICAL_VIEWS,
+           separate_seconds * 1e3, batched_seconds * 1e3,
+           memcmp(separate, batched, CAMERA_NUM_CANONICAL_VIEWS * image_size) == 0 ? "yes" : "no");
+    free(separate);
+    free(batched);
 }
 
 int main(int argc, char **argv) {
 
-    if (argc != 2) {
-        puts("Expected arguments: path/to/mesh.stl");
+    if (argc == 3 && strcmp(argv[1], "--shm-viewer") == 0) {
+        return view_shared_memory(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "--connect") == 0) {
+        return view_tcp(argv[2]);
+    }
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "--thumbnails") == 0) {
+        return render_thumbnails(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 128);
+    }
+    if ((argc == 4 || argc == 5) && strcmp(argv[1], "--trace-pages") == 0) {
+        return render_pages(argv[2], argv[3], argc == 5 ? atoi(argv[4]) : 256);
+    }
+    if (argc == 3 && strcmp(argv[1], "--unpublish-scene") == 0) {
+        return scene_blob_unpublish(argv[2]) ? 0 : 1;
+    }
+    if (argc < 2) {
+        puts("Expected arguments: path/to/mesh.stl [--sdf] [--sdf-resolution N] [--components] [--meshlets] "
+             "[--thickness LIMIT] [--thickness-samples N] [--points] [--fill-holes] [--benchmark] "
+             "[--export path/to/mesh.ply|obj|glb] "
+             "[--video path/to/video.y4m|rgb|-] [--video-frames N] [--video-path turntable|flythrough] [--shm /name] "
+             "[--shm-frames N] [--serve PORT] [--serve-frames N] [--region x,y,width,height] [--region-scale S] [--shadows ray|map] "
+             "[--shadow-map-resolution N] [--hit-cache] [--views path/prefix] [--bvh-layout depth-first|veb] "
+             "[--write-pages path/to/mesh.pages] [--publish-scene /name] "
+             "[--visibility sources.xyz targets.xyz output.txt] [--sample-surface N points.ply] [--sample-seed S]\n"
+             "           --attach-scene /name [same options as above]\n"
+             "           --unpublish-scene /name\n"
+             "           --shm-viewer /name\n"
+             "           --connect host:port\n"
+             "           --thumbnails input/directory output/directory [size]\n"
+             "           --trace-pages path/to/mesh.pages output.ppm [resident MiB]");
         return 0;
     }
 
     const char *stl_mesh_filepath = argv[1];
-    FILE *stl_mesh_file = fopen(stl_mesh_filepath, "rb");
-    if (stl_mesh_file == NULL) {
-        puts("Failed to open file");
-        return 1;
+    // Workers of a render farm map the scene another process published instead of loading the file themselves
+    const char *attach_name = NULL;
+    int first_option = 2;
+    if (argc >= 3 && strcmp(argv[1], "--attach-scene") == 0) {
+        attach_name = argv[2];
+        first_option = 3;
     }
-    if (fseek(stl_mesh_file, 80, SEEK_CUR) != 0) {
-        puts("Failed to seek");
-        return 1;
+    render_mode_t mode = RENDER_MODE_BVH;
+    int sdf_resolution = 128;
+    bool split_components = false;
+    bool use_meshlets = false;
+    float thickness_limit = 0.0f;
+    int thickness_samples = 1;
+    bool fill_holes = false;
+    bool benchmark = false;
+    const char *export_filepath = NULL;
+    const char *pages_filepath = NULL;
+    const char *publish_name = NULL;
+    const char *visibility_sources = NULL, *visibility_targets = NULL, *visibility_output = NULL;
+    size_t num_surface_samples = 0;
+    const char *samples_filepath = NULL;
+    uint32_t samples_seed = 0;
+    const char *video_filepath = NULL;
+    int video_frames = 120;
+    camera_path_t video_path = CAMERA_PATH_TURNTABLE;
+    const char *shm_name = NULL;
+    uint64_t shm_frames = 0;
+    int serve_port = 0;
+    uint64_t serve_frames = 0;
+    shadow_mode_t shadows = SHADOWS_NONE;
+    bool use_hit_cache = false;
+    const char *views_prefix = NULL;
+    int shadow_map_resolution = 512;
+    bvh_layout_t bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+    int width = 640, height = 480;
+    camera_region_t region = camera_region_full(width, height);
+    for (int i = first_option; i < argc; i++) {
+        if (strcmp(argv[i], "--sdf") == 0) {
+            mode = RENDER_MODE_SDF;
+        } else if (strcmp(argv[i], "--sdf-resolution") == 0 && i + 1 < argc) {
+            sdf_resolution = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--components") == 0) {
+            split_components = true;
+        } else if (strcmp(argv[i], "--meshlets") == 0) {
+            use_meshlets = true;
+        } else if (strcmp(argv[i], "--thickness") == 0 && i + 1 < argc) {
+            thickness_limit = strtof(argv[++i], NULL);
+            if (!(thickness_limit > 0.0f)) {
+                printf("Invalid thickness: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--thickness-samples") == 0 && i + 1 < argc) {
+            thickness_samples = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--points") == 0) {
+            mode = RENDER_MODE_POINTS;
+        } else if (strcmp(argv[i], "--fill-holes") == 0) {
+            fill_holes = true;
+        } else if (strcmp(argv[i], "--benchmark") == 0) {
+            benchmark = true;
+        } else if (strcmp(argv[i], "--export") == 0 && i + 1 < argc) {
+            export_filepath = argv[++i];
+        } else if (strcmp(argv[i], "--write-pages") == 0 && i + 1 < argc) {
+            pages_filepath = argv[++i];
+        } else if (strcmp(argv[i], "--visibility") == 0 && i + 3 < argc) {
+            visibility_sources = argv[++i];
+            visibility_targets = argv[++i];
+            visibility_output = argv[++i];
+        } else if (strcmp(argv[i], "--sample-surface") == 0 && i + 2 < argc) {
+            num_surface_samples = strtoull(argv[++i], NULL, 10);
+            samples_filepath = argv[++i];
+        } else if (strcmp(argv[i], "--sample-seed") == 0 && i + 1 < argc) {
+            samples_seed = (uint32_t) strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--publish-scene") == 0 && i + 1 < argc) {
+            publish_name = argv[++i];
+        } else if (strcmp(argv[i], "--video") == 0 && i + 1 < argc) {
+            video_filepath = argv[++i];
+        } else if (strcmp(argv[i], "--video-frames") == 0 && i + 1 < argc) {
+            video_frames = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if (strcmp(argv[i], "--shm-frames") == 0 && i + 1 < argc) {
+            shm_frames = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--serve-frames") == 0 && i + 1 < argc) {
+            serve_frames = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--region") == 0 && i + 1 < argc) {
+            i++;
+            if (sscanf(argv[i], "%d,%d,%d,%d", &region.x, &region.y, &region.width, &region.height) != 4 ||
+                region.width <= 0 || region.height <= 0) {
+                printf("Invalid region: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--region-scale") == 0 && i + 1 < argc) {
+            region.scale = strtof(argv[++i], NULL);
+            if (!(region.scale > 0.0f)) {
+                printf("Invalid region scale: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--views") == 0 && i + 1 < argc) {
+            views_prefix = argv[++i];
+        } else if (strcmp(argv[i], "--hit-cache") == 0) {
+            use_hit_cache = true;
+        } else if (strcmp(argv[i], "--shadows") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "ray") == 0) {
+                shadows = SHADOWS_RAY;
+            } else if (strcmp(argv[i], "map") == 0) {
+                shadows = SHADOWS_MAP;
+            } else {
+                printf("Unknown shadow mode: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--bvh-layout") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "depth-first") == 0) {
+                bvh_layout = BVH_LAYOUT_DEPTH_FIRST;
+            } else if (strcmp(argv[i], "veb") == 0) {
+                bvh_layout = BVH_LAYOUT_VAN_EMDE_BOAS;
+            } else {
+                printf("Unknown BVH layout: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shadow-map-resolution") == 0 && i + 1 < argc) {
+            shadow_map_resolution = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--video-path") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "turntable") == 0) {
+                video_path = CAMERA_PATH_TURNTABLE;
+            } else if (strcmp(argv[i], "flythrough") == 0) {
+                video_path = CAMERA_PATH_FLYTHROUGH;
+            } else {
+                printf("Unknown camera path: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            printf("Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
     }
-    uint32_t num_tris = 0;
-    if (fread(&num_tris, sizeof(uint32_t), 1, stl_mesh_file) != 1) {
-        puts("Failed to read number of triangles");
+
+    // The benchmark always measures whole frames, everything else shows only the region
+    if (benchmark) region = camera_region_full(width, height);
+    int output_width = camera_region_output_width(&region), output_height = camera_region_output_height(&region);
+    // Opened before anything is logged, streaming to standard output moves the log out of the way
+    video_writer_t video_writer;
+    if (video_filepath != NULL &&
+        !video_writer_open(&video_writer, video_filepath, output_width, output_height, 30)) {
         return 1;
     }
 
-    size_t num_max_unique_vertices = 3 * num_tris;
-    vec3_t *unique_vertices = malloc(num_max_unique_vertices * sizeof(vec3_t));
-    size_t num_unique_vertices = 0;
+    job_system_init(0);
+    double start = timing_seconds();
+
+    // Conversion only needs the welded mesh, none of the acceleration structures
+    if (export_filepath != NULL && attach_name == NULL) {
+        mesh_t mesh;
+        if (!mesh_load_stl(stl_mesh_filepath, &mesh)) return 1;
+        print_load_summary(&mesh, NULL, timing_seconds() - start);
+        start = timing_seconds();
+        if (!export_mesh(&mesh, export_filepath)) return 1;
+        printf("Exported %s in %.2f ms\n", export_filepath, (timing_seconds() - start) * 1e3);
+        mesh_free(&mesh);
+        return 0;
+    }
 
-    struct vec3_uint32_hash_table_node_t *preallocated_nodes = malloc(
-            num_max_unique_vertices * sizeof(struct vec3_uint32_hash_table_node_t));
-    size_t new_node_index = 0;
+    stl_stream_t stream;
+    scene_blob_t blob;
+    if (attach_name != NULL) {
+        if (!scene_blob_attach(&blob, attach_name) || !stl_stream_adopt(&stream, &blob.mesh, &blob.bvh)) return 1;
+        printf("Attached %s, %.1f MiB shared, in %.3f ms\n", attach_name, (double) blob.size / (1 << 20),
+               (timing_seconds() - start) * 1e3);
+        if (export_filepath != NULL) {
+            start = timing_seconds();
+            if (!export_mesh(&stream.mesh, export_filepath)) return 1;
+            printf("Exported %s in %.2f ms\n", export_filepath, (timing_seconds() - start) * 1e3);
+            return 0;
+        }
+    } else if (!stl_stream_start(&stream, stl_mesh_filepath, benchmark ? BVH_LAYOUT_DEPTH_FIRST : bvh_layout)) {
+        // The benchmark compares both layouts itself
+        return 1;
+    }
+    const mesh_t *mesh = &stream.mesh;
 
-    size_t num_buckets = 3 * num_tris;
-    struct vec3_uint32_hash_table_node_t **buckets = malloc(
-            num_buckets * sizeof(struct vec3_uint32_hash_table_node_t *));
-    for (size_t i = 0; i < 3 * num_tris; i++) {
-        buckets[i] = NULL;
+    // Point clouds only need the welded mesh
+    if (samples_filepath != NULL) {
+        if (!stl_stream_wait(&stream)) return 1;
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        start = timing_seconds();
+        surface_sampler_t sampler;
+        if (!surface_sampler_build(&sampler, mesh)) {
+            puts("Failed to build surface sampler");
+            return 1;
+        }
+        printf("Built alias table over %zu triangles, area %g, in %.2f ms\n", sampler.num_tris, sampler.total_area,
+               (timing_seconds() - start) * 1e3);
+        start = timing_seconds();
+        surface_samples_t samples;
+        if (!surface_samples_draw(&samples, &sampler, mesh, num_surface_samples, samples_seed)) {
+            puts("Failed to allocate memory");
+            return 1;
+        }
+        double seconds = timing_seconds() - start;
+        printf("Drew %zu points in %.2f ms, %.2f Mpoints/s\n", samples.count, seconds * 1e3,
+               (double) samples.count / seconds * 1e-6);
+        bool ok = surface_samples_write_ply(&samples, samples_filepath);
+        surface_samples_free(&samples);
+        surface_sampler_free(&sampler);
+        return ok ? 0 : 1;
     }
 
-    for (size_t triangle_index = 0; triangle_index < num_tris; triangle_index++) {
-        vec3_t triangle_normal, triangle_vertices[3];
-        uint16_t attribute_byte_count;
-        if (fread(&triangle_normal, sizeof(vec3_t), 1, stl_mesh_file) != 1) {
-            puts("Failed to read normal");
+    // Line of sight between point sets only needs the BVH over the whole mesh
+    if (visibility_sources != NULL) {
+        vec3_t *sources, *targets;
+        size_t num_sources, num_targets;
+        if (!visibility_read_points(visibility_sources, &sources, &num_sources) ||
+            !visibility_read_points(visibility_targets, &targets, &num_targets) || !stl_stream_wait(&stream)) {
             return 1;
         }
-        if (fread(&triangle_vertices, sizeof(vec3_t), 3, stl_mesh_file) != 3) {
-            puts("Failed to read vertices");
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        start = timing_seconds();
+        visibility_matrix_t matrix;
+        if (!visibility_matrix_compute(&matrix, mesh, &stream.bvh, sources, num_sources, targets, num_targets)) {
+            puts("Failed to allocate memory");
             return 1;
         }
-        if (fread(&attribute_byte_count, sizeof(uint16_t), 1, stl_mesh_file) != 1) {
-            puts("Failed to read attribute byte count");
+        double seconds = timing_seconds() - start;
+        double num_pairs = (double) num_sources * (double) num_targets;
+        printf("Traced %zu x %zu visibility pairs in %.2f ms, %.2f Mpairs/s, %.1f%% visible\n", num_sources,
+               num_targets, seconds * 1e3, num_pairs / seconds * 1e-6,
+               100.0 * (double) visibility_matrix_count(&matrix) / num_pairs);
+        bool ok = visibility_matrix_write(&matrix, visibility_output);
+        visibility_matrix_free(&matrix);
+        free(sources);
+        free(targets);
+        return ok ? 0 : 1;
+    }
+
+    // Published once, the object outlives this process until --unpublish-scene removes it
+    if (publish_name != NULL) {
+        if (!stl_stream_wait(&stream)) return 1;
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        start = timing_seconds();
+        if (!scene_blob_publish(publish_name, mesh, &stream.bvh)) return 1;
+        printf("Published %s in %.2f ms\n", publish_name, (timing_seconds() - start) * 1e3);
+        return 0;
+    }
+
+    // Pages are cut from the BVH over the whole mesh, then tracing them needs neither
+    if (pages_filepath != NULL) {
+        if (!stl_stream_wait(&stream)) return 1;
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        start = timing_seconds();
+        if (!paged_bvh_write(pages_filepath, &stream.bvh, mesh)) return 1;
+        printf("Wrote %s in %.2f ms\n", pages_filepath, (timing_seconds() - start) * 1e3);
+        return 0;
+    }
+
+    scene_t scene = {0};
+    scene.mode = mode;
+    scene.mesh = mesh;
+    scene.parts = stream.parts;
+    scene.num_parts = stream.num_chunks;
+    scene.fill_holes = fill_holes;
+    scene.shadows = shadows;
+    tile_schedule_t tile_schedule = {0};
+    scene.tile_schedule = &tile_schedule;
+    scene.bounds_culling = true;
+    hit_cache_t hit_cache = {.enabled = true};
+    if (use_hit_cache) scene.hit_cache = &hit_cache;
+    shadow_map_t shadow_map = {0};
+    if (shadows == SHADOWS_MAP || benchmark) {
+        if (shadow_map_resolution < 1 || !shadow_map_create(&shadow_map, shadow_map_resolution)) {
+            puts("Failed to allocate memory");
             return 1;
         }
-        for (int triangle_vertex_index = 0; triangle_vertex_index < 3; triangle_vertex_index++) {
-            vec3_t vertex = triangle_vertices[triangle_vertex_index];
-            uint32_t vertex_hash = hash(vertex.x, vertex.y, vertex.z);
-            uint32_t bucket_index = vertex_hash % num_buckets;
-            if (buckets[bucket_index] == NULL) {
-                // Push new hash map node
-                buckets[bucket_index] = preallocated_nodes + (new_node_index++);
-                buckets[bucket_index]->next = NULL;
-                buckets[bucket_index]->key = vertex;
-
-                // Push new vertex to unique vertices array
-                size_t new_unique_vertex_index = num_unique_vertices++;
-                buckets[bucket_index]->value = new_unique_vertex_index;
-                unique_vertices[new_unique_vertex_index] = vertex;
-            }
+        scene.shadow_map = &shadow_map;
+    }
+
+    // Products derived from the complete mesh are further nodes of the task graph
+    sdf_build_job_t sdf_job = {.mesh = mesh, .resolution = sdf_resolution};
+    job_t *sdf_build = NULL;
+    if (mode == RENDER_MODE_SDF || benchmark) {
+        sdf_build = start_derived_build(sdf_build_job, &sdf_job, stream.welded_job);
+    }
+    components_build_job_t components_job = {.mesh = mesh};
+    job_t *components_build = NULL;
+    if (split_components || benchmark) {
+        components_build = start_derived_build(components_build_job, &components_job, stream.welded_job);
+    }
+    meshlets_build_job_t meshlets_job = {.mesh = mesh, .bvh = &stream.bvh};
+    job_t *meshlets_build = NULL;
+    if (use_meshlets || benchmark) {
+        meshlets_build = start_derived_build(meshlets_build_job, &meshlets_job, stream.bvh_job);
+    }
+    thickness_job_t wall_thickness_job = {
+            .mesh = mesh, .bvh = &stream.bvh, .num_samples = thickness_samples, .limit = thickness_limit};
+    job_t *thickness_build = NULL;
+    if (thickness_limit > 0.0f) {
+        scene.thickness_limit = thickness_limit;
+        thickness_build = start_derived_build(thickness_job, &wall_thickness_job, stream.bvh_job);
+    }
+    splat_framebuffer_t splat_framebuffer = {0};
+    scene.splat_framebuffer = &splat_framebuffer;
+    vertex_colors_job_t colors_job = {.scene = scene};
+    job_t *colors_build = NULL;
+    if (mode == RENDER_MODE_POINTS || benchmark) {
+        if (!splat_framebuffer_create(&splat_framebuffer, output_width, output_height)) {
+            puts("Failed to allocate memory");
+            return 1;
         }
+        colors_build = start_derived_build(vertex_colors_job, &colors_job, stream.welded_job);
     }
 
-// TODO: build BVH
+    if (benchmark) {
+        if (!stl_stream_wait(&stream)) return 1;
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        job_wait(sdf_build);
+        job_wait(components_build);
+        job_wait(meshlets_build);
+        job_wait(colors_build);
+        if (!atomic_load(&sdf_job.ready) || !atomic_load(&components_job.ready) || !atomic_load(&meshlets_job.ready) ||
+            !atomic_load(&colors_job.ready)) {
+            return 1;
+        }
+        scene.bvh = &stream.bvh;
+        scene.components = &components_job.components;
+        scene.sdf = &sdf_job.sdf;
+        scene.vertex_colors = colors_job.colors;
+        frame_scene(&scene, mesh->bounds);
+        scene.meshlets = &meshlets_job.meshlets;
+        benchmark_render_modes(scene, width, height, 10);
+        scene.meshlets = NULL;
+        benchmark_shadows(scene, &shadow_map, width, height, 10);
+        benchmark_pixel_orders(scene, width, height, 5);
+        benchmark_bvh_layouts(scene, width, height, 5);
+        benchmark_paged_bvh(scene, width, height);
+        benchmark_tile_schedule(scene, width, height, 10);
+        benchmark_bounds_culling(scene, width, height, 10);
+        benchmark_hit_cache(scene, width, height, 10);
+        benchmark_views(scene, width, height);
+        return 0;
+    }
 
-    int width = 640, height = 480;
-    nano_gui_create_fixed_size_window(width, height);
+    // Headless, waits for what the render mode needs and renders the camera path into a video,
+    // shared memory or a TCP stream, or the canonical views into images
+    if (video_filepath != NULL || shm_name != NULL || serve_port > 0 || views_prefix != NULL) {
+        if (!stl_stream_wait(&stream)) return 1;
+        print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+        job_wait(sdf_build);
+        job_wait(components_build);
+        job_wait(meshlets_build);
+        job_wait(colors_build);
+        job_wait(thickness_build);
+        scene.bvh = &stream.bvh;
+        if (atomic_load(&wall_thickness_job.ready)) scene.thickness = wall_thickness_job.thickness;
+        if (atomic_load(&components_job.ready)) scene.components = &components_job.components;
+        if (atomic_load(&meshlets_job.ready)) scene.meshlets = &meshlets_job.meshlets;
+        if (atomic_load(&sdf_job.ready)) scene.sdf = &sdf_job.sdf;
+        if (atomic_load(&colors_job.ready)) scene.vertex_colors = colors_job.colors;
+        if (views_prefix != NULL) return render_canonical_views(&scene, &region, views_prefix) ? 0 : 1;
+        if (video_filepath != NULL) {
+            return render_video(scene, &region, &video_writer, video_path, video_frames) ? 0 : 1;
+        }
+        if (serve_port > 0) {
+            return serve_tcp(scene, &region, serve_port, video_path, video_frames, serve_frames) ? 0 : 1;
+        }
+        shm_ring_t ring;
+        if (!shm_ring_create(&ring, shm_name, output_width, output_height, 3)) return 1;
+        serve_shared_memory(scene, &region, &ring, video_path, video_frames, shm_frames);
+        shm_ring_close(&ring);
+        return 0;
+    }
 
-    point_light_t light1;
-    light1.power = 1.0f;
-    light1.color = (vec3_t) {1.0f, 1.0f, 1.0f};
-    light1.position = (vec3_t) {-1.0f, -1.0f, 0.0f};
+    uint8_t *pixels = malloc(3 * (size_t) output_width * output_height);
+    nano_gui_create_fixed_size_window(output_width, output_height);
 
-    // Main loop
+    // Main loop, frames are rendered from whatever the pipeline has produced so far. A changed view restarts
+    // coarse to fine, one pass per frame, so something shows up right away even when whole frames are slow.
+    bool loaded = false;
+    scene_t shown_scene = {0};
+    int stride = RENDER_TILE_SIZE;
+    double view_start = timing_seconds();
     while (nano_gui_process_events()) {
-        for (int i = 0; i < width; i++) {
-            for (int j = 0; j < height; j++) {
-                float x = (float) i / (float) width;
-                float y = (float) j / (float) height;
-                // Transform to NDC and correct aspect ratio
-                x = 2 * x - 1;
-                y = 2 * y - 1;
-                x *= (float) width / (float) height;
-                ray_t ray;
-                ray.direction = vec3_normalized((vec3_t) {x, y, -1.0f});
-                ray.origin = (vec3_t) {0, 0, 0};
-                sphere_t sphere = {{0, 0, -2}, 1.0f};
-
-                float depth;
-                vec3_t position, normal;
-                if (ray_sphere_intersection_with_normal_and_position(ray, sphere, &depth, &normal, &position)) {
-                    lighting_t lighting = blinn_phong_shading(light1, position, normal, ray.direction, 20.0f);
-//                    uint8_t depth_clamped = (uint8_t) clampf(depth * 255, 0, 255);
-                    uint8_t r = (uint8_t) clampf(lighting.color.x * 255, 0, 255);
-                    uint8_t g = (uint8_t) clampf(lighting.color.y * 255, 0, 255);
-                    uint8_t b = (uint8_t) clampf(lighting.color.z * 255, 0, 255);
-                    nano_gui_draw_pixel(i, j, r, g, b);
-                } else {
-                    nano_gui_draw_pixel(i, j, 0, 0, 0);
-                }
+        if (atomic_load(&stream.failed)) {
+            puts("Failed to load mesh");
+            return 1;
+        }
+        if (stl_stream_is_welded(&stream)) {
+            frame_scene(&scene, mesh->bounds);
+        } else {
+            aabb_t bounds = stl_stream_ready_bounds(&stream);
+            if (bounds.min.x <= bounds.max.x) frame_scene(&scene, bounds);
+        }
+        if (stl_stream_is_complete(&stream)) {
+            scene.bvh = &stream.bvh;
+            if (!loaded) {
+                print_load_summary(mesh, &stream.bvh, timing_seconds() - start);
+                loaded = true;
+            }
+        }
+        if (atomic_load_explicit(&sdf_job.ready, memory_order_acquire)) scene.sdf = &sdf_job.sdf;
+        if (atomic_load_explicit(&components_job.ready, memory_order_acquire)) {
+            scene.components = &components_job.components;
+        }
+        if (atomic_load_explicit(&meshlets_job.ready, memory_order_acquire)) scene.meshlets = &meshlets_job.meshlets;
+        if (atomic_load_explicit(&colors_job.ready, memory_order_acquire)) scene.vertex_colors = colors_job.colors;
+        if (atomic_load_explicit(&wall_thickness_job.ready, memory_order_acquire)) {
+            scene.thickness = wall_thickness_job.thickness;
+        }
+
+        if (scene_view_changed(&scene, &shown_scene)) {
+            stride = RENDER_TILE_SIZE;
+            view_start = timing_seconds();
+        }
+        render_region_pass(&scene, &region, stride, pixels);
+        shown_scene = scene;
+        if (loaded && stride == RENDER_TILE_SIZE) {
+            printf("First preview after %.2f ms\n", (timing_seconds() - view_start) * 1e3);
+        }
+        // Once sharp every frame is traced whole, while streaming newly loaded parts keep showing up
+        if (stride > 1) {
+            stride /= 2;
+        } else if (loaded && view_start > 0.0) {
+            printf("Sharp after %.2f ms\n", (timing_seconds() - view_start) * 1e3);
+            view_start = 0.0;
+        }
+        for (int j = 0; j < output_height; j++) {
+            for (int i = 0; i < output_width; i++) {
+                const uint8_t *pixel = pixels + 3 * ((size_t) j * output_width + i);
+                nano_gui_draw_pixel(i, j, pixel[0], pixel[1], pixel[2]);
             }
         }
     }
+    // Builds that are still running finish before the mesh they read goes away
+    stl_stream_wait(&stream);
+    job_wait(sdf_build);
+    job_wait(components_build);
+    job_wait(meshlets_build);
+    job_wait(colors_build);
+    job_wait(thickness_build);
+    job_release(sdf_build);
+    job_release(components_build);
+    job_release(meshlets_build);
+    job_release(colors_build);
+    job_release(thickness_build);
+    job_system_shutdown();
+    stl_stream_free(&stream);
+    splat_framebuffer_free(&splat_framebuffer);
+    shadow_map_free(&shadow_map);
+    sdf_free(&sdf_job.sdf);
+    mesh_components_free(&components_job.components);
+    mesh_meshlets_free(&meshlets_job.meshlets);
+    free(colors_job.colors);
+    free(wall_thickness_job.thickness);
+    tile_schedule_free(&tile_schedule);
+    free(pixels);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "vec3.h"
+
+typedef struct {
+    vec3_t *unique_vertices;
+    size_t num_unique_vertices;
+    // 3 indices into unique_vertices per triangle
+    uint32_t *indices;
+    size_t num_tris;
+    aabb_t bounds;
+    // Triangles dropped while welding
+    size_t num_degenerate_tris;
+    size_t num_duplicate_tris;
+} mesh_t;
+
+struct vec3_uint32_hash_table_node_t {
+    vec3_t key;
+    uint32_t value;
+    struct vec3_uint32_hash_table_node_t *next;
+};
+
+static void mesh_free(mesh_t *mesh) {
+    free(mesh->unique_vertices);
+    free(mesh->indices);
+    *mesh = (mesh_t) {0};
+}
+
+static void mesh_triangle(const mesh_t *mesh, size_t triangle_index, vec3_t *a, vec3_t *b, vec3_t *c) {
+    const uint32_t *tri = mesh->indices + 3 * triangle_index;
+    *a = mesh->unique_vertices[tri[0]];
+    *b = mesh->unique_vertices[tri[1]];
+    *c = mesh->unique_vertices[tri[2]];
+}
+
+#define MESH_NO_TRIANGLE UINT32_MAX
+// Squared sine of the smallest corner angle below which a triangle counts as degenerate,
+// well above the rounding noise of the cross product of collinear float edges
+#define MESH_DEGENERATE_SIN_SQUARED 1e-12f
+
+// Hash table from vertex position to unique vertex index, nodes are preallocated for the worst case.
+// A second hash table from sorted index triples to kept triangles finds duplicate triangles,
+// its chains run through triangle_next indexed by mesh triangle.
+typedef struct {
+    struct vec3_uint32_hash_table_node_t *preallocated_nodes;
+    size_t new_node_index;
+    struct vec3_uint32_hash_table_node_t **buckets;
+    size_t num_buckets;
+    uint32_t *triangle_buckets;
+    uint32_t *triangle_next;
+    size_t num_triangle_buckets;
+} mesh_welder_t;
+
+static void mesh_welder_free(mesh_welder_t *welder) {
+    free(welder->preallocated_nodes);
+    free(welder->buckets);
+    free(welder->triangle_buckets);
+    free(welder->triangle_next);
+    *welder = (mesh_welder_t) {0};
+}
+
+// Allocates a mesh and welder for num_tris triangles, the mesh starts out empty
+static bool mesh_welder_init(mesh_welder_t *welder, mesh_t *mesh, size_t num_tris) {
+    size_t num_max_unique_vertices = 3 * num_tris;
+    *mesh = (mesh_t) {0};
+    mesh->unique_vertices = malloc((num_max_unique_vertices > 0 ? num_max_unique_vertices : 1) * sizeof(vec3_t));
+    mesh->indices = malloc((num_max_unique_vertices > 0 ? num_max_unique_vertices : 1) * sizeof(uint32_t));
+    mesh->bounds = aabb_empty();
+
+    welder->preallocated_nodes = malloc(
+            (num_max_unique_vertices > 0 ? num_max_unique_vertices : 1) * sizeof(struct vec3_uint32_hash_table_node_t));
+    welder->new_node_index = 0;
+    welder->num_buckets = num_max_unique_vertices > 0 ? num_max_unique_vertices : 1;
+    welder->buckets = calloc(welder->num_buckets, sizeof(struct vec3_uint32_hash_table_node_t *));
+
+    welder->num_triangle_buckets = num_tris > 0 ? num_tris : 1;
+    welder->triangle_buckets = malloc(welder->num_triangle_buckets * sizeof(uint32_t));
+    welder->triangle_next = malloc(welder->num_triangle_buckets * sizeof(uint32_t));
+    if (welder->triangle_buckets != NULL) {
+        // All bytes 0xFF is MESH_NO_TRIANGLE
+        memset(welder->triangle_buckets, 0xFF, welder->num_triangle_buckets * sizeof(uint32_t));
+    }
+
+    if (mesh->unique_vertices == NULL || mesh->indices == NULL || welder->preallocated_nodes == NULL ||
+        welder->buckets == NULL || welder->triangle_buckets == NULL || welder->triangle_next == NULL) {
+        mesh_welder_free(welder);
+        mesh_free(mesh);
+        return false;
+    }
+    return true;
+}
+
+static uint32_t mesh_weld_vertex(mesh_welder_t *welder, mesh_t *mesh, vec3_t vertex) {
+    uint32_t vertex_hash = hash(vertex.x, vertex.y, vertex.z);
+    uint32_t bucket_index = vertex_hash % welder->num_buckets;
+
+    struct vec3_uint32_hash_table_node_t *node = welder->buckets[bucket_index];
+    while (node != NULL && !(node->key.x == vertex.x && node->key.y == vertex.y && node->key.z == vertex.z)) {
+        node = node->next;
+    }
+    if (node == NULL) {
+        // Push new hash map node
+        node = welder->preallocated_nodes + (welder->new_node_index++);
+        node->next = welder->buckets[bucket_index];
+        node->key = vertex;
+        welder->buckets[bucket_index] = node;
+
+        // Push new vertex to unique vertices array
+        size_t new_unique_vertex_index = mesh->num_unique_vertices++;
+        node->value = new_unique_vertex_index;
+        mesh->unique_vertices[new_unique_vertex_index] = vertex;
+    }
+    return node->value;
+}
+
+static void sort_triangle_indices(const uint32_t *tri, uint32_t *sorted) {
+    uint32_t a = tri[0], b = tri[1], c = tri[2];
+    sorted[0] = a < b ? (a < c ? a : c) : (b < c ? b : c);
+    sorted[2] = a > b ? (a > c ? a : c) : (b > c ? b : c);
+    // The indices are distinct, the middle one is what is left
+    sorted[1] = a ^ b ^ c ^ sorted[0] ^ sorted[2];
+}
+
+// In double, both sides grow with the fourth power of the edge length and would overflow or underflow a float
+static bool triangle_is_degenerate(vec3_t a, vec3_t b, vec3_t c) {
+    double e1x = (double) b.x - a.x, e1y = (double) b.y - a.y, e1z = (double) b.z - a.z;
+    double e2x = (double) c.x - a.x, e2y = (double) c.y - a.y, e2z = (double) c.z - a.z;
+    double cx = e1y * e2z - e1z * e2y, cy = e1z * e2x - e1x * e2z, cz = e1x * e2y - e1y * e2x;
+    double cross = cx * cx + cy * cy + cz * cz;
+    return cross <= MESH_DEGENERATE_SIN_SQUARED * (e1x * e1x + e1y * e1y + e1z * e1z) *
+                            (e2x * e2x + e2y * e2y + e2z * e2z);
+}
+
+// Takes back the vertices welded since first_vertex, newest first. Each one was pushed to the front of its
+// bucket, so it is still there when its turn comes.
+static void mesh_unweld_vertices(mesh_welder_t *welder, mesh_t *mesh, size_t first_vertex) {
+    while (mesh->num_unique_vertices > first_vertex) {
+        struct vec3_uint32_hash_table_node_t *node = welder->preallocated_nodes + --welder->new_node_index;
+        welder->buckets[hash(node->key.x, node->key.y, node->key.z) % welder->num_buckets] = node->next;
+        mesh->num_unique_vertices--;
+    }
+}
+
+// Welds triangle corner positions (3 per triangle) into the mesh, appending the kept triangles after
+// mesh->num_tris and new unique vertices after mesh->num_unique_vertices.
+// Degenerate triangles and repeats of a kept triangle (with any winding) are dropped and counted, vertices only
+// they used are not added.
+static void mesh_weld(mesh_welder_t *welder, mesh_t *mesh, const vec3_t *positions, size_t num_tris) {
+    size_t first_new_vertex = mesh->num_unique_vertices;
+    for (size_t triangle_index = 0; triangle_index < num_tris; triangle_index++) {
+        const vec3_t *corners = positions + 3 * triangle_index;
+        if (triangle_is_degenerate(corners[0], corners[1], corners[2])) {
+            mesh->num_degenerate_tris++;
+            continue;
+        }
+        uint32_t *tri = mesh->indices + 3 * mesh->num_tris;
+        size_t first_triangle_vertex = mesh->num_unique_vertices;
+        for (int k = 0; k < 3; k++) {
+            tri[k] = mesh_weld_vertex(welder, mesh, corners[k]);
+        }
+        if (tri[0] == tri[1] || tri[1] == tri[2] || tri[0] == tri[2]) {
+            mesh_unweld_vertices(welder, mesh, first_triangle_vertex);
+            mesh->num_degenerate_tris++;
+            continue;
+        }
+
+        uint32_t sorted[3];
+        sort_triangle_indices(tri, sorted);
+        uint32_t triangle_hash = int_hash32(int_hash32(int_hash32(sorted[0]) ^ sorted[1]) ^ sorted[2]);
+        uint32_t bucket_index = triangle_hash % welder->num_triangle_buckets;
+        uint32_t other = welder->triangle_buckets[bucket_index];
+        while (other != MESH_NO_TRIANGLE) {
+            uint32_t other_sorted[3];
+            sort_triangle_indices(mesh->indices + 3 * (size_t) other, other_sorted);
+            if (other_sorted[0] == sorted[0] && other_sorted[1] == sorted[1] && other_sorted[2] == sorted[2]) break;
+            other = welder->triangle_next[other];
+        }
+        if (other != MESH_NO_TRIANGLE) {
+            mesh->num_duplicate_tris++;
+            continue;
+        }
+        welder->triangle_next[mesh->num_tris] = welder->triangle_buckets[bucket_index];
+        welder->triangle_buckets[bucket_index] = mesh->num_tris;
+        mesh->num_tris++;
+    }
+    // Bounds of the vertices this batch added, in one pass instead of per vertex
+    mesh->bounds = aabb_union(mesh->bounds, aabb_of_points(mesh->unique_vertices + first_new_vertex,
+                                                           mesh->num_unique_vertices - first_new_vertex));
+}
+
+#define STL_HEADER_SIZE 84
+#define STL_TRIANGLE_SIZE 50
+
+static bool stl_read_num_tris(FILE *stl_mesh_file, uint32_t *num_tris) {
+    if (fseek(stl_mesh_file, 80, SEEK_SET) != 0) {
+        puts("Failed to seek");
+        return false;
+    }
+    if (fread(num_tris, sizeof(uint32_t), 1, stl_mesh_file) != 1) {
+        puts("Failed to read number of triangles");
+        return false;
+    }
+    return true;
+}
+
+// Reads num_tris triangle records at the current file position in one go, keeping only the vertices
+//@param raw scratch space of num_tris * STL_TRIANGLE_SIZE bytes
+static bool stl_read_triangles(FILE *stl_mesh_file, size_t num_tris, unsigned char *raw, vec3_t *positions) {
+    if (fread(raw, STL_TRIANGLE_SIZE, num_tris, stl_mesh_file) != num_tris) {
+        puts("Failed to read triangles");
+        return false;
+    }
+    for (size_t triangle_index = 0; triangle_index < num_tris; triangle_index++) {
+        // Skip the normal, the attribute byte count follows the vertices
+        memcpy(positions + 3 * triangle_index, raw + triangle_index * STL_TRIANGLE_SIZE + sizeof(vec3_t),
+               3 * sizeof(vec3_t));
+    }
+    return true;
+}
+
+#define STL_READ_BATCH_TRIANGLES 65536
+
+// Loads a binary STL file and welds identical vertex positions into an indexed mesh
+static bool mesh_load_stl(const char *filepath, mesh_t *mesh) {
+    FILE *stl_mesh_file = fopen(filepath, "rb");
+    if (stl_mesh_file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    uint32_t num_tris = 0;
+    if (!stl_read_num_tris(stl_mesh_file, &num_tris)) {
+        fclose(stl_mesh_file);
+        return false;
+    }
+
+    mesh_welder_t welder;
+    unsigned char *raw = malloc(STL_READ_BATCH_TRIANGLES * STL_TRIANGLE_SIZE);
+    vec3_t *positions = malloc(STL_READ_BATCH_TRIANGLES * 3 * sizeof(vec3_t));
+    bool ok = raw != NULL && positions != NULL && mesh_welder_init(&welder, mesh, num_tris);
+    if (!ok) {
+        puts("Failed to allocate memory");
+        free(raw);
+        free(positions);
+        fclose(stl_mesh_file);
+        return false;
+    }
+
+    for (size_t first = 0; first < num_tris && ok; first += STL_READ_BATCH_TRIANGLES) {
+        size_t count = num_tris - first < STL_READ_BATCH_TRIANGLES ? num_tris - first : STL_READ_BATCH_TRIANGLES;
+        ok = stl_read_triangles(stl_mesh_file, count, raw, positions);
+        if (ok) mesh_weld(&welder, mesh, positions, count);
+    }
+
+    mesh_welder_free(&welder);
+    free(raw);
+    free(positions);
+    fclose(stl_mesh_file);
+    if (!ok) mesh_free(mesh);
+    return ok;
+}
+
+// Area weighted vertex normals, the unnormalized cross product of each face is its area times two
+static void mesh_vertex_normals(const mesh_t *mesh, vec3_t *normals) {
+    for (size_t i = 0; i < mesh->num_unique_vertices; i++) {
+        normals[i] = (vec3_t) {0, 0, 0};
+    }
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        const uint32_t *tri = mesh->indices + 3 * triangle_index;
+        vec3_t a, b, c;
+        mesh_triangle(mesh, triangle_index, &a, &b, &c);
+        vec3_t face_normal = vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+        for (int k = 0; k < 3; k++) {
+            normals[tri[k]] = vec3_add(normals[tri[k]], face_normal);
+        }
+    }
+    for (size_t i = 0; i < mesh->num_unique_vertices; i++) {
+        float length = vec3_length(normals[i]);
+        normals[i] = length > 0.0f ? vec3_scale(normals[i], 1.0f / length) : (vec3_t) {0, 0, 1};
+    }
+}
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Clusters of up to MESHLET_MAX_TRIANGLES triangles over up to MESHLET_MAX_VERTICES vertices, with their
+// positions copied next to each other and 8 bit vertex indices local to the cluster. A BVH with one meshlet
+// per leaf then reaches all the geometry of a leaf without going through prim_indices and the mesh, which
+// are scattered over memory, and stores far fewer nodes than a BVH over single triangles. Consecutive triangles
+// of a meshlet are neighbors, bounds of every group of them let a ray skip most of the meshlet.
+
+#define MESHLET_MAX_VERTICES 64
+#define MESHLET_MAX_TRIANGLES 124
+#define MESHLET_GROUP_SIZE 8
+
+typedef struct {
+    uint32_t first_vertex;
+    uint32_t first_triangle;
+    // Groups are the triangles [first_triangle + g * MESHLET_GROUP_SIZE, + MESHLET_GROUP_SIZE)
+    uint32_t first_group;
+    uint8_t num_vertices;
+    uint8_t num_triangles;
+} meshlet_t;
+
+typedef struct {
+    meshlet_t *meshlets;
+    size_t num_meshlets;
+    vec3_t *vertices;
+    size_t num_vertices;
+    // 3 indices into the vertices of the meshlet per triangle
+    uint8_t *local_indices;
+    // Mesh triangle of each meshlet triangle, reported in hits
+    uint32_t *triangle_indices;
+    size_t num_tris;
+    aabb_t *group_bounds;
+    size_t num_groups;
+    // prim_indices index into meshlets
+    bvh_t bvh;
+} mesh_meshlets_t;
+
+static void mesh_meshlets_free(mesh_meshlets_t *meshlets) {
+    free(meshlets->meshlets);
+    free(meshlets->vertices);
+    free(meshlets->local_indices);
+    free(meshlets->triangle_indices);
+    free(meshlets->group_bounds);
+    bvh_free(&meshlets->bvh);
+    *meshlets = (mesh_meshlets_t) {0};
+}
+
+static size_t mesh_meshlets_memory_size(const mesh_meshlets_t *meshlets) {
+    return bvh_memory_size(&meshlets->bvh) + meshlets->num_meshlets * sizeof(meshlet_t) +
+           meshlets->num_vertices * sizeof(vec3_t) + meshlets->num_tris * (3 * sizeof(uint8_t) + sizeof(uint32_t)) +
+           meshlets->num_groups * sizeof(aabb_t);
+}
+
+// Packs the triangles greedily in the order of the leaves of a BVH over them, which keeps neighbors together,
+// a meshlet is closed once the next triangle would exceed either limit
+static bool mesh_meshlets_build(mesh_meshlets_t *meshlets, const mesh_t *mesh, const bvh_t *triangle_bvh) {
+    *meshlets = (mesh_meshlets_t) {0};
+    size_t num_tris = triangle_bvh->num_prims;
+    meshlets->meshlets = malloc((num_tris > 0 ? num_tris : 1) * sizeof(meshlet_t));
+    meshlets->vertices = malloc((num_tris > 0 ? 3 * num_tris : 1) * sizeof(vec3_t));
+    meshlets->local_indices = malloc((num_tris > 0 ? 3 * num_tris : 1) * sizeof(uint8_t));
+    meshlets->triangle_indices = malloc((num_tris > 0 ? num_tris : 1) * sizeof(uint32_t));
+    // Local index of each mesh vertex in the meshlet that last used it
+    uint32_t *vertex_meshlets = malloc((mesh->num_unique_vertices > 0 ? mesh->num_unique_vertices : 1) *
+                                       sizeof(uint32_t));
+    uint8_t *vertex_local_indices = malloc(mesh->num_unique_vertices > 0 ? mesh->num_unique_vertices : 1);
+    if (meshlets->meshlets == NULL || meshlets->vertices == NULL || meshlets->local_indices == NULL ||
+        meshlets->triangle_indices == NULL || vertex_meshlets == NULL || vertex_local_indices == NULL) {
+        free(vertex_meshlets);
+        free(vertex_local_indices);
+        mesh_meshlets_free(meshlets);
+        return false;
+    }
+    for (size_t v = 0; v < mesh->num_unique_vertices; v++) vertex_meshlets[v] = UINT32_MAX;
+
+    meshlet_t *meshlet = NULL;
+    for (size_t i = 0; i < num_tris; i++) {
+        uint32_t triangle_index = triangle_bvh->prim_indices[i];
+        const uint32_t *tri = mesh->indices + 3 * (size_t) triangle_index;
+        // Welding dropped degenerate triangles, the three vertices are distinct
+        int num_new_vertices = 0;
+        for (int k = 0; k < 3; k++) {
+            num_new_vertices += meshlet == NULL || vertex_meshlets[tri[k]] != meshlets->num_meshlets - 1;
+        }
+        if (meshlet == NULL || meshlet->num_triangles == MESHLET_MAX_TRIANGLES ||
+            meshlet->num_vertices + num_new_vertices > MESHLET_MAX_VERTICES) {
+            meshlet = meshlets->meshlets + meshlets->num_meshlets++;
+            *meshlet = (meshlet_t) {(uint32_t) meshlets->num_vertices, (uint32_t) meshlets->num_tris, 0, 0, 0};
+        }
+        uint32_t meshlet_index = (uint32_t) (meshlets->num_meshlets - 1);
+        for (int k = 0; k < 3; k++) {
+            if (vertex_meshlets[tri[k]] != meshlet_index) {
+                vertex_meshlets[tri[k]] = meshlet_index;
+                vertex_local_indices[tri[k]] = meshlet->num_vertices++;
+                meshlets->vertices[meshlets->num_vertices++] = mesh->unique_vertices[tri[k]];
+            }
+            meshlets->local_indices[3 * meshlets->num_tris + k] = vertex_local_indices[tri[k]];
+        }
+        meshlets->triangle_indices[meshlets->num_tris++] = triangle_index;
+        meshlet->num_triangles++;
+    }
+    free(vertex_meshlets);
+    free(vertex_local_indices);
+
+    for (size_t m = 0; m < meshlets->num_meshlets; m++) {
+        meshlet_t *cluster = meshlets->meshlets + m;
+        cluster->first_group = (uint32_t) meshlets->num_groups;
+        meshlets->num_groups += (cluster->num_triangles + MESHLET_GROUP_SIZE - 1) / MESHLET_GROUP_SIZE;
+    }
+    aabb_t *meshlet_bounds = malloc((meshlets->num_meshlets > 0 ? meshlets->num_meshlets : 1) * sizeof(aabb_t));
+    meshlets->group_bounds = malloc((meshlets->num_groups > 0 ? meshlets->num_groups : 1) * sizeof(aabb_t));
+    if (meshlet_bounds == NULL || meshlets->group_bounds == NULL) {
+        free(meshlet_bounds);
+        mesh_meshlets_free(meshlets);
+        return false;
+    }
+    for (size_t m = 0; m < meshlets->num_meshlets; m++) {
+        const meshlet_t *cluster = meshlets->meshlets + m;
+        const vec3_t *vertices = meshlets->vertices + cluster->first_vertex;
+        const uint8_t *indices = meshlets->local_indices + 3 * (size_t) cluster->first_triangle;
+        meshlet_bounds[m] = aabb_of_points(vertices, cluster->num_vertices);
+        for (uint32_t k = 0; k < cluster->num_triangles; k++) {
+            aabb_t *bounds = meshlets->group_bounds + cluster->first_group + k / MESHLET_GROUP_SIZE;
+            if (k % MESHLET_GROUP_SIZE == 0) *bounds = aabb_empty();
+            for (int c = 0; c < 3; c++) *bounds = aabb_grow(*bounds, vertices[indices[3 * k + c]]);
+        }
+    }
+    bool ok = bvh_build_leaves(&meshlets->bvh, meshlet_bounds, meshlets->num_meshlets, 1);
+    free(meshlet_bounds);
+    if (!ok) mesh_meshlets_free(meshlets);
+    return ok;
+}
+
+// Like bvh_intersect, triangles are read from the meshlet of the leaf
+static bool mesh_meshlets_intersect(const mesh_meshlets_t *meshlets, ray_t ray, ray_hit_t *hit) {
+    const bvh_t *bvh = &meshlets->bvh;
+    if (bvh->num_prims == 0) return false;
+    vec3_t inv_direction = vec3_inverse(ray.direction);
+    float t_near, t_far;
+    if (!ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes), hit->t, &t_near, &t_far)) {
+        return false;
+    }
+
+    bool found = false;
+    uint32_t stack[BVH_STACK_SIZE];
+    int stack_size = 0;
+    uint32_t node_index = 0;
+    while (true) {
+        const bvh_node_t *node = bvh->nodes + node_index;
+        if (node->count > 0) {
+            for (uint32_t i = node->left_first; i < node->left_first + node->count; i++) {
+                const meshlet_t *meshlet = meshlets->meshlets + bvh->prim_indices[i];
+                const vec3_t *vertices = meshlets->vertices + meshlet->first_vertex;
+                const uint8_t *indices = meshlets->local_indices + 3 * (size_t) meshlet->first_triangle;
+                for (uint32_t k = 0; k < meshlet->num_triangles; k++) {
+                    if (k % MESHLET_GROUP_SIZE == 0 &&
+                        !ray_aabb_intersection(ray.origin, inv_direction,
+                                               meshlets->group_bounds[meshlet->first_group + k / MESHLET_GROUP_SIZE],
+                                               hit->t, &t_near, &t_far)) {
+                        k += MESHLET_GROUP_SIZE - 1;
+                        continue;
+                    }
+                    float t, u, v;
+                    if (ray_triangle_intersection(ray, vertices[indices[3 * k]], vertices[indices[3 * k + 1]],
+                                                  vertices[indices[3 * k + 2]], &t, &u, &v) &&
+                        t < hit->t) {
+                        *hit = (ray_hit_t) {t, meshlets->triangle_indices[meshlet->first_triangle + k], u, v};
+                        found = true;
+                    }
+                }
+            }
+        } else {
+            uint32_t left = node->left_first, right = left + 1;
+            float t_left, t_right, t_unused;
+            bool hit_left = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + left),
+                                                  hit->t, &t_left, &t_unused);
+            bool hit_right = ray_aabb_intersection(ray.origin, inv_direction, bvh_node_bounds(bvh->nodes + right),
+                                                   hit->t, &t_right, &t_unused);
+            if (hit_left && hit_right) {
+                if (t_right < t_left) {
+                    uint32_t tmp = left;
+                    left = right;
+                    right = tmp;
+                }
+                stack[stack_size++] = right;
+                node_index = left;
+                continue;
+            } else if (hit_left) {
+                node_index = left;
+                continue;
+            } else if (hit_right) {
+                node_index = right;
+                continue;
+            }
+        }
+        if (stack_size == 0) break;
+        node_index = stack[--stack_size];
+    }
+    return found;
+}
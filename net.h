@@ -0,0 +1,334 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "jobs.h"
+
+// Streams RGB8 frames over TCP as the tiles that changed since the previous frame, each run length encoded.
+// Every frame is a header followed by a payload of (tile index, encoded size, encoded tile) records.
+// Integers are sent in host byte order, both ends are expected to be little endian like the STL input.
+
+#define NET_TILE_SIZE 16
+#define NET_FRAME_MAGIC 0x52464257u
+// Literal runs of at most 128 pixels with one control byte each
+#define NET_MAX_ENCODED_TILE (NET_TILE_SIZE * NET_TILE_SIZE * 3 + NET_TILE_SIZE * NET_TILE_SIZE / 128 + 1)
+// Largest width and height a receiver accepts
+#define NET_MAX_FRAME_SIDE 16384
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t num_tiles;
+    uint64_t frame;
+    uint64_t payload_size;
+} net_frame_header_t;
+
+typedef struct {
+    int width;
+    int height;
+    int num_tiles_x;
+    size_t num_tiles;
+    uint64_t frame;
+    // Last frame that was sent, tiles are compared against it
+    uint8_t *previous;
+    bool has_previous;
+    // Per tile encoding, 0 bytes for tiles that did not change
+    uint8_t *encoded;
+    uint16_t *encoded_sizes;
+    const uint8_t *pixels;
+    uint8_t *payload;
+    size_t payload_size;
+} net_encoder_t;
+
+static void net_tile_rect(int num_tiles_x, int width, int height, size_t tile, int *x0, int *y0, int *x1, int *y1) {
+    *x0 = (int) (tile % num_tiles_x) * NET_TILE_SIZE;
+    *y0 = (int) (tile / num_tiles_x) * NET_TILE_SIZE;
+    *x1 = *x0 + NET_TILE_SIZE < width ? *x0 + NET_TILE_SIZE : width;
+    *y1 = *y0 + NET_TILE_SIZE < height ? *y0 + NET_TILE_SIZE : height;
+}
+
+// Control byte with the high bit set: run of (c & 0x7F) + 1 copies of the next pixel,
+// otherwise c + 1 literal pixels follow
+static size_t net_rle_encode(const uint8_t *pixels, size_t num_pixels, uint8_t *out) {
+    uint8_t *start = out;
+    size_t i = 0;
+    while (i < num_pixels) {
+        size_t run = 1;
+        while (i + run < num_pixels && run < 128 && memcmp(pixels + 3 * i, pixels + 3 * (i + run), 3) == 0) run++;
+        if (run >= 2) {
+            *out++ = (uint8_t) (0x80 | (run - 1));
+            memcpy(out, pixels + 3 * i, 3);
+            out += 3;
+            i += run;
+            continue;
+        }
+        // Literals until the next run of at least two pixels
+        size_t literal = 1;
+        while (i + literal < num_pixels && literal < 128 &&
+               !(i + literal + 1 < num_pixels &&
+                 memcmp(pixels + 3 * (i + literal), pixels + 3 * (i + literal + 1), 3) == 0)) {
+            literal++;
+        }
+        *out++ = (uint8_t) (literal - 1);
+        memcpy(out, pixels + 3 * i, 3 * literal);
+        out += 3 * literal;
+        i += literal;
+    }
+    return out - start;
+}
+
+//@returns false if the encoded data does not decode to exactly num_pixels pixels
+static bool net_rle_decode(const uint8_t *in, size_t size, uint8_t *pixels, size_t num_pixels) {
+    const uint8_t *end = in + size;
+    size_t i = 0;
+    while (in < end) {
+        uint8_t control = *in++;
+        size_t count = (control & 0x7F) + 1;
+        if (i + count > num_pixels) return false;
+        if (control & 0x80) {
+            if (end - in < 3) return false;
+            for (size_t k = 0; k < count; k++) memcpy(pixels + 3 * (i + k), in, 3);
+            in += 3;
+        } else {
+            if ((size_t) (end - in) < 3 * count) return false;
+            memcpy(pixels + 3 * i, in, 3 * count);
+            in += 3 * count;
+        }
+        i += count;
+    }
+    return i == num_pixels;
+}
+
+// Payload of a frame in which every tile changed and none compressed
+static size_t net_max_payload_size(int width, int height) {
+    size_t num_tiles = (size_t) ((width + NET_TILE_SIZE - 1) / NET_TILE_SIZE) *
+                       ((height + NET_TILE_SIZE - 1) / NET_TILE_SIZE);
+    return num_tiles * (NET_MAX_ENCODED_TILE + 6);
+}
+
+static bool net_encoder_create(net_encoder_t *encoder, int width, int height) {
+    *encoder = (net_encoder_t) {0};
+    encoder->width = width;
+    encoder->height = height;
+    encoder->num_tiles_x = (width + NET_TILE_SIZE - 1) / NET_TILE_SIZE;
+    encoder->num_tiles = (size_t) encoder->num_tiles_x * ((height + NET_TILE_SIZE - 1) / NET_TILE_SIZE);
+    encoder->previous = malloc(3 * (size_t) width * height);
+    encoder->encoded = malloc(encoder->num_tiles * NET_MAX_ENCODED_TILE);
+    encoder->encoded_sizes = malloc(encoder->num_tiles * sizeof(uint16_t));
+    encoder->payload = malloc(net_max_payload_size(width, height));
+    if (encoder->previous == NULL || encoder->encoded == NULL || encoder->encoded_sizes == NULL ||
+        encoder->payload == NULL) {
+        free(encoder->previous);
+        free(encoder->encoded);
+        free(encoder->encoded_sizes);
+        free(encoder->payload);
+        return false;
+    }
+    return true;
+}
+
+static void net_encoder_free(net_encoder_t *encoder) {
+    free(encoder->previous);
+    free(encoder->encoded);
+    free(encoder->encoded_sizes);
+    free(encoder->payload);
+    *encoder = (net_encoder_t) {0};
+}
+
+// Forgets the previous frame, the next frame is sent whole, e.g. for a newly connected client
+static void net_encoder_reset(net_encoder_t *encoder) {
+    encoder->has_previous = false;
+}
+
+static void net_encode_tiles(void *context, size_t begin, size_t end) {
+    net_encoder_t *encoder = context;
+    int width = encoder->width;
+    uint8_t tile_pixels[NET_TILE_SIZE * NET_TILE_SIZE * 3];
+    for (size_t tile = begin; tile < end; tile++) {
+        int x0, y0, x1, y1;
+        net_tile_rect(encoder->num_tiles_x, width, encoder->height, tile, &x0, &y0, &x1, &y1);
+        size_t row_size = 3 * (size_t) (x1 - x0);
+        bool changed = !encoder->has_previous;
+        for (int j = y0; j < y1 && !changed; j++) {
+            size_t offset = 3 * ((size_t) j * width + x0);
+            changed = memcmp(encoder->pixels + offset, encoder->previous + offset, row_size) != 0;
+        }
+        if (!changed) {
+            encoder->encoded_sizes[tile] = 0;
+            continue;
+        }
+        for (int j = y0; j < y1; j++) {
+            size_t offset = 3 * ((size_t) j * width + x0);
+            memcpy(tile_pixels + (j - y0) * row_size, encoder->pixels + offset, row_size);
+            memcpy(encoder->previous + offset, encoder->pixels + offset, row_size);
+        }
+        encoder->encoded_sizes[tile] = (uint16_t) net_rle_encode(
+                tile_pixels, (size_t) (x1 - x0) * (y1 - y0), encoder->encoded + tile * NET_MAX_ENCODED_TILE);
+    }
+}
+
+// Encodes the tiles of pixels that differ from the previous frame into encoder->payload, tiles are compared
+// and encoded in parallel and then packed in tile order
+//@returns number of changed tiles
+static uint32_t net_encode_frame(net_encoder_t *encoder, const uint8_t *pixels) {
+    encoder->pixels = pixels;
+    parallel_for(encoder->num_tiles, 16, net_encode_tiles, encoder);
+    encoder->has_previous = true;
+    uint8_t *out = encoder->payload;
+    uint32_t num_changed = 0;
+    for (size_t tile = 0; tile < encoder->num_tiles; tile++) {
+        uint16_t size = encoder->encoded_sizes[tile];
+        if (size == 0) continue;
+        uint32_t index = (uint32_t) tile;
+        memcpy(out, &index, sizeof(index));
+        memcpy(out + 4, &size, sizeof(size));
+        memcpy(out + 6, encoder->encoded + tile * NET_MAX_ENCODED_TILE, size);
+        out += 6 + size;
+        num_changed++;
+    }
+    encoder->payload_size = out - encoder->payload;
+    encoder->frame++;
+    return num_changed;
+}
+
+static bool net_send_all(int socket_fd, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t sent = send(socket_fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent <= 0) return false;
+        bytes += sent;
+        size -= (size_t) sent;
+    }
+    return true;
+}
+
+static bool net_recv_all(int socket_fd, void *data, size_t size) {
+    uint8_t *bytes = data;
+    while (size > 0) {
+        ssize_t received = recv(socket_fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) continue;
+        if (received <= 0) return false;
+        bytes += received;
+        size -= (size_t) received;
+    }
+    return true;
+}
+
+//@returns false once the client is gone
+static bool net_send_frame(int socket_fd, const net_encoder_t *encoder, uint32_t num_changed) {
+    net_frame_header_t header = {NET_FRAME_MAGIC, (uint32_t) encoder->width, (uint32_t) encoder->height, num_changed,
+                                 encoder->frame, encoder->payload_size};
+    return net_send_all(socket_fd, &header, sizeof(header)) &&
+           net_send_all(socket_fd, encoder->payload, encoder->payload_size);
+}
+
+static bool net_receive_header(int socket_fd, net_frame_header_t *header) {
+    if (!net_recv_all(socket_fd, header, sizeof(*header))) return false;
+    if (header->magic != NET_FRAME_MAGIC || header->width < 1 || header->width > NET_MAX_FRAME_SIDE ||
+        header->height < 1 || header->height > NET_MAX_FRAME_SIDE ||
+        header->payload_size > net_max_payload_size((int) header->width, (int) header->height)) {
+        puts("Unexpected frame");
+        return false;
+    }
+    return true;
+}
+
+// Receives the payload of the frame whose header was just received and applies its tiles to pixels,
+// which hold the previous frame
+//@param payload scratch space that grows as needed
+static bool net_receive_tiles(int socket_fd, const net_frame_header_t *header, uint8_t *pixels, uint8_t **payload,
+                              size_t *payload_capacity) {
+    int width = (int) header->width, height = (int) header->height;
+    if (header->payload_size > *payload_capacity) {
+        uint8_t *grown = realloc(*payload, header->payload_size);
+        if (grown == NULL) return false;
+        *payload = grown;
+        *payload_capacity = header->payload_size;
+    }
+    if (!net_recv_all(socket_fd, *payload, header->payload_size)) return false;
+
+    int num_tiles_x = (width + NET_TILE_SIZE - 1) / NET_TILE_SIZE;
+    size_t num_tiles = (size_t) num_tiles_x * ((height + NET_TILE_SIZE - 1) / NET_TILE_SIZE);
+    const uint8_t *in = *payload, *end = *payload + header->payload_size;
+    uint8_t tile_pixels[NET_TILE_SIZE * NET_TILE_SIZE * 3];
+    for (uint32_t t = 0; t < header->num_tiles; t++) {
+        uint32_t tile;
+        uint16_t size;
+        if (end - in < 6) return false;
+        memcpy(&tile, in, sizeof(tile));
+        memcpy(&size, in + 4, sizeof(size));
+        in += 6;
+        if (tile >= num_tiles || (size_t) (end - in) < size) return false;
+        int x0, y0, x1, y1;
+        net_tile_rect(num_tiles_x, width, height, tile, &x0, &y0, &x1, &y1);
+        if (!net_rle_decode(in, size, tile_pixels, (size_t) (x1 - x0) * (y1 - y0))) return false;
+        in += size;
+        size_t row_size = 3 * (size_t) (x1 - x0);
+        for (int j = y0; j < y1; j++) {
+            memcpy(pixels + 3 * ((size_t) j * width + x0), tile_pixels + (j - y0) * row_size, row_size);
+        }
+    }
+    return true;
+}
+
+static int net_listen(int port) {
+    int socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_fd < 0) return -1;
+    int enable = 1;
+    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    struct sockaddr_in address = {0};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons((uint16_t) port);
+    if (bind(socket_fd, (struct sockaddr *) &address, sizeof(address)) != 0 || listen(socket_fd, 1) != 0) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+static int net_accept(int listen_fd) {
+    int socket_fd = accept(listen_fd, NULL, NULL);
+    if (socket_fd >= 0) {
+        // Frames are sent whole, there is nothing to gain from delaying the tail of one
+        int enable = 1;
+        setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    }
+    return socket_fd;
+}
+
+//@param address "host:port"
+static int net_connect(const char *address) {
+    char host[256];
+    const char *colon = strrchr(address, ':');
+    if (colon == NULL || (size_t) (colon - address) >= sizeof(host)) return -1;
+    memcpy(host, address, colon - address);
+    host[colon - address] = '\0';
+    struct addrinfo hints = {0}, *results;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &results) != 0) return -1;
+    int socket_fd = -1;
+    for (struct addrinfo *result = results; result != NULL && socket_fd < 0; result = result->ai_next) {
+        socket_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+        if (socket_fd >= 0 && connect(socket_fd, result->ai_addr, result->ai_addrlen) != 0) {
+            close(socket_fd);
+            socket_fd = -1;
+        }
+    }
+    freeaddrinfo(results);
+    return socket_fd;
+}
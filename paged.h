@@ -0,0 +1,604 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// A BVH together with its leaf triangles cut into fixed size pages of a file, for meshes that do not fit in memory.
+// Each page holds a treelet: the root or a sibling pair, and breadth first the pairs below it while they fit,
+// followed by copies of the triangles of its leaves. Inner nodes reference their children as page and index.
+//
+// The file is memory mapped and at most max_resident pages are kept in memory, the others are dropped. A ray
+// traverses exactly as bvh_intersect does until it needs a page that is not resident, then it waits in that
+// page's queue. The page with the longest queue is loaded next and all of its rays continue at once, so the
+// cost of a load is shared by many rays instead of paid by each ray on its own.
+//
+// The file is not trusted, each page is checked when it is loaded before any ray follows its references.
+
+#define PAGED_BVH_MAGIC 0x47504257u
+#define PAGED_BVH_PAGE_SIZE 65536
+// Node references are page << PAGED_BVH_NODE_BITS | index in the page
+#define PAGED_BVH_NODE_BITS 11
+#define PAGED_BVH_NONE UINT32_MAX
+// Waiting page of a ray whose path through a damaged file is deeper than its stack
+#define PAGED_BVH_TOO_DEEP (UINT32_MAX - 1)
+#define PAGED_BVH_BATCH_RAYS 65536
+#define PAGED_BVH_GRAIN 256
+
+// Fills the first page of the file, the treelet pages follow
+typedef struct {
+    uint32_t magic;
+    uint32_t page_size;
+    uint32_t num_pages;
+    uint32_t num_tris;
+    aabb_t bounds;
+} paged_bvh_header_t;
+
+// Starts every page, padded to the size of a node so that the nodes that follow stay aligned
+typedef struct {
+    uint32_t num_nodes;
+    uint32_t num_tris;
+    uint32_t padding[6];
+} paged_bvh_page_header_t;
+
+typedef struct {
+    vec3_t a;
+    vec3_t b;
+    vec3_t c;
+    uint32_t triangle_index;
+} paged_bvh_triangle_t;
+
+typedef struct {
+    ray_t ray;
+    vec3_t inv_direction;
+    ray_hit_t hit;
+    vec3_t normal;
+    // Sibling pair to test next, PAGED_BVH_NONE to continue with the stack
+    uint32_t pair;
+    // Page the ray waits for, PAGED_BVH_NONE once its closest hit is known
+    uint32_t waiting_page;
+    // Next ray in the queue of the same page
+    uint32_t next;
+    int stack_size;
+    uint32_t stack[BVH_STACK_SIZE + 1];
+} paged_ray_t;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    paged_bvh_header_t header;
+    size_t max_resident;
+    // Slot of each page, -1 while the page is not resident
+    int32_t *page_slots;
+    uint32_t *slot_pages;
+    uint64_t *slot_uses;
+    size_t num_resident;
+    uint64_t clock;
+    // Rays waiting for each page, linked through paged_ray_t.next
+    uint32_t *queue_heads;
+    uint32_t *queue_sizes;
+    // Max-heap of the pages with waiting rays by queue size, and the heap position of each page or PAGED_BVH_NONE
+    uint32_t *heap;
+    uint32_t *heap_positions;
+    uint32_t heap_size;
+    size_t num_loads;
+    size_t num_deferred;
+} paged_bvh_t;
+
+static size_t paged_bvh_node_cost(const bvh_node_t *node) {
+    return sizeof(bvh_node_t) + (node->count > 0 ? node->count * sizeof(paged_bvh_triangle_t) : 0);
+}
+
+typedef struct {
+    const bvh_t *bvh;
+    // Bytes of all nodes and triangles below each node
+    size_t *below_costs;
+    // Reference of each node, PAGED_BVH_NONE until it is placed
+    uint32_t *refs;
+    // Nodes in the order they are stored, page after page
+    uint32_t *order;
+    size_t num_ordered;
+    size_t page_start;
+    uint32_t page;
+    size_t used;
+} paged_bvh_layout_t;
+
+static size_t paged_bvh_measure(paged_bvh_layout_t *layout, uint32_t node_index) {
+    const bvh_node_t *node = layout->bvh->nodes + node_index;
+    size_t cost = 0;
+    if (node->count == 0) {
+        for (uint32_t child = node->left_first; child < node->left_first + 2; child++) {
+            cost += paged_bvh_node_cost(layout->bvh->nodes + child) + paged_bvh_measure(layout, child);
+        }
+    }
+    layout->below_costs[node_index] = cost;
+    return cost;
+}
+
+static size_t paged_bvh_pair_cost(const paged_bvh_layout_t *layout, uint32_t left) {
+    return paged_bvh_node_cost(layout->bvh->nodes + left) + paged_bvh_node_cost(layout->bvh->nodes + left + 1);
+}
+
+static void paged_bvh_place(paged_bvh_layout_t *layout, uint32_t node_index) {
+    layout->refs[node_index] =
+            layout->page << PAGED_BVH_NODE_BITS | (uint32_t) (layout->num_ordered - layout->page_start);
+    layout->order[layout->num_ordered++] = node_index;
+    layout->used += paged_bvh_node_cost(layout->bvh->nodes + node_index);
+}
+
+// Places everything below an inner node depth first
+static void paged_bvh_place_below(paged_bvh_layout_t *layout, uint32_t node_index) {
+    uint32_t left = layout->bvh->nodes[node_index].left_first;
+    paged_bvh_place(layout, left);
+    paged_bvh_place(layout, left + 1);
+    for (uint32_t child = left; child < left + 2; child++) {
+        if (layout->bvh->nodes[child].count == 0) paged_bvh_place_below(layout, child);
+    }
+}
+
+// Writes the pages of a BVH built over a mesh, the BVH and mesh are only needed for this
+static bool paged_bvh_write(const char *filepath, const bvh_t *bvh, const mesh_t *mesh) {
+    size_t num_nodes = bvh->num_nodes;
+    paged_bvh_layout_t layout = {.bvh = bvh};
+    layout.below_costs = malloc(num_nodes * sizeof(size_t));
+    layout.refs = malloc(num_nodes * sizeof(uint32_t));
+    layout.order = malloc(num_nodes * sizeof(uint32_t));
+    uint32_t *roots = malloc(num_nodes * sizeof(uint32_t));
+    size_t *page_starts = malloc((num_nodes + 1) * sizeof(size_t));
+    uint8_t *page = malloc(PAGED_BVH_PAGE_SIZE);
+    bool ok = layout.below_costs != NULL && layout.refs != NULL && layout.order != NULL && roots != NULL &&
+              page_starts != NULL && page != NULL;
+    if (!ok) puts("Failed to allocate memory");
+
+    // A page starts at the root or at a pair that did not fit in its parent's page, and takes the pairs below
+    // breadth first while they fit. Subtrees that fit whole are taken whole, and space that is left over goes
+    // to whole subtrees of pairs still waiting for a page, so that the many small treelets near the leaves
+    // share pages instead of leaving them mostly empty.
+    // An empty BVH has a root without triangles that is no leaf, the file then holds the header alone
+    size_t num_roots = 0, next_root = 0;
+    if (ok && bvh->num_prims > 0) {
+        for (size_t i = 0; i < num_nodes; i++) layout.refs[i] = PAGED_BVH_NONE;
+        paged_bvh_measure(&layout, 0);
+        roots[num_roots++] = 0;
+    }
+    while (next_root < num_roots) {
+        uint32_t first = roots[next_root++];
+        page_starts[layout.page] = layout.page_start = layout.num_ordered;
+        layout.used = sizeof(paged_bvh_page_header_t);
+        for (uint32_t n = first; n < first + (first == 0 ? 1 : 2); n++) paged_bvh_place(&layout, n);
+        // Only leaves of many triangles with the same centroid are this large
+        if (layout.used > PAGED_BVH_PAGE_SIZE) {
+            puts("Failed to fit a BVH leaf into a page");
+            ok = false;
+            break;
+        }
+        for (size_t q = layout.page_start; q < layout.num_ordered; q++) {
+            uint32_t node_index = layout.order[q];
+            const bvh_node_t *node = bvh->nodes + node_index;
+            if (node->count > 0 || layout.refs[node->left_first] != PAGED_BVH_NONE) continue;
+            if (layout.used + layout.below_costs[node_index] <= PAGED_BVH_PAGE_SIZE) {
+                paged_bvh_place_below(&layout, node_index);
+            } else if (layout.used + paged_bvh_pair_cost(&layout, node->left_first) <= PAGED_BVH_PAGE_SIZE) {
+                paged_bvh_place(&layout, node->left_first);
+                paged_bvh_place(&layout, node->left_first + 1);
+            } else {
+                roots[num_roots++] = node->left_first;
+            }
+        }
+        while (next_root < num_roots) {
+            uint32_t left = roots[next_root];
+            size_t cost = paged_bvh_pair_cost(&layout, left) + layout.below_costs[left] + layout.below_costs[left + 1];
+            if (layout.used + cost > PAGED_BVH_PAGE_SIZE) break;
+            paged_bvh_place(&layout, left);
+            paged_bvh_place(&layout, left + 1);
+            for (uint32_t child = left; child < left + 2; child++) {
+                if (bvh->nodes[child].count == 0) paged_bvh_place_below(&layout, child);
+            }
+            next_root++;
+        }
+        layout.page++;
+    }
+    uint32_t num_pages = layout.page;
+    uint32_t *refs = layout.refs, *order = layout.order;
+    if (ok) page_starts[num_pages] = layout.num_ordered;
+
+    FILE *file = ok ? fopen(filepath, "wb") : NULL;
+    if (ok && file == NULL) {
+        puts("Failed to open pages output");
+        ok = false;
+    }
+    if (ok) {
+        memset(page, 0, PAGED_BVH_PAGE_SIZE);
+        paged_bvh_header_t header = {PAGED_BVH_MAGIC, PAGED_BVH_PAGE_SIZE, num_pages, (uint32_t) bvh->num_prims,
+                                     bvh_node_bounds(bvh->nodes)};
+        memcpy(page, &header, sizeof(header));
+        ok = fwrite(page, PAGED_BVH_PAGE_SIZE, 1, file) == 1;
+    }
+    for (uint32_t p = 0; ok && p < num_pages; p++) {
+        memset(page, 0, PAGED_BVH_PAGE_SIZE);
+        paged_bvh_page_header_t *page_header = (paged_bvh_page_header_t *) page;
+        page_header->num_nodes = (uint32_t) (page_starts[p + 1] - page_starts[p]);
+        bvh_node_t *nodes = (bvh_node_t *) (page + sizeof(paged_bvh_page_header_t));
+        paged_bvh_triangle_t *triangles = (paged_bvh_triangle_t *) (nodes + page_header->num_nodes);
+        for (uint32_t i = 0; i < page_header->num_nodes; i++) {
+            bvh_node_t node = bvh->nodes[order[page_starts[p] + i]];
+            if (node.count == 0) {
+                node.left_first = refs[node.left_first];
+            } else {
+                for (uint32_t k = node.left_first; k < node.left_first + node.count; k++) {
+                    paged_bvh_triangle_t *triangle = triangles + page_header->num_tris++;
+                    triangle->triangle_index = bvh->prim_indices[k];
+                    mesh_triangle(mesh, triangle->triangle_index, &triangle->a, &triangle->b, &triangle->c);
+                }
+                node.left_first = page_header->num_tris - node.count;
+            }
+            nodes[i] = node;
+        }
+        ok = fwrite(page, PAGED_BVH_PAGE_SIZE, 1, file) == 1;
+    }
+    if (file != NULL && fclose(file) != 0) ok = false;
+    if (file != NULL && !ok) puts("Failed to write pages");
+    free(layout.below_costs);
+    free(refs);
+    free(order);
+    free(roots);
+    free(page_starts);
+    free(page);
+    return ok;
+}
+
+static void paged_bvh_close(paged_bvh_t *paged) {
+    if (paged->data != NULL) munmap((void *) paged->data, paged->size);
+    free(paged->page_slots);
+    free(paged->slot_pages);
+    free(paged->slot_uses);
+    free(paged->queue_heads);
+    free(paged->queue_sizes);
+    free(paged->heap);
+    free(paged->heap_positions);
+    *paged = (paged_bvh_t) {0};
+}
+
+//@param max_resident number of pages kept in memory at most, at least 1
+static bool paged_bvh_open(paged_bvh_t *paged, const char *filepath, size_t max_resident) {
+    *paged = (paged_bvh_t) {0};
+    int fd = open(filepath, O_RDONLY);
+    if (fd < 0) {
+        puts("Failed to open pages");
+        return false;
+    }
+    struct stat info;
+    void *memory = fstat(fd, &info) == 0 && info.st_size >= PAGED_BVH_PAGE_SIZE
+                           ? mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        puts("Failed to map pages");
+        return false;
+    }
+    paged->data = memory;
+    paged->size = (size_t) info.st_size;
+    memcpy(&paged->header, paged->data, sizeof(paged_bvh_header_t));
+    if (paged->header.magic != PAGED_BVH_MAGIC || paged->header.page_size != PAGED_BVH_PAGE_SIZE ||
+        (paged->header.num_tris > 0 && paged->header.num_pages == 0) ||
+        paged->header.num_pages > (PAGED_BVH_TOO_DEEP >> PAGED_BVH_NODE_BITS) ||
+        paged->size < ((size_t) paged->header.num_pages + 1) * PAGED_BVH_PAGE_SIZE) {
+        puts("Failed to read pages");
+        paged_bvh_close(paged);
+        return false;
+    }
+    uint32_t num_pages = paged->header.num_pages;
+    // Files of empty meshes have no pages, the arrays still get one entry
+    size_t num_entries = num_pages > 0 ? num_pages : 1;
+    paged->max_resident = max_resident < 1 ? 1 : max_resident < num_entries ? max_resident : num_entries;
+    paged->page_slots = malloc(num_entries * sizeof(int32_t));
+    paged->slot_pages = malloc(paged->max_resident * sizeof(uint32_t));
+    paged->slot_uses = malloc(paged->max_resident * sizeof(uint64_t));
+    paged->queue_heads = malloc(num_entries * sizeof(uint32_t));
+    paged->queue_sizes = calloc(num_entries, sizeof(uint32_t));
+    paged->heap = malloc(num_entries * sizeof(uint32_t));
+    paged->heap_positions = malloc(num_entries * sizeof(uint32_t));
+    if (paged->page_slots == NULL || paged->slot_pages == NULL || paged->slot_uses == NULL ||
+        paged->queue_heads == NULL || paged->queue_sizes == NULL || paged->heap == NULL ||
+        paged->heap_positions == NULL) {
+        puts("Failed to allocate memory");
+        paged_bvh_close(paged);
+        return false;
+    }
+    for (uint32_t p = 0; p < num_pages; p++) {
+        paged->page_slots[p] = -1;
+        paged->queue_heads[p] = PAGED_BVH_NONE;
+        paged->heap_positions[p] = PAGED_BVH_NONE;
+    }
+    // Nothing is resident until a ray asks for it
+    madvise(memory, paged->size, MADV_DONTNEED);
+    return true;
+}
+
+static const uint8_t *paged_bvh_page(const paged_bvh_t *paged, uint32_t page) {
+    return paged->data + ((size_t) page + 1) * PAGED_BVH_PAGE_SIZE;
+}
+
+static const bvh_node_t *paged_bvh_node(const paged_bvh_t *paged, uint32_t ref) {
+    const uint8_t *page = paged_bvh_page(paged, ref >> PAGED_BVH_NODE_BITS);
+    return (const bvh_node_t *) (page + sizeof(paged_bvh_page_header_t)) + (ref & ((1u << PAGED_BVH_NODE_BITS) - 1));
+}
+
+// Nodes and triangles fit in the page, leaves reference triangles of their page and inner nodes a sibling pair
+// within one existing page that comes after the node
+static bool paged_bvh_page_is_valid(const paged_bvh_t *paged, uint32_t page) {
+    const paged_bvh_page_header_t *page_header = (const paged_bvh_page_header_t *) paged_bvh_page(paged, page);
+    uint32_t num_nodes = page_header->num_nodes, num_tris = page_header->num_tris;
+    if (num_nodes > (1u << PAGED_BVH_NODE_BITS) ||
+        sizeof(paged_bvh_page_header_t) + (size_t) num_nodes * sizeof(bvh_node_t) +
+                        (size_t) num_tris * sizeof(paged_bvh_triangle_t) >
+                PAGED_BVH_PAGE_SIZE) {
+        return false;
+    }
+    // Rays start at the root, reference 0
+    if (page == 0 && num_nodes == 0) return false;
+    const bvh_node_t *nodes = paged_bvh_node(paged, page << PAGED_BVH_NODE_BITS);
+    for (uint32_t i = 0; i < num_nodes; i++) {
+        const bvh_node_t *node = nodes + i;
+        if (node->count > 0) {
+            if (node->left_first > num_tris || node->count > num_tris - node->left_first) return false;
+            continue;
+        }
+        uint32_t child_page = node->left_first >> PAGED_BVH_NODE_BITS;
+        uint32_t child = node->left_first & ((1u << PAGED_BVH_NODE_BITS) - 1);
+        // Children come after their parent, so no path through the file can loop
+        if (node->left_first <= (page << PAGED_BVH_NODE_BITS | i) || child_page >= paged->header.num_pages) {
+            return false;
+        }
+        const paged_bvh_page_header_t *child_header =
+                (const paged_bvh_page_header_t *) paged_bvh_page(paged, child_page);
+        if (child + 1 >= (child_page == page ? num_nodes : child_header->num_nodes)) return false;
+    }
+    return true;
+}
+
+// Takes the page into a slot, dropping the least recently used page if all slots are taken
+static void paged_bvh_make_resident(paged_bvh_t *paged, uint32_t page) {
+    int32_t slot = paged->page_slots[page];
+    if (slot < 0) {
+        if (paged->num_resident < paged->max_resident) {
+            slot = (int32_t) paged->num_resident++;
+        } else {
+            slot = 0;
+            for (size_t s = 1; s < paged->num_resident; s++) {
+                if (paged->slot_uses[s] < paged->slot_uses[slot]) slot = (int32_t) s;
+            }
+            uint32_t evicted = paged->slot_pages[slot];
+            madvise((void *) paged_bvh_page(paged, evicted), PAGED_BVH_PAGE_SIZE, MADV_DONTNEED);
+            paged->page_slots[evicted] = -1;
+        }
+        madvise((void *) paged_bvh_page(paged, page), PAGED_BVH_PAGE_SIZE, MADV_WILLNEED);
+        paged->slot_pages[slot] = page;
+        paged->page_slots[page] = slot;
+        paged->num_loads++;
+    }
+    paged->slot_uses[slot] = ++paged->clock;
+}
+
+// Traverses like bvh_intersect_counted as far as the resident pages go, then sets the page the ray waits for
+static void paged_bvh_resume(const paged_bvh_t *paged, paged_ray_t *r) {
+    while (true) {
+        uint32_t ref = r->pair != PAGED_BVH_NONE ? r->pair
+                       : r->stack_size > 0      ? r->stack[r->stack_size - 1]
+                                                : PAGED_BVH_NONE;
+        if (ref == PAGED_BVH_NONE) {
+            r->waiting_page = PAGED_BVH_NONE;
+            return;
+        }
+        uint32_t page = ref >> PAGED_BVH_NODE_BITS;
+        if (paged->page_slots[page] < 0) {
+            r->waiting_page = page;
+            return;
+        }
+        if (r->pair != PAGED_BVH_NONE) {
+            // Visit the nearer child first, postpone the other one
+            if (r->stack_size + 2 > BVH_STACK_SIZE + 1) {
+                r->waiting_page = PAGED_BVH_TOO_DEEP;
+                return;
+            }
+            const bvh_node_t *children = paged_bvh_node(paged, ref);
+            r->pair = PAGED_BVH_NONE;
+            uint32_t left = ref, right = ref + 1;
+            float t_left, t_right, t_unused;
+            bool hit_left = ray_aabb_intersection(r->ray.origin, r->inv_direction, bvh_node_bounds(children),
+                                                  r->hit.t, &t_left, &t_unused);
+            bool hit_right = ray_aabb_intersection(r->ray.origin, r->inv_direction, bvh_node_bounds(children + 1),
+                                                   r->hit.t, &t_right, &t_unused);
+            if (hit_left && hit_right) {
+                if (t_right < t_left) {
+                    uint32_t tmp = left;
+                    left = right;
+                    right = tmp;
+                }
+                r->stack[r->stack_size++] = right;
+                r->stack[r->stack_size++] = left;
+            } else if (hit_left) {
+                r->stack[r->stack_size++] = left;
+            } else if (hit_right) {
+                r->stack[r->stack_size++] = right;
+            }
+            continue;
+        }
+        const bvh_node_t *node = paged_bvh_node(paged, r->stack[--r->stack_size]);
+        if (node->count == 0) {
+            r->pair = node->left_first;
+            continue;
+        }
+        const uint8_t *page_data = paged_bvh_page(paged, page);
+        uint32_t num_nodes = ((const paged_bvh_page_header_t *) page_data)->num_nodes;
+        const paged_bvh_triangle_t *triangles =
+                (const paged_bvh_triangle_t *) (page_data + sizeof(paged_bvh_page_header_t) +
+                                                num_nodes * sizeof(bvh_node_t)) +
+                node->left_first;
+        for (uint32_t i = 0; i < node->count; i++) {
+            const paged_bvh_triangle_t *triangle = triangles + i;
+            float t, u, v;
+            if (ray_triangle_intersection(r->ray, triangle->a, triangle->b, triangle->c, &t, &u, &v) &&
+                t < r->hit.t) {
+                r->hit = (ray_hit_t) {t, triangle->triangle_index, u, v};
+                r->normal = vec3_cross(vec3_sub(triangle->b, triangle->a), vec3_sub(triangle->c, triangle->a));
+            }
+        }
+    }
+}
+
+typedef struct {
+    const paged_bvh_t *paged;
+    paged_ray_t *rays;
+    const uint32_t *indices;
+} paged_bvh_resume_job_t;
+
+static void paged_bvh_resume_range(void *context, size_t begin, size_t end) {
+    paged_bvh_resume_job_t *job = context;
+    for (size_t i = begin; i < end; i++) paged_bvh_resume(job->paged, job->rays + job->indices[i]);
+}
+
+static void paged_bvh_heap_set(paged_bvh_t *paged, uint32_t position, uint32_t page) {
+    paged->heap[position] = page;
+    paged->heap_positions[page] = position;
+}
+
+static void paged_bvh_heap_up(paged_bvh_t *paged, uint32_t position) {
+    uint32_t page = paged->heap[position];
+    while (position > 0) {
+        uint32_t parent = (position - 1) / 2;
+        if (paged->queue_sizes[paged->heap[parent]] >= paged->queue_sizes[page]) break;
+        paged_bvh_heap_set(paged, position, paged->heap[parent]);
+        position = parent;
+    }
+    paged_bvh_heap_set(paged, position, page);
+}
+
+static void paged_bvh_heap_down(paged_bvh_t *paged, uint32_t position) {
+    uint32_t page = paged->heap[position];
+    while (true) {
+        uint32_t child = 2 * position + 1;
+        if (child >= paged->heap_size) break;
+        if (child + 1 < paged->heap_size &&
+            paged->queue_sizes[paged->heap[child + 1]] > paged->queue_sizes[paged->heap[child]]) {
+            child++;
+        }
+        if (paged->queue_sizes[paged->heap[child]] <= paged->queue_sizes[page]) break;
+        paged_bvh_heap_set(paged, position, paged->heap[child]);
+        position = child;
+    }
+    paged_bvh_heap_set(paged, position, page);
+}
+
+// Removes and returns the page with the longest queue, PAGED_BVH_NONE if no ray waits
+static uint32_t paged_bvh_heap_pop(paged_bvh_t *paged) {
+    if (paged->heap_size == 0) return PAGED_BVH_NONE;
+    uint32_t page = paged->heap[0];
+    paged->heap_positions[page] = PAGED_BVH_NONE;
+    if (--paged->heap_size > 0) {
+        paged_bvh_heap_set(paged, 0, paged->heap[paged->heap_size]);
+        paged_bvh_heap_down(paged, 0);
+    }
+    return page;
+}
+
+static void paged_bvh_enqueue(paged_bvh_t *paged, paged_ray_t *rays, uint32_t index) {
+    uint32_t page = rays[index].waiting_page;
+    rays[index].next = paged->queue_heads[page];
+    paged->queue_heads[page] = index;
+    paged->queue_sizes[page]++;
+    if (paged->heap_positions[page] == PAGED_BVH_NONE) paged_bvh_heap_set(paged, paged->heap_size++, page);
+    paged_bvh_heap_up(paged, paged->heap_positions[page]);
+}
+
+// Loads the page with the most waiting rays and lets them all continue, until every ray is done
+//@returns false if a page is not valid, the rays of the batch are left unfinished
+static bool paged_bvh_run(paged_bvh_t *paged, paged_ray_t *rays, uint32_t *indices) {
+    while (true) {
+        uint32_t page = paged_bvh_heap_pop(paged);
+        if (page == PAGED_BVH_NONE) return true;
+        bool loaded = paged->page_slots[page] >= 0;
+        paged_bvh_make_resident(paged, page);
+        bool ok = loaded || paged_bvh_page_is_valid(paged, page);
+        size_t count = 0;
+        for (uint32_t i = paged->queue_heads[page]; i != PAGED_BVH_NONE; i = rays[i].next) indices[count++] = i;
+        paged->queue_heads[page] = PAGED_BVH_NONE;
+        paged->queue_sizes[page] = 0;
+        if (ok) {
+            paged_bvh_resume_job_t job = {paged, rays, indices};
+            parallel_for(count, PAGED_BVH_GRAIN, paged_bvh_resume_range, &job);
+        }
+        for (size_t i = 0; ok && i < count; i++) {
+            if (rays[indices[i]].waiting_page == PAGED_BVH_NONE) continue;
+            ok = rays[indices[i]].waiting_page != PAGED_BVH_TOO_DEEP;
+            if (ok) {
+                paged_bvh_enqueue(paged, rays, indices[i]);
+                paged->num_deferred++;
+            }
+        }
+        if (!ok) {
+            // Drops the rays still waiting so the next batch starts with empty queues
+            while (paged->heap_size > 0) {
+                page = paged_bvh_heap_pop(paged);
+                paged->queue_heads[page] = PAGED_BVH_NONE;
+                paged->queue_sizes[page] = 0;
+            }
+            return false;
+        }
+    }
+}
+
+// Finds the closest hits of the rays like bvh_intersect, hits[i].t must be initialized by the caller.
+// Normals are the unnormalized geometric normals of the hit triangles, the mesh itself is not needed.
+//@returns false if memory for the ray queues could not be allocated or the file is not valid
+static bool paged_bvh_trace(paged_bvh_t *paged, const ray_t *rays, ray_hit_t *hits, vec3_t *normals,
+                            size_t num_rays) {
+    size_t batch_size = num_rays < PAGED_BVH_BATCH_RAYS ? num_rays : PAGED_BVH_BATCH_RAYS;
+    paged_ray_t *batch = malloc((batch_size > 0 ? batch_size : 1) * sizeof(paged_ray_t));
+    uint32_t *indices = malloc((batch_size > 0 ? batch_size : 1) * sizeof(uint32_t));
+    bool ok = batch != NULL && indices != NULL;
+    if (!ok) puts("Failed to allocate memory");
+    for (size_t begin = 0; ok && begin < num_rays; begin += batch_size) {
+        size_t count = num_rays - begin < batch_size ? num_rays - begin : batch_size;
+        for (size_t i = 0; i < count; i++) {
+            paged_ray_t *r = batch + i;
+            r->ray = rays[begin + i];
+            r->inv_direction = vec3_inverse(r->ray.direction);
+            r->hit = hits[begin + i];
+            r->normal = (vec3_t) {0.0f, 0.0f, 0.0f};
+            r->pair = PAGED_BVH_NONE;
+            r->stack_size = 0;
+            float t_near, t_far;
+            if (paged->header.num_tris > 0 && ray_aabb_intersection(r->ray.origin, r->inv_direction,
+                                                                    paged->header.bounds, r->hit.t, &t_near,
+                                                                    &t_far)) {
+                r->stack[r->stack_size++] = 0;
+                r->waiting_page = 0;
+                paged_bvh_enqueue(paged, batch, (uint32_t) i);
+            }
+        }
+        if (!paged_bvh_run(paged, batch, indices)) {
+            puts("Failed to read pages");
+            ok = false;
+            break;
+        }
+        for (size_t i = 0; i < count; i++) {
+            hits[begin + i] = batch[i].hit;
+            normals[begin + i] = batch[i].normal;
+        }
+    }
+    free(batch);
+    free(indices);
+    return ok;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Hardware cache counters of the calling thread through perf_event_open, user space only so that the default
+// perf_event_paranoid setting allows it. Counters the CPU or kernel do not offer stay closed and read as missing.
+
+typedef enum {
+    PERF_COUNTER_L1D_READ_MISSES,
+    PERF_COUNTER_LL_READ_MISSES,
+    PERF_COUNTER_DTLB_READ_MISSES,
+    PERF_COUNTER_INSTRUCTIONS,
+    PERF_NUM_COUNTERS,
+} perf_counter_t;
+
+#define PERF_COUNTER_MISSING UINT64_MAX
+
+typedef struct {
+    int fds[PERF_NUM_COUNTERS];
+} perf_counters_t;
+
+static int perf_open_counter(uint32_t type, uint64_t config) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+//@returns false if no counter could be opened
+static bool perf_counters_open(perf_counters_t *counters) {
+    uint64_t read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    counters->fds[PERF_COUNTER_L1D_READ_MISSES] =
+            perf_open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | read_miss);
+    counters->fds[PERF_COUNTER_LL_READ_MISSES] =
+            perf_open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | read_miss);
+    counters->fds[PERF_COUNTER_DTLB_READ_MISSES] =
+            perf_open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | read_miss);
+    counters->fds[PERF_COUNTER_INSTRUCTIONS] = perf_open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    bool any = false;
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) any |= counters->fds[i] >= 0;
+    return any;
+}
+
+static void perf_counters_close(perf_counters_t *counters) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->fds[i] >= 0) close(counters->fds[i]);
+        counters->fds[i] = -1;
+    }
+}
+
+// Zeroes and starts all counters
+static void perf_counters_start(const perf_counters_t *counters) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Stops all counters and reads them, missing ones read PERF_COUNTER_MISSING
+static void perf_counters_stop(const perf_counters_t *counters, uint64_t values[PERF_NUM_COUNTERS]) {
+    for (int i = 0; i < PERF_NUM_COUNTERS; i++) {
+        values[i] = PERF_COUNTER_MISSING;
+        if (counters->fds[i] < 0) continue;
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        uint64_t value;
+        if (read(counters->fds[i], &value, sizeof(value)) == sizeof(value)) values[i] = value;
+    }
+}
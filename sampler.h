@@ -0,0 +1,267 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "export.h"
+#include "hash.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Uniformly distributed points on the surface of a welded mesh. An alias table over the triangles, weighted by
+// area, picks a triangle with two random numbers in constant time, two more place the point uniformly inside it.
+// Random numbers are hashes of the seed and the sample index, so every sample can be drawn independently and in
+// any order, and the same seed and count give the same points however the work is split between threads.
+
+#define SAMPLER_GRAIN 16384
+
+typedef struct {
+    // A slot keeps its own triangle with this probability and gives its alias otherwise
+    float *probabilities;
+    uint32_t *aliases;
+    size_t num_tris;
+    double total_area;
+} surface_sampler_t;
+
+// Positions and normals as separate arrays, normals are unit length and follow the triangle winding
+typedef struct {
+    float *x, *y, *z;
+    float *normal_x, *normal_y, *normal_z;
+    size_t count;
+} surface_samples_t;
+
+typedef struct {
+    const mesh_t *mesh;
+    // Per triangle area, then scaled so that the average is 1
+    double *weights;
+    // Per block of SAMPLER_GRAIN triangles, the sum of its areas, then its number of slots below 1
+    double *block_areas;
+    size_t *block_small;
+    // Where the block's slots below 1 and at least 1 go in work
+    size_t *small_offsets;
+    size_t *large_offsets;
+    size_t num_small;
+    double scale;
+    uint32_t *work;
+} sampler_build_t;
+
+typedef struct {
+    const surface_sampler_t *sampler;
+    const mesh_t *mesh;
+    uint32_t seed;
+    surface_samples_t *samples;
+} sampler_draw_t;
+
+static void surface_sampler_free(surface_sampler_t *sampler) {
+    free(sampler->probabilities);
+    free(sampler->aliases);
+    *sampler = (surface_sampler_t) {0};
+}
+
+static void surface_samples_free(surface_samples_t *samples) {
+    // All six arrays live in one allocation
+    free(samples->x);
+    *samples = (surface_samples_t) {0};
+}
+
+static void sampler_areas(void *context, size_t begin, size_t end) {
+    sampler_build_t *build = context;
+    double block_area = 0.0;
+    for (size_t i = begin; i < end; i++) {
+        vec3_t a, b, c;
+        mesh_triangle(build->mesh, i, &a, &b, &c);
+        build->weights[i] = 0.5 * vec3_length(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+        block_area += build->weights[i];
+    }
+    build->block_areas[begin / SAMPLER_GRAIN] = block_area;
+}
+
+static void sampler_classify(void *context, size_t begin, size_t end) {
+    sampler_build_t *build = context;
+    size_t num_small = 0;
+    for (size_t i = begin; i < end; i++) {
+        build->weights[i] *= build->scale;
+        num_small += build->weights[i] < 1.0;
+    }
+    build->block_small[begin / SAMPLER_GRAIN] = num_small;
+}
+
+// Slots below 1 go to the front of work and the others after them, each block writes at its prefix sum
+static void sampler_scatter(void *context, size_t begin, size_t end) {
+    sampler_build_t *build = context;
+    size_t block = begin / SAMPLER_GRAIN;
+    size_t small = build->small_offsets[block], large = build->num_small + build->large_offsets[block];
+    for (size_t i = begin; i < end; i++) {
+        build->work[build->weights[i] < 1.0 ? small++ : large++] = (uint32_t) i;
+    }
+}
+
+// Areas, their total and the split into small and large slots run in parallel blocks tied together by prefix
+// sums over the blocks, only pairing the slots up is sequential
+//@returns false if out of memory or the mesh has no area
+static bool surface_sampler_build(surface_sampler_t *sampler, const mesh_t *mesh) {
+    *sampler = (surface_sampler_t) {.num_tris = mesh->num_tris};
+    size_t n = mesh->num_tris;
+    size_t num_blocks = (n + SAMPLER_GRAIN - 1) / SAMPLER_GRAIN;
+    sampler_build_t build = {
+            .mesh = mesh,
+            .weights = malloc((n > 0 ? n : 1) * sizeof(double)),
+            .block_areas = malloc((num_blocks + 1) * sizeof(double)),
+            .block_small = malloc((num_blocks + 1) * sizeof(size_t)),
+            .small_offsets = malloc((num_blocks + 1) * sizeof(size_t)),
+            .large_offsets = malloc((num_blocks + 1) * sizeof(size_t)),
+            .work = malloc((n > 0 ? n : 1) * sizeof(uint32_t)),
+    };
+    sampler->probabilities = malloc((n > 0 ? n : 1) * sizeof(float));
+    sampler->aliases = malloc((n > 0 ? n : 1) * sizeof(uint32_t));
+    bool ok = build.weights != NULL && build.block_areas != NULL && build.block_small != NULL &&
+              build.small_offsets != NULL && build.large_offsets != NULL && build.work != NULL &&
+              sampler->probabilities != NULL && sampler->aliases != NULL && n > 0 && n <= UINT32_MAX;
+    if (ok) {
+        parallel_for(n, SAMPLER_GRAIN, sampler_areas, &build);
+        for (size_t b = 0; b < num_blocks; b++) sampler->total_area += build.block_areas[b];
+        ok = sampler->total_area > 0.0;
+    }
+    if (ok) {
+        build.scale = (double) n / sampler->total_area;
+        parallel_for(n, SAMPLER_GRAIN, sampler_classify, &build);
+        for (size_t b = 0; b < num_blocks; b++) {
+            build.small_offsets[b] = build.num_small;
+            build.large_offsets[b] = b * SAMPLER_GRAIN - build.num_small;
+            build.num_small += build.block_small[b];
+        }
+        parallel_for(n, SAMPLER_GRAIN, sampler_scatter, &build);
+
+        // Vose's method, small slots are topped up from a large one until that one drops below 1 itself.
+        // Both are stacks in work, a large slot that becomes small moves from the top of one to the other.
+        size_t num_small = build.num_small, num_large = n - build.num_small;
+        uint32_t *small = build.work, *large = build.work + build.num_small;
+        while (num_small > 0 && num_large > 0) {
+            uint32_t s = small[--num_small], l = large[num_large - 1];
+            sampler->probabilities[s] = (float) build.weights[s];
+            sampler->aliases[s] = l;
+            build.weights[l] += build.weights[s] - 1.0;
+            if (build.weights[l] < 1.0) {
+                num_large--;
+                small[num_small++] = l;
+            }
+        }
+        // Whatever is left is 1 up to rounding
+        while (num_large > 0) {
+            uint32_t l = large[--num_large];
+            sampler->probabilities[l] = 1.0f;
+            sampler->aliases[l] = l;
+        }
+        while (num_small > 0) {
+            uint32_t s = small[--num_small];
+            sampler->probabilities[s] = 1.0f;
+            sampler->aliases[s] = s;
+        }
+    }
+    free(build.weights);
+    free(build.block_areas);
+    free(build.block_small);
+    free(build.small_offsets);
+    free(build.large_offsets);
+    free(build.work);
+    if (!ok) surface_sampler_free(sampler);
+    return ok;
+}
+
+// Counter based random numbers, dimension picks one of the independent numbers of a sample
+static uint32_t sampler_random(uint32_t seed, uint64_t index, uint32_t dimension) {
+    uint32_t h = int_hash32(int_hash32(seed ^ (uint32_t) index) ^ (uint32_t) (index >> 32));
+    return int_hash32(h ^ (dimension * 0x9E3779B9u));
+}
+
+//@returns a float in [0, 1)
+static float sampler_uniform(uint32_t random) {
+    return (float) (random >> 8) * 0x1p-24f;
+}
+
+static void sampler_draw_range(void *context, size_t begin, size_t end) {
+    const sampler_draw_t *draw = context;
+    const surface_sampler_t *sampler = draw->sampler;
+    surface_samples_t *samples = draw->samples;
+    for (size_t i = begin; i < end; i++) {
+        uint32_t slot = (uint32_t) (((uint64_t) sampler_random(draw->seed, i, 0) * sampler->num_tris) >> 32);
+        uint32_t triangle_index = sampler_uniform(sampler_random(draw->seed, i, 1)) < sampler->probabilities[slot]
+                                          ? slot
+                                          : sampler->aliases[slot];
+        vec3_t a, b, c;
+        mesh_triangle(draw->mesh, triangle_index, &a, &b, &c);
+        // Square root warping spreads the barycentric coordinates evenly over the triangle
+        float r = sqrtf(sampler_uniform(sampler_random(draw->seed, i, 2)));
+        float u = r * sampler_uniform(sampler_random(draw->seed, i, 3));
+        float v = 1.0f - r;
+        vec3_t position = vec3_add(vec3_add(vec3_scale(a, 1.0f - u - v), vec3_scale(b, u)), vec3_scale(c, v));
+        vec3_t normal = vec3_normalized(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+        samples->x[i] = position.x;
+        samples->y[i] = position.y;
+        samples->z[i] = position.z;
+        samples->normal_x[i] = normal.x;
+        samples->normal_y[i] = normal.y;
+        samples->normal_z[i] = normal.z;
+    }
+}
+
+// Draws count points in parallel on the job system
+//@returns false if out of memory
+static bool surface_samples_draw(surface_samples_t *samples, const surface_sampler_t *sampler, const mesh_t *mesh,
+                                 size_t count, uint32_t seed) {
+    *samples = (surface_samples_t) {.count = count};
+    float *data = malloc((count > 0 ? 6 * count : 1) * sizeof(float));
+    if (data == NULL) return false;
+    samples->x = data;
+    samples->y = data + count;
+    samples->z = data + 2 * count;
+    samples->normal_x = data + 3 * count;
+    samples->normal_y = data + 4 * count;
+    samples->normal_z = data + 5 * count;
+    sampler_draw_t draw = {sampler, mesh, seed, samples};
+    parallel_for(count, SAMPLER_GRAIN, sampler_draw_range, &draw);
+    return true;
+}
+
+// Six floats per point, interleaved again for the file
+static size_t sampler_ply_points(const void *context, size_t begin, size_t end, char *out) {
+    const surface_samples_t *samples = context;
+    char *start = out;
+    for (size_t i = begin; i < end; i++) {
+        float point[6] = {samples->x[i],        samples->y[i],        samples->z[i],
+                          samples->normal_x[i], samples->normal_y[i], samples->normal_z[i]};
+        memcpy(out, point, sizeof(point));
+        out += sizeof(point);
+    }
+    return out - start;
+}
+
+// Binary little endian PLY point cloud with normals
+static bool surface_samples_write_ply(const surface_samples_t *samples, const char *filepath) {
+    FILE *file = fopen(filepath, "wb");
+    if (file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    fprintf(file,
+            "ply\n"
+            "format binary_little_endian 1.0\n"
+            "element vertex %zu\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property float nx\n"
+            "property float ny\n"
+            "property float nz\n"
+            "end_header\n",
+            samples->count);
+    bool ok = export_elements(file, samples->count, 6 * sizeof(float), sampler_ply_points, samples);
+    ok &= fclose(file) == 0;
+    if (!ok) puts("Failed to write file");
+    return ok;
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Orders the tiles of a frame by the cost they had in the previous frame, most expensive first, and splits
+// tiles that alone would take a large share of the frame into parts. Handed out dynamically in that order
+// the long items start early and the short ones fill the gaps at the end, so no thread is left with
+// one expensive tile while the others idle.
+
+#define TILE_SCHEDULE_MAX_PARTS 16
+// Items should not cost more than this fraction of the work per thread
+#define TILE_SCHEDULE_TARGET_FRACTION 0.25f
+
+typedef struct {
+    uint32_t tile;
+    uint8_t part;
+    uint8_t num_parts;
+    float cost;
+} tile_schedule_item_t;
+
+typedef struct {
+    size_t num_tiles;
+    // Measured while the current frame renders
+    _Atomic uint64_t *nanoseconds;
+    _Atomic uint32_t *num_rays;
+    // Nanoseconds per ray of each tile the last time it traced any rays, 0 if never
+    float *ray_costs;
+    tile_schedule_item_t *items;
+    size_t num_items;
+    // Sum of all measured item times of the last frame
+    double work_seconds;
+} tile_schedule_t;
+
+static void tile_schedule_free(tile_schedule_t *schedule) {
+    free((void *) schedule->nanoseconds);
+    free((void *) schedule->num_rays);
+    free(schedule->ray_costs);
+    free(schedule->items);
+    *schedule = (tile_schedule_t) {0};
+}
+
+// Keeps the predictions as long as the number of tiles stays the same, starts over otherwise
+static bool tile_schedule_resize(tile_schedule_t *schedule, size_t num_tiles) {
+    if (schedule->num_tiles == num_tiles && schedule->items != NULL) return true;
+    tile_schedule_free(schedule);
+    schedule->nanoseconds = calloc(num_tiles, sizeof(uint64_t));
+    schedule->num_rays = calloc(num_tiles, sizeof(uint32_t));
+    schedule->ray_costs = calloc(num_tiles, sizeof(float));
+    schedule->items = malloc(num_tiles * TILE_SCHEDULE_MAX_PARTS * sizeof(tile_schedule_item_t));
+    if (schedule->nanoseconds == NULL || schedule->num_rays == NULL || schedule->ray_costs == NULL ||
+        schedule->items == NULL) {
+        tile_schedule_free(schedule);
+        return false;
+    }
+    schedule->num_tiles = num_tiles;
+    return true;
+}
+
+static int tile_schedule_compare_items(const void *a, const void *b) {
+    const tile_schedule_item_t *item_a = a, *item_b = b;
+    if (item_a->cost != item_b->cost) return item_a->cost > item_b->cost ? -1 : 1;
+    // Equal costs, e.g. before anything was measured, keep tiles in raster order
+    if (item_a->tile != item_b->tile) return item_a->tile < item_b->tile ? -1 : 1;
+    return (int) item_a->part - (int) item_b->part;
+}
+
+// Plans the items of the next frame, tiles are split into up to max_parts parts, a power of 4
+static void tile_schedule_plan(tile_schedule_t *schedule, int num_threads, int max_parts) {
+    if (max_parts > TILE_SCHEDULE_MAX_PARTS) max_parts = TILE_SCHEDULE_MAX_PARTS;
+    double total_cost = 0.0;
+    for (size_t tile = 0; tile < schedule->num_tiles; tile++) total_cost += schedule->ray_costs[tile];
+    float target = (float) (total_cost / num_threads) * TILE_SCHEDULE_TARGET_FRACTION;
+    schedule->num_items = 0;
+    for (size_t tile = 0; tile < schedule->num_tiles; tile++) {
+        float cost = schedule->ray_costs[tile];
+        int num_parts = 1;
+        while (num_parts * 4 <= max_parts && cost / (float) num_parts > target) num_parts *= 4;
+        for (int part = 0; part < num_parts; part++) {
+            schedule->items[schedule->num_items++] =
+                    (tile_schedule_item_t) {(uint32_t) tile, (uint8_t) part, (uint8_t) num_parts, cost / num_parts};
+        }
+    }
+    qsort(schedule->items, schedule->num_items, sizeof(tile_schedule_item_t), tile_schedule_compare_items);
+}
+
+// Safe to call from all threads while the frame renders
+static void tile_schedule_record(tile_schedule_t *schedule, uint32_t tile, double seconds, uint32_t num_rays) {
+    atomic_fetch_add_explicit(schedule->nanoseconds + tile, (uint64_t) (seconds * 1e9), memory_order_relaxed);
+    atomic_fetch_add_explicit(schedule->num_rays + tile, num_rays, memory_order_relaxed);
+}
+
+// Turns the measurements of the finished frame into the predictions for the next one
+static void tile_schedule_learn(tile_schedule_t *schedule) {
+    uint64_t total_nanoseconds = 0;
+    for (size_t tile = 0; tile < schedule->num_tiles; tile++) {
+        uint64_t nanoseconds = atomic_exchange_explicit(schedule->nanoseconds + tile, 0, memory_order_relaxed);
+        uint32_t num_rays = atomic_exchange_explicit(schedule->num_rays + tile, 0, memory_order_relaxed);
+        if (num_rays > 0) schedule->ray_costs[tile] = (float) nanoseconds / (float) num_rays;
+        total_nanoseconds += nanoseconds;
+    }
+    schedule->work_seconds = (double) total_nanoseconds * 1e-9;
+}
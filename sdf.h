@@ -0,0 +1,481 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// A brick covers SDF_BRICK_SIZE^3 voxels and stores distances at their corners,
+// the shared border samples are duplicated so trilinear lookups never leave a brick
+#define SDF_BRICK_SIZE 8
+#define SDF_BRICK_SAMPLES (SDF_BRICK_SIZE + 1)
+#define SDF_BRICK_NUM_SAMPLES (SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES)
+#define SDF_EMPTY_BRICK UINT32_MAX
+#define SDF_MAX_STEPS 256
+
+// Sparse brick signed distance field, only bricks within band of the surface are allocated
+typedef struct {
+    vec3_t origin;
+    float voxel_size;
+    float band;
+    int num_bricks[3];
+    // One entry per brick cell of the grid, index into bricks or SDF_EMPTY_BRICK
+    uint32_t *brick_map;
+    float *bricks;
+    size_t num_allocated_bricks;
+} sdf_t;
+
+// Signs of distances come from the pseudo-normal of the closest feature, by Baerentzen and Aanaes: the face normal
+// inside a triangle, the sum of the unit normals of the triangles at an edge and their sum weighted by angle at a
+// vertex. With those the sign is right at sharp edges and corners of closed meshes too.
+typedef struct {
+    // Per unique vertex
+    vec3_t *vertex_normals;
+    // Triangles around each unique vertex, those of vertex v are [vertex_offsets[v], vertex_offsets[v + 1])
+    uint32_t *vertex_offsets;
+    uint32_t *vertex_triangles;
+} sdf_pseudo_normals_t;
+
+static void sdf_free(sdf_t *sdf) {
+    free(sdf->brick_map);
+    free(sdf->bricks);
+    *sdf = (sdf_t) {0};
+}
+
+static size_t sdf_memory_size(const sdf_t *sdf) {
+    size_t num_cells = (size_t) sdf->num_bricks[0] * sdf->num_bricks[1] * sdf->num_bricks[2];
+    return num_cells * sizeof(uint32_t) + sdf->num_allocated_bricks * SDF_BRICK_NUM_SAMPLES * sizeof(float);
+}
+
+// Closest point on triangle abc to p, from Real-Time Collision Detection by Christer Ericson
+//@param feature set to 0, 1 or 2 for the corners a, b and c, 3, 4 or 5 for the edges ab, bc and ca and 6 inside
+static vec3_t closest_point_on_triangle(vec3_t p, vec3_t a, vec3_t b, vec3_t c, int *feature) {
+    vec3_t ab = vec3_sub(b, a), ac = vec3_sub(c, a), ap = vec3_sub(p, a);
+    float d1 = vec3_dot(ab, ap), d2 = vec3_dot(ac, ap);
+    *feature = 0;
+    if (d1 <= 0.0f && d2 <= 0.0f) return a;
+
+    vec3_t bp = vec3_sub(p, b);
+    float d3 = vec3_dot(ab, bp), d4 = vec3_dot(ac, bp);
+    *feature = 1;
+    if (d3 >= 0.0f && d4 <= d3) return b;
+
+    float vc = d1 * d4 - d3 * d2;
+    *feature = 3;
+    if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) return vec3_add(a, vec3_scale(ab, d1 / (d1 - d3)));
+
+    vec3_t cp = vec3_sub(p, c);
+    float d5 = vec3_dot(ab, cp), d6 = vec3_dot(ac, cp);
+    *feature = 2;
+    if (d6 >= 0.0f && d5 <= d6) return c;
+
+    float vb = d5 * d2 - d1 * d6;
+    *feature = 5;
+    if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) return vec3_add(a, vec3_scale(ac, d2 / (d2 - d6)));
+
+    float va = d3 * d6 - d5 * d4;
+    *feature = 4;
+    if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+        return vec3_add(b, vec3_scale(vec3_sub(c, b), (d4 - d3) / ((d4 - d3) + (d5 - d6))));
+    }
+
+    float denom = 1.0f / (va + vb + vc);
+    float v = vb * denom, w = vc * denom;
+    *feature = 6;
+    return vec3_add(a, vec3_add(vec3_scale(ab, v), vec3_scale(ac, w)));
+}
+
+static vec3_t sdf_face_normal(const mesh_t *mesh, uint32_t triangle_index) {
+    vec3_t a, b, c;
+    mesh_triangle(mesh, triangle_index, &a, &b, &c);
+    return vec3_normalized(vec3_cross(vec3_sub(b, a), vec3_sub(c, a)));
+}
+
+static void sdf_pseudo_normals_free(sdf_pseudo_normals_t *normals) {
+    free(normals->vertex_normals);
+    free(normals->vertex_offsets);
+    free(normals->vertex_triangles);
+    *normals = (sdf_pseudo_normals_t) {0};
+}
+
+static bool sdf_pseudo_normals_build(sdf_pseudo_normals_t *normals, const mesh_t *mesh) {
+    size_t num_vertices = mesh->num_unique_vertices;
+    normals->vertex_normals = calloc(num_vertices + 1, sizeof(vec3_t));
+    normals->vertex_offsets = calloc(num_vertices + 1, sizeof(uint32_t));
+    normals->vertex_triangles = malloc((3 * mesh->num_tris + 1) * sizeof(uint32_t));
+    if (normals->vertex_normals == NULL || normals->vertex_offsets == NULL || normals->vertex_triangles == NULL) {
+        sdf_pseudo_normals_free(normals);
+        return false;
+    }
+    for (size_t i = 0; i < 3 * mesh->num_tris; i++) normals->vertex_offsets[mesh->indices[i]]++;
+    uint32_t sum = 0;
+    for (size_t v = 0; v <= num_vertices; v++) {
+        uint32_t count = normals->vertex_offsets[v];
+        normals->vertex_offsets[v] = sum;
+        sum += count;
+    }
+    for (size_t t = 0; t < mesh->num_tris; t++) {
+        const uint32_t *tri = mesh->indices + 3 * t;
+        vec3_t normal = sdf_face_normal(mesh, (uint32_t) t);
+        for (int corner = 0; corner < 3; corner++) {
+            // Offsets are used as cursors and end up one vertex ahead, which is undone below
+            normals->vertex_triangles[normals->vertex_offsets[tri[corner]]++] = (uint32_t) t;
+            vec3_t p = mesh->unique_vertices[tri[corner]];
+            vec3_t to_next = vec3_normalized(vec3_sub(mesh->unique_vertices[tri[(corner + 1) % 3]], p));
+            vec3_t to_previous = vec3_normalized(vec3_sub(mesh->unique_vertices[tri[(corner + 2) % 3]], p));
+            float angle = acosf(clampf(vec3_dot(to_next, to_previous), -1.0f, 1.0f));
+            normals->vertex_normals[tri[corner]] =
+                    vec3_add(normals->vertex_normals[tri[corner]], vec3_scale(normal, angle));
+        }
+    }
+    for (size_t v = num_vertices; v > 0; v--) normals->vertex_offsets[v] = normals->vertex_offsets[v - 1];
+    normals->vertex_offsets[0] = 0;
+    return true;
+}
+
+// Sum of the unit normals of the triangles that share the edge between vertices u and v
+static vec3_t sdf_edge_normal(const mesh_t *mesh, const sdf_pseudo_normals_t *normals, uint32_t u, uint32_t v) {
+    vec3_t sum = {0.0f, 0.0f, 0.0f};
+    for (uint32_t k = normals->vertex_offsets[u]; k < normals->vertex_offsets[u + 1]; k++) {
+        uint32_t triangle_index = normals->vertex_triangles[k];
+        const uint32_t *tri = mesh->indices + 3 * (size_t) triangle_index;
+        if (tri[0] == v || tri[1] == v || tri[2] == v) sum = vec3_add(sum, sdf_face_normal(mesh, triangle_index));
+    }
+    return sum;
+}
+
+static size_t sdf_brick_cell_index(const sdf_t *sdf, int x, int y, int z) {
+    return ((size_t) z * sdf->num_bricks[1] + y) * sdf->num_bricks[0] + x;
+}
+
+// Distance from p to the closest of the given triangles if it is below sqrt(max_distance_squared)
+static bool sdf_closest_distance(const mesh_t *mesh, const sdf_pseudo_normals_t *normals, vec3_t p,
+                                 const uint32_t *triangles, size_t num_triangles, float max_distance_squared,
+                                 float *signed_distance) {
+    float best_distance_squared = max_distance_squared;
+    bool found = false;
+    for (size_t n = 0; n < num_triangles; n++) {
+        vec3_t a, b, c;
+        mesh_triangle(mesh, triangles[n], &a, &b, &c);
+        // The distance to the triangle bounds is a cheap lower bound
+        vec3_t box_delta = vec3_sub(vec3_max(vec3_min(p, vec3_max(a, vec3_max(b, c))), vec3_min(a, vec3_min(b, c))),
+                                    p);
+        if (vec3_length_squared(box_delta) >= best_distance_squared) continue;
+        int feature;
+        vec3_t q = closest_point_on_triangle(p, a, b, c, &feature);
+        vec3_t d = vec3_sub(p, q);
+        float distance_squared = vec3_length_squared(d);
+        if (distance_squared < best_distance_squared) {
+            best_distance_squared = distance_squared;
+            const uint32_t *tri = mesh->indices + 3 * (size_t) triangles[n];
+            vec3_t normal = feature < 3   ? normals->vertex_normals[tri[feature]]
+                            : feature < 6 ? sdf_edge_normal(mesh, normals, tri[feature - 3], tri[(feature - 2) % 3])
+                                          : vec3_cross(vec3_sub(b, a), vec3_sub(c, a));
+            *signed_distance = vec3_dot(d, normal) < 0.0f ? -sqrtf(distance_squared) : sqrtf(distance_squared);
+            found = true;
+        }
+    }
+    return found;
+}
+
+// Fills the samples of one brick from the triangles that may lie within band of it,
+// distances are clamped to band which keeps them conservative for the sphere tracer
+static void sdf_fill_brick(const sdf_t *sdf, const mesh_t *mesh, const sdf_pseudo_normals_t *normals, int bx, int by,
+                           int bz, const uint32_t *triangles, size_t num_triangles, float *samples) {
+    bool known[SDF_BRICK_NUM_SAMPLES];
+    size_t num_unknown = 0;
+    for (int k = 0; k < SDF_BRICK_SAMPLES; k++) {
+        for (int j = 0; j < SDF_BRICK_SAMPLES; j++) {
+            for (int i = 0; i < SDF_BRICK_SAMPLES; i++) {
+                vec3_t p = {
+                        sdf->origin.x + (float) (bx * SDF_BRICK_SIZE + i) * sdf->voxel_size,
+                        sdf->origin.y + (float) (by * SDF_BRICK_SIZE + j) * sdf->voxel_size,
+                        sdf->origin.z + (float) (bz * SDF_BRICK_SIZE + k) * sdf->voxel_size,
+                };
+                int index = (k * SDF_BRICK_SAMPLES + j) * SDF_BRICK_SAMPLES + i;
+                known[index] = sdf_closest_distance(mesh, normals, p, triangles, num_triangles,
+                                                    sdf->band * sdf->band, samples + index);
+                if (!known[index]) {
+                    samples[index] = sdf->band;
+                    num_unknown++;
+                }
+            }
+        }
+    }
+
+    // Samples further than band from the surface cannot have a zero crossing towards a neighbor
+    // one voxel away, so their sign is flooded from neighbors instead of searching all triangles
+    const int offsets[6] = {1, -1, SDF_BRICK_SAMPLES, -SDF_BRICK_SAMPLES, SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES,
+                            -SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES};
+    while (num_unknown > 0) {
+        size_t num_resolved = 0;
+        for (int index = 0; index < SDF_BRICK_NUM_SAMPLES; index++) {
+            if (known[index]) continue;
+            int i = index % SDF_BRICK_SAMPLES;
+            int j = (index / SDF_BRICK_SAMPLES) % SDF_BRICK_SAMPLES;
+            int k = index / (SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES);
+            int coordinates[3] = {i, j, k};
+            for (int n = 0; n < 6; n++) {
+                int c = coordinates[n / 2] + ((n & 1) ? -1 : 1);
+                if (c < 0 || c >= SDF_BRICK_SAMPLES || !known[index + offsets[n]]) continue;
+                samples[index] = copysignf(sdf->band, samples[index + offsets[n]]);
+                known[index] = true;
+                num_resolved++;
+                break;
+            }
+        }
+        if (num_resolved == 0) {
+            // No sample near the surface to flood from, search without a radius for a single seed
+            int index = 0;
+            while (known[index]) index++;
+            int i = index % SDF_BRICK_SAMPLES;
+            int j = (index / SDF_BRICK_SAMPLES) % SDF_BRICK_SAMPLES;
+            int k = index / (SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES);
+            vec3_t p = {
+                    sdf->origin.x + (float) (bx * SDF_BRICK_SIZE + i) * sdf->voxel_size,
+                    sdf->origin.y + (float) (by * SDF_BRICK_SIZE + j) * sdf->voxel_size,
+                    sdf->origin.z + (float) (bz * SDF_BRICK_SIZE + k) * sdf->voxel_size,
+            };
+            float signed_distance = sdf->band;
+            sdf_closest_distance(mesh, normals, p, triangles, num_triangles, INFINITY, &signed_distance);
+            samples[index] = copysignf(sdf->band, signed_distance);
+            known[index] = true;
+            num_resolved = 1;
+        }
+        num_unknown -= num_resolved;
+    }
+}
+
+typedef struct {
+    const sdf_t *sdf;
+    const mesh_t *mesh;
+    const sdf_pseudo_normals_t *normals;
+    const uint32_t *cell_offsets;
+    const uint32_t *cell_triangles;
+} sdf_fill_job_t;
+
+static void sdf_fill_range(void *context, size_t begin, size_t end) {
+    const sdf_fill_job_t *job = context;
+    const sdf_t *sdf = job->sdf;
+    for (size_t cell = begin; cell < end; cell++) {
+        uint32_t brick_index = sdf->brick_map[cell];
+        if (brick_index == SDF_EMPTY_BRICK) continue;
+        int x = (int) (cell % sdf->num_bricks[0]);
+        int y = (int) ((cell / sdf->num_bricks[0]) % sdf->num_bricks[1]);
+        int z = (int) (cell / ((size_t) sdf->num_bricks[0] * sdf->num_bricks[1]));
+        uint32_t first = job->cell_offsets[cell];
+        sdf_fill_brick(sdf, job->mesh, job->normals, x, y, z, job->cell_triangles + first,
+                       job->cell_offsets[cell + 1] - first, sdf->bricks + (size_t) brick_index * SDF_BRICK_NUM_SAMPLES);
+    }
+}
+
+// Range of bricks overlapped by the bounds of a triangle expanded by band
+static void sdf_triangle_brick_range(const sdf_t *sdf, const mesh_t *mesh, size_t triangle_index, int lo[3],
+                                     int hi[3]) {
+    vec3_t a, b, c;
+    mesh_triangle(mesh, triangle_index, &a, &b, &c);
+    aabb_t box = aabb_grow(aabb_grow(aabb_grow(aabb_empty(), a), b), c);
+    float brick_extent = sdf->voxel_size * SDF_BRICK_SIZE;
+    for (int axis = 0; axis < 3; axis++) {
+        float o = vec3_component(sdf->origin, axis);
+        lo[axis] = (int) floorf((vec3_component(box.min, axis) - sdf->band - o) / brick_extent);
+        hi[axis] = (int) floorf((vec3_component(box.max, axis) + sdf->band - o) / brick_extent);
+        if (lo[axis] < 0) lo[axis] = 0;
+        if (hi[axis] > sdf->num_bricks[axis] - 1) hi[axis] = sdf->num_bricks[axis] - 1;
+    }
+}
+
+//@param resolution number of voxels along the longest axis of the mesh bounds
+static bool sdf_build(sdf_t *sdf, const mesh_t *mesh, int resolution) {
+    *sdf = (sdf_t) {0};
+    vec3_t extent = vec3_sub(mesh->bounds.max, mesh->bounds.min);
+    float longest = fmaxf(extent.x, fmaxf(extent.y, extent.z));
+    if (mesh->num_tris == 0 || !(longest > 0.0f) || resolution < 1) return false;
+
+    sdf->voxel_size = longest / (float) resolution;
+    sdf->band = 2.0f * sdf->voxel_size;
+    // Pad by the band so the zero crossing never touches the grid border
+    vec3_t padding = {sdf->band, sdf->band, sdf->band};
+    sdf->origin = vec3_sub(mesh->bounds.min, padding);
+    vec3_t grid_extent = vec3_add(extent, vec3_scale(padding, 2.0f));
+    float brick_extent = sdf->voxel_size * SDF_BRICK_SIZE;
+    for (int axis = 0; axis < 3; axis++) {
+        sdf->num_bricks[axis] = (int) ceilf(vec3_component(grid_extent, axis) / brick_extent);
+    }
+    size_t num_cells = (size_t) sdf->num_bricks[0] * sdf->num_bricks[1] * sdf->num_bricks[2];
+
+    // Bin triangles into every brick their band-expanded bounds touch, as offsets + one flat list
+    uint32_t *cell_offsets = calloc(num_cells + 1, sizeof(uint32_t));
+    uint32_t *cursor = malloc(num_cells * sizeof(uint32_t));
+    sdf->brick_map = malloc(num_cells * sizeof(uint32_t));
+    if (cell_offsets == NULL || cursor == NULL || sdf->brick_map == NULL) {
+        free(cell_offsets);
+        free(cursor);
+        sdf_free(sdf);
+        return false;
+    }
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        int lo[3], hi[3];
+        sdf_triangle_brick_range(sdf, mesh, triangle_index, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    cell_offsets[sdf_brick_cell_index(sdf, x, y, z)]++;
+                }
+            }
+        }
+    }
+    uint32_t sum = 0;
+    size_t num_allocated_bricks = 0;
+    for (size_t cell = 0; cell <= num_cells; cell++) {
+        uint32_t count = cell_offsets[cell];
+        if (count > 0) num_allocated_bricks++;
+        cell_offsets[cell] = sum;
+        sum += count;
+    }
+    memcpy(cursor, cell_offsets, num_cells * sizeof(uint32_t));
+
+    uint32_t *cell_triangles = malloc((sum > 0 ? sum : 1) * sizeof(uint32_t));
+    sdf->bricks = malloc(num_allocated_bricks * SDF_BRICK_NUM_SAMPLES * sizeof(float));
+    if (cell_triangles == NULL || sdf->bricks == NULL) {
+        free(cell_triangles);
+        free(cell_offsets);
+        free(cursor);
+        sdf_free(sdf);
+        return false;
+    }
+    for (size_t triangle_index = 0; triangle_index < mesh->num_tris; triangle_index++) {
+        int lo[3], hi[3];
+        sdf_triangle_brick_range(sdf, mesh, triangle_index, lo, hi);
+        for (int z = lo[2]; z <= hi[2]; z++) {
+            for (int y = lo[1]; y <= hi[1]; y++) {
+                for (int x = lo[0]; x <= hi[0]; x++) {
+                    cell_triangles[cursor[sdf_brick_cell_index(sdf, x, y, z)]++] = triangle_index;
+                }
+            }
+        }
+    }
+    free(cursor);
+
+    for (size_t cell = 0; cell < num_cells; cell++) {
+        sdf->brick_map[cell] = cell_offsets[cell + 1] > cell_offsets[cell] ? sdf->num_allocated_bricks++
+                                                                           : SDF_EMPTY_BRICK;
+    }
+    sdf_pseudo_normals_t normals = {0};
+    if (!sdf_pseudo_normals_build(&normals, mesh)) {
+        free(cell_triangles);
+        free(cell_offsets);
+        sdf_free(sdf);
+        return false;
+    }
+    sdf_fill_job_t job = {sdf, mesh, &normals, cell_offsets, cell_triangles};
+    parallel_for(num_cells, 64, sdf_fill_range, &job);
+    sdf_pseudo_normals_free(&normals);
+    free(cell_triangles);
+    free(cell_offsets);
+    return true;
+}
+
+static aabb_t sdf_bounds(const sdf_t *sdf) {
+    float brick_extent = sdf->voxel_size * SDF_BRICK_SIZE;
+    vec3_t size = {(float) sdf->num_bricks[0] * brick_extent, (float) sdf->num_bricks[1] * brick_extent,
+                   (float) sdf->num_bricks[2] * brick_extent};
+    return (aabb_t) {sdf->origin, vec3_add(sdf->origin, size)};
+}
+
+// Locates the brick containing p, writes the position in voxel units relative to the brick
+//@returns brick index or SDF_EMPTY_BRICK, positions outside the grid are clamped to the border bricks
+static uint32_t sdf_locate(const sdf_t *sdf, vec3_t p, int brick[3], vec3_t *local) {
+    vec3_t g = vec3_scale(vec3_sub(p, sdf->origin), 1.0f / sdf->voxel_size);
+    float gc[3] = {g.x, g.y, g.z}, lc[3];
+    for (int axis = 0; axis < 3; axis++) {
+        int b = (int) floorf(gc[axis] / SDF_BRICK_SIZE);
+        if (b < 0) b = 0;
+        if (b > sdf->num_bricks[axis] - 1) b = sdf->num_bricks[axis] - 1;
+        brick[axis] = b;
+        lc[axis] = clampf(gc[axis] - (float) (b * SDF_BRICK_SIZE), 0.0f, (float) SDF_BRICK_SIZE);
+    }
+    *local = (vec3_t) {lc[0], lc[1], lc[2]};
+    return sdf->brick_map[sdf_brick_cell_index(sdf, brick[0], brick[1], brick[2])];
+}
+
+static float sdf_sample_brick(const float *samples, vec3_t local) {
+    int i = (int) local.x, j = (int) local.y, k = (int) local.z;
+    if (i > SDF_BRICK_SIZE - 1) i = SDF_BRICK_SIZE - 1;
+    if (j > SDF_BRICK_SIZE - 1) j = SDF_BRICK_SIZE - 1;
+    if (k > SDF_BRICK_SIZE - 1) k = SDF_BRICK_SIZE - 1;
+    float fx = local.x - (float) i, fy = local.y - (float) j, fz = local.z - (float) k;
+    const float *s = samples + (k * SDF_BRICK_SAMPLES + j) * SDF_BRICK_SAMPLES + i;
+    const int dy = SDF_BRICK_SAMPLES, dz = SDF_BRICK_SAMPLES * SDF_BRICK_SAMPLES;
+    float c00 = s[0] + (s[1] - s[0]) * fx;
+    float c10 = s[dy] + (s[dy + 1] - s[dy]) * fx;
+    float c01 = s[dz] + (s[dz + 1] - s[dz]) * fx;
+    float c11 = s[dz + dy] + (s[dz + dy + 1] - s[dz + dy]) * fx;
+    float c0 = c00 + (c10 - c00) * fy;
+    float c1 = c01 + (c11 - c01) * fy;
+    return c0 + (c1 - c0) * fz;
+}
+
+// Trilinearly interpolated distance, empty bricks report the band as a lower bound
+static float sdf_sample(const sdf_t *sdf, vec3_t p) {
+    int brick[3];
+    vec3_t local;
+    uint32_t brick_index = sdf_locate(sdf, p, brick, &local);
+    if (brick_index == SDF_EMPTY_BRICK) return sdf->band;
+    return sdf_sample_brick(sdf->bricks + (size_t) brick_index * SDF_BRICK_NUM_SAMPLES, local);
+}
+
+static vec3_t sdf_normal(const sdf_t *sdf, vec3_t p) {
+    float h = 0.5f * sdf->voxel_size;
+    vec3_t gradient = {
+            sdf_sample(sdf, (vec3_t) {p.x + h, p.y, p.z}) - sdf_sample(sdf, (vec3_t) {p.x - h, p.y, p.z}),
+            sdf_sample(sdf, (vec3_t) {p.x, p.y + h, p.z}) - sdf_sample(sdf, (vec3_t) {p.x, p.y - h, p.z}),
+            sdf_sample(sdf, (vec3_t) {p.x, p.y, p.z + h}) - sdf_sample(sdf, (vec3_t) {p.x, p.y, p.z - h}),
+    };
+    float length = vec3_length(gradient);
+    if (length == 0.0f) return (vec3_t) {0, 0, 1};
+    return vec3_scale(gradient, 1.0f / length);
+}
+
+// Sphere traces the field, empty bricks are skipped in one step up to their exit.
+// pixel_cone is the footprint of a pixel per unit distance, the hit threshold grows with it
+// so distant surfaces terminate early, which acts as a smooth level of detail.
+static bool sdf_trace(const sdf_t *sdf, ray_t ray, float t_max, float pixel_cone, float *t) {
+    if (sdf->brick_map == NULL) return false;
+    vec3_t inv_direction = vec3_inverse(ray.direction);
+    float t_near, t_far;
+    if (!ray_aabb_intersection(ray.origin, inv_direction, sdf_bounds(sdf), t_max, &t_near, &t_far)) return false;
+
+    float brick_extent = sdf->voxel_size * SDF_BRICK_SIZE;
+    float min_step = 0.01f * sdf->voxel_size;
+    float current = t_near;
+    for (int step = 0; step < SDF_MAX_STEPS && current <= t_far; step++) {
+        vec3_t p = vec3_add(ray.origin, vec3_scale(ray.direction, current));
+        int brick[3];
+        vec3_t local;
+        uint32_t brick_index = sdf_locate(sdf, p, brick, &local);
+        if (brick_index == SDF_EMPTY_BRICK) {
+            // No surface within band of this brick, jump to where the ray leaves it
+            vec3_t brick_min = {sdf->origin.x + (float) brick[0] * brick_extent,
+                                sdf->origin.y + (float) brick[1] * brick_extent,
+                                sdf->origin.z + (float) brick[2] * brick_extent};
+            aabb_t box = {brick_min, vec3_add(brick_min, (vec3_t) {brick_extent, brick_extent, brick_extent})};
+            float t0, t1;
+            ray_aabb_intersection(ray.origin, inv_direction, box, INFINITY, &t0, &t1);
+            current = maxf(t1, current) + min_step;
+            continue;
+        }
+        float distance = sdf_sample_brick(sdf->bricks + (size_t) brick_index * SDF_BRICK_NUM_SAMPLES, local);
+        if (distance < min_step + pixel_cone * current) {
+            *t = current;
+            return true;
+        }
+        current += maxf(distance, min_step);
+    }
+    return false;
+}
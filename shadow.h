@@ -0,0 +1,202 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Omnidirectional shadow map of a point light: six square faces looking down +X, -X, +Y, -Y, +Z and -Z
+// from the light. A texel holds the distance along the face axis to the closest triangle, triangles are
+// rasterized from all cores and depth tested with an atomic minimum like the point splatter does.
+// The map is kept while the light and mesh stay the same, so static views pay for it only once.
+
+#define SHADOW_MAP_EMPTY UINT32_MAX
+#define SHADOW_MAP_GRAIN 4096
+// Lookups move this many texels along the normal and accept depths this much behind the stored one
+#define SHADOW_MAP_NORMAL_OFFSET 1.5f
+#define SHADOW_MAP_DEPTH_BIAS 1.005f
+
+typedef struct {
+    // Six resolution x resolution faces of positive float depth bits, smaller bits are closer
+    _Atomic uint32_t *depths;
+    int resolution;
+    const mesh_t *mesh;
+    vec3_t light_position;
+    float near;
+    bool valid;
+} shadow_map_t;
+
+typedef struct {
+    vec3_t uvz[4];
+    int count;
+} shadow_polygon_t;
+
+static bool shadow_map_create(shadow_map_t *map, int resolution) {
+    *map = (shadow_map_t) {0};
+    map->resolution = resolution;
+    map->depths = malloc(6 * (size_t) resolution * resolution * sizeof(uint32_t));
+    return map->depths != NULL;
+}
+
+static void shadow_map_free(shadow_map_t *map) {
+    free(map->depths);
+    *map = (shadow_map_t) {0};
+}
+
+static size_t shadow_map_memory_size(const shadow_map_t *map) {
+    return 6 * (size_t) map->resolution * map->resolution * sizeof(uint32_t);
+}
+
+// Face coordinates of an offset from the light: u and v on the face, z along the face axis
+static vec3_t shadow_face_coordinates(vec3_t d, int face) {
+    int axis = face / 2;
+    float sign = face % 2 == 0 ? 1.0f : -1.0f;
+    return (vec3_t) {vec3_component(d, (axis + 1) % 3), vec3_component(d, (axis + 2) % 3),
+                     sign * vec3_component(d, axis)};
+}
+
+// The face a direction from the light falls on, the one of its largest component
+static int shadow_face_of(vec3_t d) {
+    float ax = fabsf(d.x), ay = fabsf(d.y), az = fabsf(d.z);
+    if (ax >= ay && ax >= az) return d.x >= 0.0f ? 0 : 1;
+    if (ay >= az) return d.y >= 0.0f ? 2 : 3;
+    return d.z >= 0.0f ? 4 : 5;
+}
+
+// Sutherland-Hodgman against z >= near, a triangle stays at most a quad
+static void shadow_clip_near(const vec3_t uvz[3], float near, shadow_polygon_t *polygon) {
+    polygon->count = 0;
+    for (int i = 0; i < 3; i++) {
+        vec3_t a = uvz[i], b = uvz[(i + 1) % 3];
+        bool a_inside = a.z >= near, b_inside = b.z >= near;
+        if (a_inside) polygon->uvz[polygon->count++] = a;
+        if (a_inside != b_inside) {
+            float t = (near - a.z) / (b.z - a.z);
+            polygon->uvz[polygon->count++] = vec3_add(a, vec3_scale(vec3_sub(b, a), t));
+        }
+    }
+}
+
+static void shadow_atomic_min(_Atomic uint32_t *texel, uint32_t value) {
+    uint32_t current = atomic_load_explicit(texel, memory_order_relaxed);
+    while (value < current &&
+           !atomic_compare_exchange_weak_explicit(texel, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+// Vertices are texel x, y and 1 / z, which unlike z interpolates linearly across the face
+static void shadow_rasterize_triangle(shadow_map_t *map, int face, const vec3_t p[3]) {
+    int n = map->resolution;
+    float area = (p[1].x - p[0].x) * (p[2].y - p[0].y) - (p[2].x - p[0].x) * (p[1].y - p[0].y);
+    if (!(fabsf(area) > 0.0f)) return;
+    float min_x = maxf(minf(minf(p[0].x, p[1].x), p[2].x), 0.0f);
+    float max_x = minf(maxf(maxf(p[0].x, p[1].x), p[2].x), (float) n);
+    float min_y = maxf(minf(minf(p[0].y, p[1].y), p[2].y), 0.0f);
+    float max_y = minf(maxf(maxf(p[0].y, p[1].y), p[2].y), (float) n);
+    if (!(min_x < max_x && min_y < max_y)) return;
+    int x0 = (int) min_x, x1 = (int) ceilf(max_x), y0 = (int) min_y, y1 = (int) ceilf(max_y);
+    if (x1 > n) x1 = n;
+    if (y1 > n) y1 = n;
+    float inv_area = 1.0f / area;
+    _Atomic uint32_t *texels = map->depths + (size_t) face * n * n;
+    for (int y = y0; y < y1; y++) {
+        float py = (float) y + 0.5f;
+        for (int x = x0; x < x1; x++) {
+            float px = (float) x + 0.5f;
+            // Barycentric weights from the edge functions, normalized by the signed area so both windings pass
+            float w0 = ((p[1].x - px) * (p[2].y - py) - (p[2].x - px) * (p[1].y - py)) * inv_area;
+            float w1 = ((p[2].x - px) * (p[0].y - py) - (p[0].x - px) * (p[2].y - py)) * inv_area;
+            float w2 = 1.0f - w0 - w1;
+            if (w0 < 0.0f || w1 < 0.0f || w2 < 0.0f) continue;
+            float depth = 1.0f / (w0 * p[0].z + w1 * p[1].z + w2 * p[2].z);
+            uint32_t depth_bits;
+            memcpy(&depth_bits, &depth, sizeof(depth_bits));
+            shadow_atomic_min(texels + (size_t) y * n + x, depth_bits);
+        }
+    }
+}
+
+static void shadow_map_rasterize_range(void *context, size_t begin, size_t end) {
+    shadow_map_t *map = context;
+    float half = 0.5f * (float) map->resolution;
+    for (size_t triangle = begin; triangle < end; triangle++) {
+        vec3_t vertices[3];
+        mesh_triangle(map->mesh, triangle, vertices, vertices + 1, vertices + 2);
+        for (int i = 0; i < 3; i++) vertices[i] = vec3_sub(vertices[i], map->light_position);
+        for (int face = 0; face < 6; face++) {
+            vec3_t uvz[3];
+            for (int i = 0; i < 3; i++) uvz[i] = shadow_face_coordinates(vertices[i], face);
+            // Entirely outside one side of the 90 degree frustum
+            if ((uvz[0].x > uvz[0].z && uvz[1].x > uvz[1].z && uvz[2].x > uvz[2].z) ||
+                (uvz[0].x < -uvz[0].z && uvz[1].x < -uvz[1].z && uvz[2].x < -uvz[2].z) ||
+                (uvz[0].y > uvz[0].z && uvz[1].y > uvz[1].z && uvz[2].y > uvz[2].z) ||
+                (uvz[0].y < -uvz[0].z && uvz[1].y < -uvz[1].z && uvz[2].y < -uvz[2].z)) {
+                continue;
+            }
+            shadow_polygon_t polygon;
+            shadow_clip_near(uvz, map->near, &polygon);
+            if (polygon.count < 3) continue;
+            vec3_t projected[4];
+            for (int i = 0; i < polygon.count; i++) {
+                float inv_z = 1.0f / polygon.uvz[i].z;
+                projected[i] = (vec3_t) {(polygon.uvz[i].x * inv_z + 1.0f) * half,
+                                         (polygon.uvz[i].y * inv_z + 1.0f) * half, inv_z};
+            }
+            shadow_rasterize_triangle(map, face, projected);
+            if (polygon.count == 4) {
+                vec3_t second[3] = {projected[0], projected[2], projected[3]};
+                shadow_rasterize_triangle(map, face, second);
+            }
+        }
+    }
+}
+
+// Rebuilds the map unless it already shows this mesh from this light position
+//@returns true if the map was rebuilt
+static bool shadow_map_update(shadow_map_t *map, const mesh_t *mesh, vec3_t light_position) {
+    if (map->valid && map->mesh == mesh && memcmp(&map->light_position, &light_position, sizeof(vec3_t)) == 0) {
+        return false;
+    }
+    map->mesh = mesh;
+    map->light_position = light_position;
+    map->near = 1e-4f * vec3_length(vec3_sub(mesh->bounds.max, mesh->bounds.min));
+    // All bytes 0xFF is SHADOW_MAP_EMPTY
+    memset((void *) map->depths, 0xFF, shadow_map_memory_size(map));
+    parallel_for(mesh->num_tris, SHADOW_MAP_GRAIN, shadow_map_rasterize_range, map);
+    map->valid = true;
+    return true;
+}
+
+// Fraction of the 3x3 texels around the point that see it from the light (percentage closer filtering),
+// 1 is fully lit. Samples are offset along the normal by the texel size at that distance against acne.
+static float shadow_map_visibility(const shadow_map_t *map, vec3_t position, vec3_t normal) {
+    int n = map->resolution;
+    vec3_t d = vec3_sub(position, map->light_position);
+    int face = shadow_face_of(d);
+    float texel_size = 2.0f * shadow_face_coordinates(d, face).z / (float) n;
+    d = vec3_add(d, vec3_scale(normal, SHADOW_MAP_NORMAL_OFFSET * texel_size));
+    vec3_t uvz = shadow_face_coordinates(d, face);
+    if (!(uvz.z > map->near)) return 1.0f;
+    float half = 0.5f * (float) n;
+    int x = (int) floorf((uvz.x / uvz.z + 1.0f) * half);
+    int y = (int) floorf((uvz.y / uvz.z + 1.0f) * half);
+    const _Atomic uint32_t *texels = map->depths + (size_t) face * n * n;
+    int num_lit = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            // Samples past the face border repeat the edge texels
+            int sx = x + dx < 0 ? 0 : x + dx >= n ? n - 1 : x + dx;
+            int sy = y + dy < 0 ? 0 : y + dy >= n ? n - 1 : y + dy;
+            uint32_t bits = atomic_load_explicit(texels + (size_t) sy * n + sx, memory_order_relaxed);
+            float depth;
+            memcpy(&depth, &bits, sizeof(depth));
+            num_lit += bits == SHADOW_MAP_EMPTY || uvz.z <= depth * SHADOW_MAP_DEPTH_BIAS;
+        }
+    }
+    return (float) num_lit / 9.0f;
+}
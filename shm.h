@@ -0,0 +1,185 @@
+#pragma once
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Ring of RGB8 framebuffers in POSIX shared memory. The renderer draws straight into a slot and publishes it,
+// viewers copy slots out. Every slot has a sequence counter that is odd while the slot is being written,
+// a reader checks that the counter did not move while it was reading, so torn frames are detected without locks.
+
+#define SHM_RING_MAGIC 0x57425348u
+#define SHM_RING_MAX_SLOTS 8
+#define SHM_RING_ALIGNMENT 4096
+
+typedef struct {
+    _Atomic uint64_t sequence;
+    uint64_t frame;
+    size_t offset;
+} shm_ring_slot_t;
+
+typedef struct {
+    _Atomic uint32_t magic;
+    int32_t width;
+    int32_t height;
+    int32_t num_slots;
+    // Number of frames published so far, the latest one is in slot (num_frames - 1) % num_slots
+    _Atomic uint64_t num_frames;
+    shm_ring_slot_t slots[SHM_RING_MAX_SLOTS];
+} shm_ring_header_t;
+
+typedef struct {
+    shm_ring_header_t *header;
+    size_t size;
+    char name[256];
+    bool owner;
+    int writing_slot;
+} shm_ring_t;
+
+static size_t shm_ring_frame_size(int width, int height) {
+    size_t size = 3 * (size_t) width * height;
+    return (size + SHM_RING_ALIGNMENT - 1) / SHM_RING_ALIGNMENT * SHM_RING_ALIGNMENT;
+}
+
+static uint8_t *shm_ring_pixels(const shm_ring_t *ring, int slot) {
+    return (uint8_t *) ring->header + ring->header->slots[slot].offset;
+}
+
+//@param name POSIX shared memory object name, e.g. "/wonderbox"
+static bool shm_ring_create(shm_ring_t *ring, const char *name, int width, int height, int num_slots) {
+    *ring = (shm_ring_t) {0};
+    if (num_slots < 2) num_slots = 2;
+    if (num_slots > SHM_RING_MAX_SLOTS) num_slots = SHM_RING_MAX_SLOTS;
+    size_t header_size = (sizeof(shm_ring_header_t) + SHM_RING_ALIGNMENT - 1) / SHM_RING_ALIGNMENT *
+                         SHM_RING_ALIGNMENT;
+    ring->size = header_size + num_slots * shm_ring_frame_size(width, height);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        puts("Failed to create shared memory");
+        return false;
+    }
+    void *memory = ftruncate(fd, (off_t) ring->size) == 0
+                           ? mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        puts("Failed to map shared memory");
+        shm_unlink(name);
+        return false;
+    }
+    ring->header = memory;
+    ring->owner = true;
+    ring->writing_slot = -1;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+
+    // A leftover object may still be mapped by viewers, they stop trusting it before its layout changes
+    shm_ring_header_t *header = ring->header;
+    atomic_store_explicit(&header->magic, 0, memory_order_relaxed);
+    header->width = width;
+    header->height = height;
+    header->num_slots = num_slots;
+    atomic_store(&header->num_frames, 0);
+    for (int i = 0; i < num_slots; i++) {
+        atomic_store(&header->slots[i].sequence, 0);
+        header->slots[i].frame = 0;
+        header->slots[i].offset = header_size + i * shm_ring_frame_size(width, height);
+    }
+    // Viewers only trust the layout once the magic is visible
+    atomic_store_explicit(&header->magic, SHM_RING_MAGIC, memory_order_release);
+    return true;
+}
+
+static bool shm_ring_open(shm_ring_t *ring, const char *name) {
+    *ring = (shm_ring_t) {0};
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        puts("Failed to open shared memory");
+        return false;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    void *memory = size >= (off_t) sizeof(shm_ring_header_t)
+                           ? mmap(NULL, (size_t) size, PROT_READ, MAP_SHARED, fd, 0)
+                           : MAP_FAILED;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        puts("Failed to map shared memory");
+        return false;
+    }
+    ring->header = memory;
+    ring->size = (size_t) size;
+    ring->writing_slot = -1;
+    snprintf(ring->name, sizeof(ring->name), "%s", name);
+    const shm_ring_header_t *header = ring->header;
+    bool ok = atomic_load_explicit(&((shm_ring_header_t *) header)->magic, memory_order_acquire) == SHM_RING_MAGIC &&
+              header->num_slots >= 1 && header->num_slots <= SHM_RING_MAX_SLOTS && header->width > 0 &&
+              header->height > 0;
+    // Every slot must lie inside the mapping
+    for (int i = 0; ok && i < header->num_slots; i++) {
+        size_t offset = header->slots[i].offset;
+        ok = offset <= ring->size && shm_ring_frame_size(header->width, header->height) <= ring->size - offset;
+    }
+    if (!ok) {
+        puts("Shared memory does not hold a frame ring");
+        munmap(memory, ring->size);
+        *ring = (shm_ring_t) {0};
+        return false;
+    }
+    return true;
+}
+
+// The creator also removes the name, mappings of viewers stay valid until they close
+static void shm_ring_close(shm_ring_t *ring) {
+    if (ring->header != NULL) munmap(ring->header, ring->size);
+    if (ring->owner) shm_unlink(ring->name);
+    *ring = (shm_ring_t) {0};
+}
+
+// Returns the pixels of the next slot to render into, readers see the slot as being written until it is published
+static uint8_t *shm_ring_begin_frame(shm_ring_t *ring) {
+    shm_ring_header_t *header = ring->header;
+    uint64_t frame = atomic_load_explicit(&header->num_frames, memory_order_relaxed);
+    ring->writing_slot = (int) (frame % header->num_slots);
+    shm_ring_slot_t *slot = header->slots + ring->writing_slot;
+    atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_relaxed);
+    // Pixel writes must not become visible before the sequence turned odd
+    atomic_thread_fence(memory_order_release);
+    slot->frame = frame;
+    return shm_ring_pixels(ring, ring->writing_slot);
+}
+
+static void shm_ring_publish_frame(shm_ring_t *ring) {
+    shm_ring_header_t *header = ring->header;
+    shm_ring_slot_t *slot = header->slots + ring->writing_slot;
+    atomic_fetch_add_explicit(&slot->sequence, 1, memory_order_release);
+    atomic_store_explicit(&header->num_frames, slot->frame + 1, memory_order_release);
+    ring->writing_slot = -1;
+}
+
+// Finds the latest published frame, its pixels can be read in place until shm_ring_validate says otherwise
+//@returns false if nothing was published yet or the writer already started overwriting the slot
+static bool shm_ring_acquire(const shm_ring_t *ring, uint64_t *frame, const uint8_t **pixels, uint64_t *sequence) {
+    shm_ring_header_t *header = ring->header;
+    uint64_t num_frames = atomic_load_explicit(&header->num_frames, memory_order_acquire);
+    if (num_frames == 0) return false;
+    int slot_index = (int) ((num_frames - 1) % header->num_slots);
+    const shm_ring_slot_t *slot = header->slots + slot_index;
+    *sequence = atomic_load_explicit(&((shm_ring_slot_t *) slot)->sequence, memory_order_acquire);
+    if (*sequence % 2 != 0) return false;
+    *frame = slot->frame;
+    *pixels = shm_ring_pixels(ring, slot_index);
+    return true;
+}
+
+// True if the slot was not touched by the writer since it was acquired, i.e. what was read is a whole frame
+static bool shm_ring_validate(const shm_ring_t *ring, uint64_t frame, uint64_t sequence) {
+    shm_ring_header_t *header = ring->header;
+    const shm_ring_slot_t *slot = header->slots + frame % header->num_slots;
+    // Pixel reads must complete before the sequence is checked again
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&((shm_ring_slot_t *) slot)->sequence, memory_order_relaxed) == sequence;
+}
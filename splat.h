@@ -0,0 +1,159 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "camera.h"
+#include "jobs.h"
+#include "vec3.h"
+
+#define SPLAT_EMPTY UINT64_MAX
+#define SPLAT_GRAIN 65536
+
+// Each framebuffer word packs the bits of a positive float depth above a 0x00RRGGBB color,
+// positive float bits order like the floats themselves so the closest point has the smallest word
+typedef struct {
+    _Atomic uint64_t *words;
+    int width;
+    int height;
+} splat_framebuffer_t;
+
+typedef struct {
+    splat_framebuffer_t *framebuffer;
+    const camera_t *camera;
+    const camera_region_t *region;
+    const vec3_t *points;
+    const uint32_t *colors;
+} splat_job_t;
+
+static uint32_t splat_pack_color(uint8_t r, uint8_t g, uint8_t b) {
+    return ((uint32_t) r << 16) | ((uint32_t) g << 8) | b;
+}
+
+static bool splat_framebuffer_create(splat_framebuffer_t *framebuffer, int width, int height) {
+    framebuffer->width = width;
+    framebuffer->height = height;
+    framebuffer->words = malloc((size_t) width * height * sizeof(uint64_t));
+    return framebuffer->words != NULL;
+}
+
+static void splat_framebuffer_free(splat_framebuffer_t *framebuffer) {
+    free(framebuffer->words);
+    framebuffer->words = NULL;
+}
+
+static void splat_framebuffer_clear(splat_framebuffer_t *framebuffer) {
+    // All bytes 0xFF is SPLAT_EMPTY, the buffer is not shared with other threads at this point
+    memset((void *) framebuffer->words, 0xFF, (size_t) framebuffer->width * framebuffer->height * sizeof(uint64_t));
+}
+
+static void splat_atomic_min(_Atomic uint64_t *word, uint64_t value) {
+    uint64_t current = atomic_load_explicit(word, memory_order_relaxed);
+    while (value < current &&
+           !atomic_compare_exchange_weak_explicit(word, &current, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static void splat_range(void *context, size_t begin, size_t end) {
+    const splat_job_t *job = context;
+    const camera_t *camera = job->camera;
+    splat_framebuffer_t *framebuffer = job->framebuffer;
+    const camera_region_t *region = job->region;
+    int width = framebuffer->width, height = framebuffer->height;
+    // Inverse of camera_region_ray: NDC x is scaled by the aspect ratio, pixel rows grow downwards,
+    // frame pixels are then moved to the region origin and scaled to output pixels
+    float scale = 0.5f * (float) region->frame_height * region->scale;
+    float offset_x = (0.5f * (float) region->frame_width - (float) region->x) * region->scale;
+    float offset_y = (0.5f * (float) region->frame_height - (float) region->y) * region->scale;
+    for (size_t i = begin; i < end; i++) {
+        vec3_t d = vec3_sub(job->points[i], camera->origin);
+        float z = vec3_dot(d, camera->forward);
+        if (!(z > 0.0f)) continue;
+        float inv_z = 1.0f / z;
+        float x = vec3_dot(d, camera->right) * inv_z * scale + offset_x;
+        float y = -vec3_dot(d, camera->up) * inv_z * scale + offset_y;
+        if (!(x >= 0.0f && x < (float) width && y >= 0.0f && y < (float) height)) continue;
+        size_t pixel = (size_t) y * width + (size_t) x;
+        uint32_t depth_bits;
+        memcpy(&depth_bits, &z, sizeof(depth_bits));
+        splat_atomic_min(framebuffer->words + pixel, ((uint64_t) depth_bits << 32) | job->colors[i]);
+    }
+}
+
+// Projects and depth tests points from all cores, colors are 0x00RRGGBB per point.
+// The framebuffer must have the output size of the region.
+static void splat_points(splat_framebuffer_t *framebuffer, const camera_t *camera, const camera_region_t *region,
+                         const vec3_t *points, const uint32_t *colors, size_t num_points) {
+    splat_job_t job = {framebuffer, camera, region, points, colors};
+    parallel_for(num_points, SPLAT_GRAIN, splat_range, &job);
+}
+
+typedef struct {
+    const splat_framebuffer_t *framebuffer;
+    uint8_t *pixels;
+    bool fill_holes;
+} splat_resolve_job_t;
+
+static float splat_depth(uint64_t word) {
+    uint32_t depth_bits = (uint32_t) (word >> 32);
+    float depth;
+    memcpy(&depth, &depth_bits, sizeof(depth));
+    return depth;
+}
+
+// Rows [begin, end) of the RGB8 output. Hole filling replaces a pixel that is empty or lies clearly behind
+// its 3x3 neighborhood (background seen through gaps between points) with the closest neighbor,
+// as long as enough neighbors are near that depth to be sure the pixel is inside a surface.
+static void splat_resolve_rows(void *context, size_t begin, size_t end) {
+    const splat_resolve_job_t *job = context;
+    const splat_framebuffer_t *framebuffer = job->framebuffer;
+    int width = framebuffer->width, height = framebuffer->height;
+    for (size_t j = begin; j < end; j++) {
+        for (int i = 0; i < width; i++) {
+            uint64_t word = atomic_load_explicit(framebuffer->words + j * width + i, memory_order_relaxed);
+            if (job->fill_holes) {
+                uint64_t closest = SPLAT_EMPTY;
+                for (int dj = -1; dj <= 1; dj++) {
+                    for (int di = -1; di <= 1; di++) {
+                        int x = i + di, y = (int) j + dj;
+                        if ((di == 0 && dj == 0) || x < 0 || y < 0 || x >= width || y >= height) continue;
+                        uint64_t neighbor = atomic_load_explicit(framebuffer->words + (size_t) y * width + x,
+                                                                 memory_order_relaxed);
+                        if (neighbor < closest) closest = neighbor;
+                    }
+                }
+                if (closest != SPLAT_EMPTY) {
+                    float threshold = splat_depth(closest) * 1.05f;
+                    if (word == SPLAT_EMPTY || splat_depth(word) > threshold) {
+                        int num_near = 0;
+                        for (int dj = -1; dj <= 1; dj++) {
+                            for (int di = -1; di <= 1; di++) {
+                                int x = i + di, y = (int) j + dj;
+                                if ((di == 0 && dj == 0) || x < 0 || y < 0 || x >= width || y >= height) continue;
+                                uint64_t neighbor = atomic_load_explicit(
+                                        framebuffer->words + (size_t) y * width + x, memory_order_relaxed);
+                                num_near += neighbor != SPLAT_EMPTY && splat_depth(neighbor) <= threshold;
+                            }
+                        }
+                        if (num_near >= 4) word = closest;
+                    }
+                }
+            }
+            uint8_t *pixel = job->pixels + 3 * (j * width + i);
+            if (word == SPLAT_EMPTY) {
+                pixel[0] = pixel[1] = pixel[2] = 0;
+            } else {
+                pixel[0] = (uint8_t) (word >> 16);
+                pixel[1] = (uint8_t) (word >> 8);
+                pixel[2] = (uint8_t) word;
+            }
+        }
+    }
+}
+
+static void splat_resolve(const splat_framebuffer_t *framebuffer, uint8_t *pixels, bool fill_holes) {
+    splat_resolve_job_t job = {framebuffer, pixels, fill_holes};
+    parallel_for(framebuffer->height, 16, splat_resolve_rows, &job);
+}
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Wall thickness at every welded vertex, the distance a ray travels into the solid before it leaves through the
+// opposite wall. Rays go against the area weighted vertex normal and, with more samples, spread over a cone around
+// it. The median of the sample distances ignores single rays that slip out through a nearby edge or corner.
+
+#define THICKNESS_MAX_SAMPLES 64
+#define THICKNESS_CONE_ANGLE 0.5f
+#define THICKNESS_GRAIN 1024
+
+typedef struct {
+    const mesh_t *mesh;
+    const bvh_t *bvh;
+    const vec3_t *normals;
+    // Sample directions around +Z, turned onto each inward normal
+    vec3_t directions[THICKNESS_MAX_SAMPLES];
+    int num_samples;
+    // Flips the normals when the winding makes them point inward
+    float orientation;
+    float epsilon;
+    float *thickness;
+} thickness_range_t;
+
+// Sum of the signed volumes of the tetrahedra between the origin and each triangle, negative when the triangles are
+// wound so that their normals point into the solid
+static double mesh_signed_volume(const mesh_t *mesh) {
+    double volume = 0.0;
+    for (size_t i = 0; i < mesh->num_tris; i++) {
+        vec3_t a, b, c;
+        mesh_triangle(mesh, i, &a, &b, &c);
+        volume += vec3_dot(a, vec3_cross(b, c));
+    }
+    return volume / 6.0;
+}
+
+// Spreads directions evenly over a cone around +Z along a Fibonacci spiral, the first one is the axis
+static void thickness_cone_directions(vec3_t *directions, int num_samples, float cone_angle) {
+    directions[0] = (vec3_t) {0, 0, 1};
+    float golden_angle = 2.39996323f;
+    float cos_cone = cosf(cone_angle);
+    for (int k = 1; k < num_samples; k++) {
+        float cos_theta = 1.0f - ((float) k - 0.5f) / (float) (num_samples - 1) * (1.0f - cos_cone);
+        float sin_theta = sqrtf(maxf(0.0f, 1.0f - cos_theta * cos_theta));
+        float phi = golden_angle * (float) k;
+        directions[k] = (vec3_t) {sin_theta * cosf(phi), sin_theta * sinf(phi), cos_theta};
+    }
+}
+
+// Turns a direction around +Z into the same direction around axis
+static vec3_t thickness_rotate(vec3_t axis, vec3_t direction) {
+    // Branchless orthonormal basis, Duff et al. 2017
+    float sign = copysignf(1.0f, axis.z);
+    float a = -1.0f / (sign + axis.z);
+    float b = axis.x * axis.y * a;
+    vec3_t tangent = {1.0f + sign * axis.x * axis.x * a, sign * b, -sign * axis.x};
+    vec3_t bitangent = {b, sign + axis.y * axis.y * a, -axis.y};
+    return vec3_add(vec3_add(vec3_scale(tangent, direction.x), vec3_scale(bitangent, direction.y)),
+                    vec3_scale(axis, direction.z));
+}
+
+static void thickness_range(void *context, size_t begin, size_t end) {
+    const thickness_range_t *job = context;
+    float distances[THICKNESS_MAX_SAMPLES];
+    for (size_t i = begin; i < end; i++) {
+        vec3_t position = job->mesh->unique_vertices[i];
+        vec3_t inward = vec3_scale(job->normals[i], -job->orientation);
+        int num_hits = 0;
+        for (int k = 0; k < job->num_samples; k++) {
+            vec3_t direction = k == 0 ? inward : thickness_rotate(inward, job->directions[k]);
+            // Starts off the vertex so the ray does not hit the triangles around it
+            ray_t ray = {vec3_add(position, vec3_scale(direction, job->epsilon)), direction};
+            ray_hit_t hit = {INFINITY, 0, 0, 0};
+            if (!bvh_intersect(job->bvh, job->mesh, ray, &hit)) continue;
+            // Insertion sort, there are only a few samples
+            int j = num_hits++;
+            for (; j > 0 && distances[j - 1] > hit.t; j--) distances[j] = distances[j - 1];
+            distances[j] = hit.t + job->epsilon;
+        }
+        // Rays that escape an open mesh do not count, vertices where all of them escape have no thickness
+        job->thickness[i] = num_hits > 0 ? distances[num_hits / 2] : INFINITY;
+    }
+}
+
+// Casts num_samples rays per vertex in parallel, thickness has one entry per unique vertex
+//@param num_samples 1 for the inward normal only, up to THICKNESS_MAX_SAMPLES spread over THICKNESS_CONE_ANGLE
+//@returns false if out of memory
+static bool mesh_wall_thickness(const mesh_t *mesh, const bvh_t *bvh, int num_samples, float *thickness) {
+    vec3_t *normals = malloc((mesh->num_unique_vertices > 0 ? mesh->num_unique_vertices : 1) * sizeof(vec3_t));
+    if (normals == NULL) return false;
+    mesh_vertex_normals(mesh, normals);
+    thickness_range_t job = {
+            .mesh = mesh,
+            .bvh = bvh,
+            .normals = normals,
+            .num_samples = num_samples < 1 ? 1 : num_samples > THICKNESS_MAX_SAMPLES ? THICKNESS_MAX_SAMPLES
+                                                                                     : num_samples,
+            .orientation = mesh_signed_volume(mesh) < 0.0 ? -1.0f : 1.0f,
+            .epsilon = 1e-5f * vec3_length(vec3_sub(mesh->bounds.max, mesh->bounds.min)),
+            .thickness = thickness,
+    };
+    thickness_cone_directions(job.directions, job.num_samples, THICKNESS_CONE_ANGLE);
+    parallel_for(mesh->num_unique_vertices, THICKNESS_GRAIN, thickness_range, &job);
+    free(normals);
+    return true;
+}
+
+// Red below half the limit, orange to yellow up to the limit, fading to white at twice the limit.
+// Vertices without a thickness are blue.
+static vec3_t thickness_color(float thickness, float limit) {
+    if (isinf(thickness)) return (vec3_t) {0.3f, 0.5f, 1.0f};
+    float ratio = thickness / limit;
+    if (ratio < 0.5f) return (vec3_t) {1.0f, 0.1f, 0.1f};
+    if (ratio < 1.0f) return (vec3_t) {1.0f, 0.1f + 1.8f * (ratio - 0.5f), 0.1f};
+    float white = clampf(ratio - 1.0f, 0.0f, 1.0f);
+    return (vec3_t) {1.0f, 1.0f, white};
+}
+
+// Color at a hit, blended from the colors of the three vertices
+static vec3_t thickness_color_at(const mesh_t *mesh, const float *thickness, float limit, ray_hit_t hit) {
+    const uint32_t *tri = mesh->indices + 3 * (size_t) hit.triangle_index;
+    vec3_t a = thickness_color(thickness[tri[0]], limit);
+    vec3_t b = thickness_color(thickness[tri[1]], limit);
+    vec3_t c = thickness_color(thickness[tri[2]], limit);
+    return vec3_add(vec3_add(vec3_scale(a, 1.0f - hit.u - hit.v), vec3_scale(b, hit.u)), vec3_scale(c, hit.v));
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <time.h>
+
+// Monotonic wall clock time in seconds
+static double timing_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
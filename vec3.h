@@ -0,0 +1,166 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+
+typedef struct {
+    float x;
+    float y;
+    float z;
+} vec3_t;
+
+typedef struct {
+    vec3_t origin;
+    vec3_t direction;
+} ray_t;
+
+typedef struct {
+    vec3_t min;
+    vec3_t max;
+} aabb_t;
+
+static float vec3_length_squared(vec3_t v) {
+    return v.x * v.x + v.y * v.y + v.z * v.z;
+}
+
+static float vec3_length(vec3_t v) {
+    return sqrtf(vec3_length_squared(v));
+}
+
+static vec3_t vec3_normalized(vec3_t v) {
+    float l = vec3_length(v);
+    return (vec3_t) {v.x / l, v.y / l, v.z / l};
+}
+
+static vec3_t vec3_scale(vec3_t v, float scale) {
+    return (vec3_t) {v.x * scale, v.y * scale, v.z * scale};
+}
+
+static vec3_t vec3_add(vec3_t a, vec3_t b) {
+    return (vec3_t) {a.x + b.x, a.y + b.y, a.z + b.z};
+}
+
+static vec3_t vec3_sub(vec3_t a, vec3_t b) {
+    return (vec3_t) {a.x - b.x, a.y - b.y, a.z - b.z};
+}
+
+static float vec3_dot(vec3_t a, vec3_t b) {
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+static vec3_t vec3_cross(vec3_t a, vec3_t b) {
+    return (vec3_t) {a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+// Unlike fminf/fmaxf these compile to single min/max instructions
+static float minf(float a, float b) {
+    return a < b ? a : b;
+}
+
+static float maxf(float a, float b) {
+    return a > b ? a : b;
+}
+
+static vec3_t vec3_min(vec3_t a, vec3_t b) {
+    return (vec3_t) {minf(a.x, b.x), minf(a.y, b.y), minf(a.z, b.z)};
+}
+
+static vec3_t vec3_max(vec3_t a, vec3_t b) {
+    return (vec3_t) {maxf(a.x, b.x), maxf(a.y, b.y), maxf(a.z, b.z)};
+}
+
+static float vec3_component(vec3_t v, int axis) {
+    return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+static float clampf(float value, float min, float max) {
+    if (value < min) return min;
+    if (value > max) return max;
+    return value;
+}
+
+static aabb_t aabb_empty(void) {
+    return (aabb_t) {{INFINITY, INFINITY, INFINITY},
+                     {-INFINITY, -INFINITY, -INFINITY}};
+}
+
+static aabb_t aabb_grow(aabb_t box, vec3_t point) {
+    return (aabb_t) {vec3_min(box.min, point), vec3_max(box.max, point)};
+}
+
+static aabb_t aabb_union(aabb_t a, aabb_t b) {
+    return (aabb_t) {vec3_min(a.min, b.min), vec3_max(a.max, b.max)};
+}
+
+// Bounds of an array of points. With SSE four points are three registers, lanes hold x y z x, y z x y and z x y z
+// and are only sorted out into per axis minima and maxima once at the end.
+static aabb_t aabb_of_points(const vec3_t *points, size_t count) {
+    aabb_t box = aabb_empty();
+    size_t i = 0;
+#ifdef __SSE__
+    if (count >= 4) {
+        const float *floats = (const float *) points;
+        __m128 min0 = _mm_loadu_ps(floats), min1 = _mm_loadu_ps(floats + 4), min2 = _mm_loadu_ps(floats + 8);
+        __m128 max0 = min0, max1 = min1, max2 = min2;
+        for (i = 4; i + 4 <= count; i += 4) {
+            __m128 a = _mm_loadu_ps(floats + 3 * i), b = _mm_loadu_ps(floats + 3 * i + 4);
+            __m128 c = _mm_loadu_ps(floats + 3 * i + 8);
+            min0 = _mm_min_ps(min0, a);
+            min1 = _mm_min_ps(min1, b);
+            min2 = _mm_min_ps(min2, c);
+            max0 = _mm_max_ps(max0, a);
+            max1 = _mm_max_ps(max1, b);
+            max2 = _mm_max_ps(max2, c);
+        }
+        float lo[12], hi[12];
+        _mm_storeu_ps(lo, min0);
+        _mm_storeu_ps(lo + 4, min1);
+        _mm_storeu_ps(lo + 8, min2);
+        _mm_storeu_ps(hi, max0);
+        _mm_storeu_ps(hi + 4, max1);
+        _mm_storeu_ps(hi + 8, max2);
+        for (int k = 0; k < 4; k++) {
+            box.min = vec3_min(box.min, (vec3_t) {lo[3 * k], lo[3 * k + 1], lo[3 * k + 2]});
+            box.max = vec3_max(box.max, (vec3_t) {hi[3 * k], hi[3 * k + 1], hi[3 * k + 2]});
+        }
+    }
+#endif
+    for (; i < count; i++) box = aabb_grow(box, points[i]);
+    return box;
+}
+
+static float aabb_surface_area(aabb_t box) {
+    vec3_t e = vec3_sub(box.max, box.min);
+    if (e.x < 0 || e.y < 0 || e.z < 0) return 0.0f;
+    return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+}
+
+static vec3_t aabb_center(aabb_t box) {
+    return vec3_scale(vec3_add(box.min, box.max), 0.5f);
+}
+
+// Slab test, inv_direction is 1 / ray.direction per component
+//@returns true if [t_near, t_far] overlaps [0, t_max]
+static inline bool ray_aabb_intersection(vec3_t origin, vec3_t inv_direction, aabb_t box, float t_max, float *t_near,
+                                         float *t_far) {
+    float tx1 = (box.min.x - origin.x) * inv_direction.x;
+    float tx2 = (box.max.x - origin.x) * inv_direction.x;
+    float ty1 = (box.min.y - origin.y) * inv_direction.y;
+    float ty2 = (box.max.y - origin.y) * inv_direction.y;
+    float tz1 = (box.min.z - origin.z) * inv_direction.z;
+    float tz2 = (box.max.z - origin.z) * inv_direction.z;
+    float t0 = maxf(maxf(minf(tx1, tx2), minf(ty1, ty2)), maxf(minf(tz1, tz2), 0.0f));
+    float t1 = minf(minf(maxf(tx1, tx2), maxf(ty1, ty2)), minf(maxf(tz1, tz2), t_max));
+    *t_near = t0;
+    *t_far = t1;
+    return t0 <= t1;
+}
+
+static vec3_t vec3_inverse(vec3_t v) {
+    return (vec3_t) {1.0f / v.x, 1.0f / v.y, 1.0f / v.z};
+}
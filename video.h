@@ -0,0 +1,138 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "jobs.h"
+
+// Streams RGB8 frames to a file or pipe as YUV4MPEG2 (4:2:0, full range BT.601) or as raw RGB24.
+// Each frame is converted and written by a job, so the next frame renders while the previous one goes out.
+
+typedef enum {
+    VIDEO_FORMAT_Y4M,
+    VIDEO_FORMAT_RGB,
+} video_format_t;
+
+typedef struct {
+    FILE *file;
+    video_format_t format;
+    int width;
+    int height;
+    // Y, Cb and Cr planes of the frame being written
+    uint8_t *planes;
+    size_t planes_size;
+    const uint8_t *pixels;
+    job_t *write_job;
+    bool failed;
+} video_writer_t;
+
+static uint8_t video_clamp_byte(float x) {
+    return (uint8_t) (x < 0.0f ? 0.0f : x > 255.0f ? 255.0f : x + 0.5f);
+}
+
+static void video_write_frame(void *data) {
+    video_writer_t *writer = data;
+    int width = writer->width, height = writer->height;
+    if (writer->format == VIDEO_FORMAT_RGB) {
+        writer->failed |= fwrite(writer->pixels, 3, (size_t) width * height, writer->file) != (size_t) width * height;
+        return;
+    }
+
+    int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+    uint8_t *y_plane = writer->planes;
+    uint8_t *cb_plane = y_plane + (size_t) width * height;
+    uint8_t *cr_plane = cb_plane + (size_t) chroma_width * chroma_height;
+    for (size_t p = 0; p < (size_t) width * height; p++) {
+        const uint8_t *rgb = writer->pixels + 3 * p;
+        y_plane[p] = video_clamp_byte(0.299f * rgb[0] + 0.587f * rgb[1] + 0.114f * rgb[2]);
+    }
+    // Chroma of the average color of each 2x2 block, edge pixels are repeated for odd sizes
+    for (int j = 0; j < chroma_height; j++) {
+        for (int i = 0; i < chroma_width; i++) {
+            float r = 0.0f, g = 0.0f, b = 0.0f;
+            for (int dj = 0; dj < 2; dj++) {
+                for (int di = 0; di < 2; di++) {
+                    int x = 2 * i + di < width ? 2 * i + di : width - 1;
+                    int y = 2 * j + dj < height ? 2 * j + dj : height - 1;
+                    const uint8_t *rgb = writer->pixels + 3 * ((size_t) y * width + x);
+                    r += rgb[0];
+                    g += rgb[1];
+                    b += rgb[2];
+                }
+            }
+            r *= 0.25f;
+            g *= 0.25f;
+            b *= 0.25f;
+            size_t c = (size_t) j * chroma_width + i;
+            cb_plane[c] = video_clamp_byte(128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+            cr_plane[c] = video_clamp_byte(128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+        }
+    }
+    writer->failed |= fputs("FRAME\n", writer->file) == EOF;
+    writer->failed |= fwrite(writer->planes, 1, writer->planes_size, writer->file) != writer->planes_size;
+}
+
+// "-" streams Y4M to standard output, from then on standard output goes to standard error
+// so log messages cannot end up in the video. Files ending in .rgb get raw RGB24, anything else Y4M.
+static bool video_writer_open(video_writer_t *writer, const char *filepath, int width, int height, int fps) {
+    *writer = (video_writer_t) {0};
+    writer->width = width;
+    writer->height = height;
+    const char *extension = strrchr(filepath, '.');
+    writer->format = extension != NULL && strcmp(extension, ".rgb") == 0 ? VIDEO_FORMAT_RGB : VIDEO_FORMAT_Y4M;
+    if (strcmp(filepath, "-") == 0) {
+        fflush(stdout);
+        int video_fd = dup(STDOUT_FILENO);
+        writer->file = video_fd >= 0 ? fdopen(video_fd, "wb") : NULL;
+        if (writer->file != NULL) dup2(STDERR_FILENO, STDOUT_FILENO);
+    } else {
+        writer->file = fopen(filepath, "wb");
+    }
+    if (writer->file == NULL) {
+        puts("Failed to open video output");
+        return false;
+    }
+
+    if (writer->format == VIDEO_FORMAT_Y4M) {
+        int chroma_width = (width + 1) / 2, chroma_height = (height + 1) / 2;
+        writer->planes_size = (size_t) width * height + 2 * (size_t) chroma_width * chroma_height;
+        writer->planes = malloc(writer->planes_size);
+        if (writer->planes == NULL) {
+            puts("Failed to allocate memory");
+            fclose(writer->file);
+            return false;
+        }
+        fprintf(writer->file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XYSCSS=420JPEG\n", width, height, fps);
+    }
+    return true;
+}
+
+// Hands a frame over to be written, pixels must stay untouched until the next call or video_writer_close.
+// Waits for the previous frame first, frames go out in order.
+static void video_writer_submit(video_writer_t *writer, const uint8_t *pixels) {
+    job_wait(writer->write_job);
+    job_release(writer->write_job);
+    writer->pixels = pixels;
+    writer->write_job = job_create(video_write_frame, writer);
+    if (writer->write_job == NULL) {
+        video_write_frame(writer);
+    } else {
+        job_submit(writer->write_job);
+    }
+}
+
+//@returns false if any frame failed to be written
+static bool video_writer_close(video_writer_t *writer) {
+    job_wait(writer->write_job);
+    job_release(writer->write_job);
+    bool ok = !writer->failed;
+    if (writer->file != NULL) ok &= fclose(writer->file) == 0;
+    free(writer->planes);
+    *writer = (video_writer_t) {0};
+    if (!ok) puts("Failed to write video");
+    return ok;
+}
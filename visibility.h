@@ -0,0 +1,166 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bvh.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Line of sight between every source and every target point, one bit per pair. Pairs are traced in tiles of
+// VISIBILITY_TILE_SOURCES sources by 64 targets: rays of a tile start at a few points and end at a few, so they
+// visit mostly the same BVH nodes, and each source row of a tile is one 64 bit word that is filled in a register
+// and stored once. Occlusion stops at the first triangle found between the points.
+
+#define VISIBILITY_TILE_SOURCES 8
+#define VISIBILITY_TILE_TARGETS 64
+
+typedef struct {
+    // Row per source, bit t % 64 of word t / 64 is set if target t is visible
+    uint64_t *bits;
+    size_t num_sources;
+    size_t num_targets;
+    size_t words_per_row;
+} visibility_matrix_t;
+
+typedef struct {
+    visibility_matrix_t *matrix;
+    const mesh_t *mesh;
+    const bvh_t *bvh;
+    const vec3_t *sources;
+    const vec3_t *targets;
+    size_t num_tiles_x;
+    // Both ends are pulled in, points on a surface do not occlude themselves
+    float epsilon;
+} visibility_job_t;
+
+static void visibility_matrix_free(visibility_matrix_t *matrix) {
+    free(matrix->bits);
+    *matrix = (visibility_matrix_t) {0};
+}
+
+static bool visibility_matrix_get(const visibility_matrix_t *matrix, size_t source, size_t target) {
+    return (matrix->bits[source * matrix->words_per_row + target / 64] >> (target % 64)) & 1;
+}
+
+static size_t visibility_matrix_count(const visibility_matrix_t *matrix) {
+    size_t count = 0;
+    for (size_t i = 0; i < matrix->num_sources * matrix->words_per_row; i++) {
+        count += (size_t) __builtin_popcountll(matrix->bits[i]);
+    }
+    return count;
+}
+
+static void visibility_tiles(void *context, size_t begin, size_t end) {
+    const visibility_job_t *job = context;
+    visibility_matrix_t *matrix = job->matrix;
+    for (size_t tile = begin; tile < end; tile++) {
+        size_t word = tile % job->num_tiles_x;
+        size_t first_source = tile / job->num_tiles_x * VISIBILITY_TILE_SOURCES;
+        size_t first_target = word * VISIBILITY_TILE_TARGETS;
+        size_t end_source = first_source + VISIBILITY_TILE_SOURCES < matrix->num_sources
+                                    ? first_source + VISIBILITY_TILE_SOURCES
+                                    : matrix->num_sources;
+        size_t end_target = first_target + VISIBILITY_TILE_TARGETS < matrix->num_targets
+                                    ? first_target + VISIBILITY_TILE_TARGETS
+                                    : matrix->num_targets;
+        for (size_t s = first_source; s < end_source; s++) {
+            vec3_t source = job->sources[s];
+            uint64_t bits = 0;
+            for (size_t t = first_target; t < end_target; t++) {
+                vec3_t to_target = vec3_sub(job->targets[t], source);
+                float distance = vec3_length(to_target);
+                bool visible = true;
+                if (distance > 2.0f * job->epsilon) {
+                    vec3_t direction = vec3_scale(to_target, 1.0f / distance);
+                    ray_t ray = {vec3_add(source, vec3_scale(direction, job->epsilon)), direction};
+                    visible = !bvh_occluded(job->bvh, job->mesh, ray, distance - 2.0f * job->epsilon);
+                }
+                bits |= (uint64_t) visible << (t - first_target);
+            }
+            matrix->bits[s * matrix->words_per_row + word] = bits;
+        }
+    }
+}
+
+// Traces all num_sources * num_targets pairs in parallel on the job system
+//@returns false if out of memory
+static bool visibility_matrix_compute(visibility_matrix_t *matrix, const mesh_t *mesh, const bvh_t *bvh,
+                                      const vec3_t *sources, size_t num_sources, const vec3_t *targets,
+                                      size_t num_targets) {
+    *matrix = (visibility_matrix_t) {
+            .num_sources = num_sources,
+            .num_targets = num_targets,
+            .words_per_row = (num_targets + 63) / 64,
+    };
+    matrix->bits = calloc(num_sources * matrix->words_per_row + 1, sizeof(uint64_t));
+    if (matrix->bits == NULL) return false;
+    visibility_job_t job = {
+            .matrix = matrix,
+            .mesh = mesh,
+            .bvh = bvh,
+            .sources = sources,
+            .targets = targets,
+            .num_tiles_x = matrix->words_per_row,
+            .epsilon = 1e-5f * vec3_length(vec3_sub(mesh->bounds.max, mesh->bounds.min)),
+    };
+    size_t num_tiles_y = (num_sources + VISIBILITY_TILE_SOURCES - 1) / VISIBILITY_TILE_SOURCES;
+    parallel_for(job.num_tiles_x * num_tiles_y, 1, visibility_tiles, &job);
+    return true;
+}
+
+// Reads points as whitespace separated "x y z" triples, e.g. one per line
+//@returns false if the file could not be read or holds no points
+static bool visibility_read_points(const char *filepath, vec3_t **points, size_t *num_points) {
+    FILE *file = fopen(filepath, "r");
+    if (file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    size_t capacity = 1024;
+    *points = malloc(capacity * sizeof(vec3_t));
+    *num_points = 0;
+    vec3_t point;
+    while (*points != NULL && fscanf(file, "%f %f %f", &point.x, &point.y, &point.z) == 3) {
+        if (*num_points == capacity) {
+            capacity *= 2;
+            vec3_t *grown = realloc(*points, capacity * sizeof(vec3_t));
+            if (grown == NULL) free(*points);
+            *points = grown;
+            if (grown == NULL) break;
+        }
+        (*points)[(*num_points)++] = point;
+    }
+    bool ok = *points != NULL && !ferror(file) && feof(file) && *num_points > 0;
+    fclose(file);
+    if (!ok) {
+        puts("Failed to read points");
+        free(*points);
+        *points = NULL;
+        return false;
+    }
+    return true;
+}
+
+// One line per source with a '1' for every visible target and a '0' for every hidden one
+static bool visibility_matrix_write(const visibility_matrix_t *matrix, const char *filepath) {
+    FILE *file = fopen(filepath, "w");
+    if (file == NULL) {
+        puts("Failed to open file");
+        return false;
+    }
+    char *line = malloc(matrix->num_targets + 2);
+    bool ok = line != NULL;
+    for (size_t s = 0; ok && s < matrix->num_sources; s++) {
+        for (size_t t = 0; t < matrix->num_targets; t++) line[t] = visibility_matrix_get(matrix, s, t) ? '1' : '0';
+        line[matrix->num_targets] = '\n';
+        ok = fwrite(line, 1, matrix->num_targets + 1, file) == matrix->num_targets + 1;
+    }
+    free(line);
+    ok &= fclose(file) == 0;
+    if (!ok) puts("Failed to write visibility matrix");
+    return ok;
+}